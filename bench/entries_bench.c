@@ -0,0 +1,180 @@
+// Microbenchmark of the entry table against the linked list it replaced.
+// Usage: entries_bench [number of entries]
+// Both build the same tree of entries (directories of ENTRIES_PER_DIR entries, with
+// extra metadata on some files, as load_entries copies it), then list them, delete
+// every fourth directory with its contents and free what is left
+#include "common.h"
+#include "myz.h"
+#include "entries.h"
+#include "ADTList.h"
+#include <time.h>
+
+#define DEFAULT_ENTRIES 200000
+#define ENTRIES_PER_DIR 100
+#define EXTRA_BYTES 64
+
+// Time of each phase, in milliseconds
+typedef struct {
+    double create;
+    double list;
+    double delete;
+    double free;
+    unsigned long long checksum;    // Keeps the listing from being optimized away
+} BenchResult;
+
+// Function to get the current time in milliseconds
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// Function to fill the i-th entry of the tree, but for its path, which is written to path
+static void fill_entry(MyzNode *node, char *path, size_t i) {
+    size_t dir = i / ENTRIES_PER_DIR;
+    if (i % ENTRIES_PER_DIR == 0) {
+        snprintf(path, MAX_PATH_LEN, "root/d%zu", dir);
+        node->type = MYZ_NODE_TYPE_DIR;
+        node->dirContents = ENTRIES_PER_DIR - 1;
+    } else {
+        snprintf(path, MAX_PATH_LEN, "root/d%zu/f%zu", dir, i);
+        node->type = MYZ_NODE_TYPE_FILE;
+        node->dirContents = -1;
+    }
+    node->stat.st_size = i;
+}
+
+// Function to check if an entry is in a deleted directory: every fourth one
+static bool entry_deleted(const MyzNode *node) {
+    size_t dir = strtoul(node->path + strlen("root/d"), NULL, 10);
+    return dir % 4 == 0;
+}
+
+// Function to add up what a listing reads of an entry
+static unsigned long long entry_checksum(const MyzNode *node) {
+    return node->stat.st_size + strlen(node->path) + node->extra_size;
+}
+
+static void destroy_entry(void *value) {
+    MyzNode *entry = value;
+    free(entry->extra);
+    free(entry);
+}
+
+// Function to run the phases on a list of separately allocated nodes
+static BenchResult bench_list(size_t count) {
+    BenchResult result = {0, 0, 0, 0, 0};
+    unsigned char extra[EXTRA_BYTES] = {0};
+
+    double start = now_ms();
+    List list = list_create(NULL);
+    for (size_t i = 0; i < count; i++) {
+        // The path is allocated with its node
+        char path[MAX_PATH_LEN];
+        MyzNode entry;
+        memset(&entry, 0, sizeof(MyzNode));
+        fill_entry(&entry, path, i);
+        size_t length = strlen(path) + 1;
+        MyzNode *node = malloc(sizeof(MyzNode) + length);
+        *node = entry;
+        node->path = memcpy(node + 1, path, length);
+        node->name = entries_name(node->path);
+        if (i % 4 == 1) {
+            node->extra = malloc(EXTRA_BYTES);
+            memcpy(node->extra, extra, EXTRA_BYTES);
+            node->extra_size = EXTRA_BYTES;
+        }
+        list_insert_after(list, list_last(list), node);
+    }
+    result.create = now_ms() - start;
+
+    start = now_ms();
+    for (ListNode node = list_first(list); node != NULL; node = list_next(node))
+        result.checksum += entry_checksum(list_value(node));
+    result.list = now_ms() - start;
+
+    start = now_ms();
+    ListNode node = list_first(list);
+    ListNode prev = NULL;
+    while (node != NULL) {
+        MyzNode *entry = list_value(node);
+        if (entry_deleted(entry)) {
+            node = list_next(node);
+            list_remove_after(list, prev);
+            destroy_entry(entry);
+        } else {
+            prev = node;
+            node = list_next(node);
+        }
+    }
+    result.delete = now_ms() - start;
+
+    start = now_ms();
+    for (node = list_first(list); node != NULL; node = list_next(node))
+        destroy_entry(list_value(node));
+    list_destroy(list);
+    result.free = now_ms() - start;
+    return result;
+}
+
+// Function to run the phases on an entry table
+static BenchResult bench_table(size_t count) {
+    BenchResult result = {0, 0, 0, 0, 0};
+    unsigned char extra[EXTRA_BYTES] = {0};
+
+    double start = now_ms();
+    EntryTable table;
+    entries_init(&table);
+    for (size_t i = 0; i < count; i++) {
+        MyzNode *node = entries_add(&table);
+        char path[MAX_PATH_LEN];
+        fill_entry(node, path, i);
+        entries_set_path(&table, node, path);
+        if (i % 4 == 1)
+            entries_set_extra(&table, node, extra, EXTRA_BYTES);
+    }
+    result.create = now_ms() - start;
+
+    start = now_ms();
+    for (size_t i = 0; i < table.count; i++)
+        result.checksum += entry_checksum(&table.entries[i]);
+    result.list = now_ms() - start;
+
+    start = now_ms();
+    bool *removed = calloc(table.count, sizeof(bool));
+    for (size_t i = 0; i < table.count; i++)
+        removed[i] = entry_deleted(&table.entries[i]);
+    entries_compact(&table, removed);
+    free(removed);
+    result.delete = now_ms() - start;
+
+    start = now_ms();
+    entries_free(&table);
+    result.free = now_ms() - start;
+    return result;
+}
+
+static void print_result(const char *name, BenchResult result) {
+    printf("%-12s %10.2f %10.2f %10.2f %10.2f\n", name, result.create, result.list, result.delete, result.free);
+}
+
+int main(int argc, char **argv) {
+    size_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_ENTRIES;
+    if (count == 0) {
+        fprintf(stderr, "Usage: %s [number of entries]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%zu entries of %zu bytes, times in ms\n", count, sizeof(MyzNode));
+    printf("%-12s %10s %10s %10s %10s\n", "", "create", "list", "delete", "free");
+    BenchResult list = bench_list(count);
+    print_result("ADTList", list);
+    BenchResult table = bench_table(count);
+    print_result("EntryTable", table);
+
+    if (list.checksum != table.checksum) {
+        fprintf(stderr, "The listings differ\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "common.h"
+#include "extra.h"
+
+#define CHECKSUM_MAP_MIN (256 * 1024)       // Smaller ranges are read instead of mapped
+#define CHECKSUM_MAP_SIZE (64 * 1024 * 1024)    // Bytes mapped at a time
+#define CHECKSUM_BUFFER_SIZE (64 * 1024)    // Bytes read at a time from small ranges
+
+// Continue the CRC32C (Castagnoli) of some data with size more bytes. Start with a crc
+// of 0. Uses the SSE 4.2 crc32 instruction when the CPU has it
+uint32_t crc32c(uint32_t crc, const void *data, size_t size);
+
+// Get the CRC32C of two pieces of data one after the other from the CRC32C of each,
+// given the length of the second one
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, off_t length2);
+
+// Compute the CRC32C of length bytes at offset of a file, mapping large ranges instead
+// of copying them
+int checksum_range(int fd, off_t offset, off_t length, uint32_t *crc);
+
+// Compute the CRC32C of the stored data of a file: the whole file, or the concatenation
+// of its data extents when extents is not NULL
+int checksum_file(int fd, const MyzExtent *extents, uint32_t count, off_t size, uint32_t *crc);
+
+// Store the checksum of the size bytes of original data of an entry as an extra record
+int checksum_store(MyzNode *entry, uint32_t crc, uint64_t size);
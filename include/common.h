@@ -1,6 +1,6 @@
 #pragma once
 
-#define _XOPEN_SOURCE 500 // For lstat
+#define _GNU_SOURCE // For lstat, copy_file_range and splice
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -30,7 +30,19 @@ typedef struct {
     bool print;
     bool query;
     bool gzip;
+    bool verbose;
+    bool dedup;
+    bool test;
+    bool align;             // Start raw file data at filesystem blocks
+    bool uring;             // Batch the I/O of small members through io_uring
+    bool toStdout;          // Write the extracted files to the standard output
+    bool vacuum;            // Compact the archive, dropping the data no entry uses
+    bool punchHoles;        // Free the data of deleted entries in the archive file
+    bool noChecksum;        // Do not checksum the files whose data is copied in the kernel
     char *archiveFile;
+    char *fromFile;         // File with more paths or patterns to extract, one per line
     char **fileList;
     int numFiles;
+    int jobs;               // Threads that extract files
+    int queueDepth;         // Submission queue depth of the io_uring backend
 } CommandLineArgs;
\ No newline at end of file
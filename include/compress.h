@@ -0,0 +1,59 @@
+#pragma once
+
+#include "common.h"
+#include "myz.h"
+
+#define COMPRESS_CHUNK_SIZE (1024 * 1024)   // Bytes of source data per compression job
+#define COMPRESS_JOBS_PER_THREAD 4          // Jobs in flight per worker thread
+
+typedef struct compress_pool* CompressPool;
+
+// Create a pool of worker threads that compress file data into the archive.
+// Compressed bytes are written to archiveFd in submission order and *archiveOffset
+// is advanced by the number of bytes written. In framed mode every gzip member is
+// preceded by its 32-bit little-endian length and each entry ends with a zero length.
+// Returns NULL if the pool cannot be set up
+CompressPool compress_pool_create(int numThreads, int archiveFd, off_t *archiveOffset, bool framed);
+
+// Queue the data of a file entry for compression. The pool takes ownership of fileFd
+// and sets the data_offset and data_size of the entry once its data is written.
+int compress_pool_submit(CompressPool pool, MyzNode *entry, int fileFd);
+
+// Queue raw bytes to be written to the archive after the jobs queued so far
+int compress_pool_write(CompressPool pool, const void *data, size_t size);
+
+// Wait until every queued job has been written to the archive
+int compress_pool_drain(CompressPool pool);
+
+// Stop the worker threads and free the pool
+void compress_pool_destroy(CompressPool pool);
+
+// Number of worker threads to use by default
+int compress_default_threads(void);
+
+#define DECOMPRESS_BUFFER_SIZE (1024 * 1024)  // Size of the inflate input and output buffers
+
+// Inflate size bytes of gzip data at offset of archiveFd into outFd.
+// Concatenated gzip members are decompressed one after the other.
+int decompress_data(int archiveFd, off_t offset, off_t size, int outFd);
+
+// Inflate framed gzip members read from the current position of inFd into outFd,
+// up to and including the zero length frame. An outFd of -1 skips the data.
+// The data of a sparse entry is written at the place of its extents, or with inOrder
+// at the current position, after the zeros of each hole (see sparse_write)
+int decompress_frames(int inFd, int outFd, const MyzNode *entry, bool inOrder);
+
+// Inflate length bytes of the original data of a block compressed entry, starting
+// at offset, into outFd. Only the blocks that hold the range are read.
+// For sparse entries the range is taken from the stored data extents, and written
+// in order with the holes before them as zeros (see sparse_write)
+int decompress_range(int archiveFd, const MyzNode *entry, off_t offset, off_t length, int outFd);
+
+// Inflate the blocks of an entry on numThreads threads, writing each block at its
+// place in outFd, which must be a regular file
+int decompress_blocks(int archiveFd, const MyzNode *entry, int outFd, int numThreads);
+
+// Inflate count blocks of an entry from block first without writing them anywhere,
+// and compute the CRC32C of their data and its length
+int decompress_checksum(int archiveFd, const MyzNode *entry, uint32_t first, uint32_t count,
+                        uint32_t *crc, uint64_t *length);
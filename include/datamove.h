@@ -0,0 +1,58 @@
+#pragma once
+
+#include "common.h"
+#include <sys/uio.h>
+
+#define MOVE_BUFFER_SIZE (1024 * 1024)  // Size of the buffer used by the fallback copy
+#define MOVE_PIPE_SIZE (1024 * 1024)    // Requested pipe capacity for splice
+
+// Ways of moving data between two file descriptors, fastest first
+typedef enum {
+    MOVE_CLONE,             // Extents shared with FICLONERANGE, for block aligned data
+    MOVE_COPY_FILE_RANGE,   // In-kernel copy, may share extents on the filesystem
+    MOVE_SENDFILE,          // In-kernel copy through the page cache
+    MOVE_SPLICE,            // In-kernel copy through a pipe
+    MOVE_BUFFER,            // read/write through a user space buffer
+    MOVE_URING,             // Small members batched through io_uring by the archive code
+    MOVE_NUM_PATHS
+} move_path;
+
+// Copy size bytes at inOffset of inFd to the current position of outFd.
+// An inOffset of -1 reads from the current position, e.g. of a pipe.
+// When both offsets are block aligned, the whole blocks are cloned instead of copied
+// if the filesystem can share extents between the files.
+// Falls back to the next path when the kernel or filesystem does not support one.
+int move_data(int inFd, off_t inOffset, int outFd, off_t size);
+
+// Block size of the filesystem of a file, the alignment that cloning needs
+off_t move_block_size(int fd);
+
+// Whether move_data may clone data at inOffset instead of copying it: no block is
+// smaller than a sector, and a filesystem that refused to clone is not asked again
+bool move_clone_possible(off_t inOffset);
+
+// Read exactly size bytes from the current position. Returns the number of bytes read
+ssize_t read_all(int fd, void *buffer, size_t size);
+
+// Skip size bytes at the current position of a file or pipe
+int discard_data(int fd, off_t size);
+
+// Write a whole buffer, retrying on short writes
+int write_all(int fd, const void *buffer, size_t size);
+
+// Write a whole buffer at the given offset
+int pwrite_all(int fd, const void *buffer, size_t size, off_t offset);
+
+// Write size zero bytes at the current position, for the holes of a sparse file
+// written to a pipe
+int write_zeros(int fd, off_t size);
+
+// Write a whole vector of buffers, IOV_MAX buffers per writev call.
+// The iovec array is modified to track partial writes
+int writev_all(int fd, struct iovec *iov, int count);
+
+// Count a member whose data was moved by the caller, e.g. through io_uring
+void move_count(move_path path, off_t size);
+
+// Print how many members and bytes went through each path
+void move_report(FILE *out);
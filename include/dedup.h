@@ -0,0 +1,34 @@
+#pragma once
+
+#include "common.h"
+#include "myz.h"
+
+#define DEDUP_MIN_CHUNK (2 * 1024)      // Smallest chunk, except at the end of a file
+#define DEDUP_AVG_CHUNK (8 * 1024)      // Expected chunk size
+#define DEDUP_MAX_CHUNK (64 * 1024)     // Largest chunk
+#define DEDUP_BUFFER_SIZE (1024 * 1024) // Bytes read from a file at a time
+
+typedef struct dedup_store* DedupStore;
+
+// Create an empty store of the chunks written to an archive. Returns NULL if it cannot be allocated
+DedupStore dedup_create(void);
+
+// Split the data of a file entry into content-defined chunks. Chunks not seen before
+// are written at the current position of archiveFd (deflated if the entry is
+// compressed and that makes them smaller) and the entry gets the list of its chunks.
+// Only the data extents of a sparse file with an extent map are chunked
+int dedup_store_file(DedupStore store, MyzNode *entry, int fileFd, int archiveFd, off_t *archiveOffset);
+
+// Print the number of chunks and the deduplication ratio
+void dedup_report(DedupStore store, FILE *out);
+
+// Free the store
+void dedup_destroy(DedupStore store);
+
+// Rebuild the data of a chunked entry into outFd. The data extents of a sparse file go
+// to their place in outFd, which already has the size of the file; with sequential they
+// are written in file order instead, with the holes as zeros
+int dedup_extract(int archiveFd, const MyzNode *entry, int outFd, bool sequential);
+
+// Compute the CRC32C of the data of a chunked entry without writing it anywhere
+int dedup_checksum(int archiveFd, const MyzNode *entry, uint32_t *crc);
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "common.h"
+#include "myz.h"
+
+#define ENTRY_ARENA_BLOCK_SIZE (256 * 1024)  // Bytes of an arena block, unless one allocation needs more
+
+// Block of the arena. Allocations are taken from the newest block
+typedef struct entry_arena_block EntryArenaBlock;
+struct entry_arena_block {
+    EntryArenaBlock *next;  // Previous block
+    size_t size;            // Bytes of data
+    size_t used;
+    unsigned char data[];
+};
+
+// Entries of an archive in one growable array, in archive order, and an arena for
+// their variable-length data. Entries are addressed by position: a pointer to an
+// entry is only valid until the next entry is added
+typedef struct {
+    MyzNode *entries;
+    size_t count;
+    size_t capacity;
+    EntryArenaBlock *arena;
+} EntryTable;
+
+#define ENTRY_NONE SIZE_MAX     // Position of no entry
+
+// Place of an entry in the directory tree. Entries are in depth-first order, so the
+// subtree of an entry is the range of size entries that starts with it
+typedef struct {
+    size_t parent;          // Position of the directory of the entry, ENTRY_NONE at the top level
+    size_t firstChild;      // Position of the first entry in the directory, or ENTRY_NONE
+    size_t size;            // Number of entries in the subtree, the entry included
+} EntryLink;
+
+// Tree index of the entries of a table, built once so that lookups and removals
+// touch only the entries on the way and the removed subtree
+typedef struct {
+    EntryLink *links;       // One per entry, by position
+    size_t count;           // Entries of the table when the tree was built
+} EntryTree;
+
+// Initialize an empty table
+void entries_init(EntryTable *table);
+
+// Make room for count more entries, so that adding them does not move the array
+int entries_reserve(EntryTable *table, size_t count);
+
+// Add a zeroed entry at the end. Returns it, or NULL if out of memory
+MyzNode *entries_add(EntryTable *table);
+
+// Allocate 8-byte aligned memory that is freed with the table. Returns NULL if out of memory
+void *entries_alloc(EntryTable *table, size_t size);
+
+// Give an entry a copy of a path in the arena, truncated to MAX_PATH_LEN - 1 bytes,
+// and take its name from the last part
+int entries_set_path(EntryTable *table, MyzNode *entry, const char *path);
+
+// Get the name of an entry, the last part of its path
+const char *entries_name(const char *path);
+
+// Give an entry a copy of extra metadata in the arena. The entry borrows it, so
+// extra_add and extra_remove copy it before changing it
+int entries_set_extra(EntryTable *table, MyzNode *entry, const void *extra, uint32_t size);
+
+// Remove the entries whose flag is set in removed, keeping the order of the others
+void entries_compact(EntryTable *table, const bool *removed);
+
+// Free the table, its arena and the extra metadata that its entries own
+void entries_free(EntryTable *table);
+
+// Build the tree index of the entries of a table from the dirContents of its directories
+int entries_tree_build(const EntryTable *table, EntryTree *tree);
+
+// Find the entry with a path, following the directories that lead to it. Entries
+// added after the tree was built are not found. Returns ENTRY_NONE if there is none
+size_t entries_tree_find(const EntryTable *table, const EntryTree *tree, const char *path);
+
+// Mark the subtree of an entry in removed and take it out of the dirContents of its directory
+void entries_tree_remove(EntryTable *table, const EntryTree *tree, size_t index, bool *removed);
+
+// Free the tree index
+void entries_tree_free(EntryTree *tree);
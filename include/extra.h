@@ -0,0 +1,81 @@
+#pragma once
+
+#include "common.h"
+#include "myz.h"
+
+// Types of extra metadata stored after a node
+typedef enum {
+    MYZ_EXTRA_BLOCKS = 1,   // Block index of compressed data
+    MYZ_EXTRA_CHUNKS = 2,   // Chunk list of deduplicated data
+    MYZ_EXTRA_EXTENTS = 3,  // Data extents of a sparse file
+    MYZ_EXTRA_CHECKSUM = 4  // Checksum of the original data
+} myz_extra_type;
+
+// Header of each extra metadata record
+typedef struct {
+    uint32_t type;          // One of myz_extra_type
+    uint32_t length;        // Bytes of data after the header
+} MyzExtraHeader;
+
+// Block index of a compressed entry. Every block holds block_size bytes of the
+// original data (the last one may hold less) and is an independent gzip member
+typedef struct {
+    uint32_t block_size;    // Bytes of original data per block
+    uint32_t count;         // Number of blocks
+} MyzBlockIndex;
+
+// Position of a block, relative to the data offset of the entry
+typedef struct {
+    uint64_t offset;        // Byte offset of the gzip member
+    uint64_t size;          // Compressed size of the gzip member
+} MyzBlock;
+
+// Reference to a deduplicated chunk. A chunk may be shared by many entries.
+// It is deflated (zlib format) when stored_size is smaller than size
+typedef struct {
+    uint64_t offset;        // Byte offset of the chunk in the archive
+    uint32_t stored_size;   // Bytes stored in the archive
+    uint32_t size;          // Bytes of original data
+} MyzChunk;
+
+// Data extent of a sparse file. The stored data of the entry is the concatenation
+// of its extents; the rest of the file is a hole
+typedef struct {
+    uint64_t offset;        // Byte offset of the extent in the file
+    uint64_t length;        // Bytes of data in the extent
+    uint64_t data_offset;   // Byte offset of the extent in the stored data
+} MyzExtent;
+
+// Checksum of the stored data of an entry, before compression or chunking: the
+// whole file, or the concatenation of the data extents of a sparse file
+typedef struct {
+    uint32_t crc32c;        // CRC32C (Castagnoli) of the data
+    uint32_t reserved;
+    uint64_t size;          // Bytes of data covered by the checksum
+} MyzChecksum;
+
+// Add an extra record to a node
+int extra_add(MyzNode *node, myz_extra_type type, const void *data, uint32_t length);
+
+// Remove every extra record of the given type from a node
+void extra_remove(MyzNode *node, myz_extra_type type);
+
+// Find an extra record of a node. Returns its data and sets *length, or NULL
+const void *extra_find(const MyzNode *node, myz_extra_type type, uint32_t *length);
+
+// Get the block index of a node, or NULL if its data is not block compressed or the
+// index is corrupt: a block size of 0, or a number of blocks that does not cover the
+// size of the data
+const MyzBlockIndex *extra_blocks(const MyzNode *node);
+
+// Get the blocks that follow a block index
+const MyzBlock *extra_block_list(const MyzBlockIndex *index);
+
+// Get the chunk list of a node and set *count, or NULL if its data is not deduplicated
+const MyzChunk *extra_chunks(const MyzNode *node, uint32_t *count);
+
+// Get the data extents of a sparse node and set *count, or NULL if the node has no holes
+const MyzExtent *extra_extents(const MyzNode *node, uint32_t *count);
+
+// Get the checksum of a node, or NULL if it has none
+const MyzChecksum *extra_checksum(const MyzNode *node);
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "common.h"
+
+typedef struct link_map* LinkMap;
+
+// Function that frees a value of the map
+typedef void (*LinkMapDestroy)(void *value);
+
+// Create an empty map from inodes (device and inode number) to values
+LinkMap linkmap_create(void);
+
+// Get the value stored for an inode, or NULL
+void *linkmap_find(LinkMap map, dev_t dev, ino_t ino);
+
+// Store the value of an inode. Returns -1 if out of memory
+int linkmap_insert(LinkMap map, dev_t dev, ino_t ino, void *value);
+
+// Free the map, calling destroy_value on each value if it is not NULL
+void linkmap_destroy(LinkMap map, LinkMapDestroy destroy_value);
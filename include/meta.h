@@ -0,0 +1,98 @@
+#pragma once
+
+#include "common.h"
+#include "myz.h"
+#include "entries.h"
+
+// Version 2 metadata. All integers are unsigned LEB128 varints (little-endian base 128),
+// signed ones zigzag encoded. The integers of the extra metadata of a record are
+// little-endian, and so are those of the path index, so the encoding does not depend
+// on the host.
+//
+// Metadata table, after the data of all entries:
+//   flags (1 byte, META_TABLE_COMPRESSED), number of entries, size of the string
+//   table, size of the body (string table and records), stored size of the body,
+//   then the body, deflated with zlib if compressed.
+// Each record: parent (index + 1 of its directory in the table, 0 at the top level),
+//   name (offset in the string table: the path for top level entries, the file
+//   name otherwise), then the fields written by meta_put_fields.
+// Records are in list order, so every directory comes before its contents and the
+// path and number of contents of a directory are rebuilt from the parent references.
+// When the metadata section is longer than the table, a path index (pathindex.h) follows.
+
+#define META_TABLE_COMPRESSED 0x01  // The body of the table is deflated
+#define META_TABLE_HEADER_MAX 41    // Largest encoded table header: the flags and four varints
+
+// Sizes at the start of a metadata table
+typedef struct {
+    unsigned char flags;
+    uint64_t count;         // Number of records
+    uint64_t strings_size;  // Bytes of the string table at the start of the body
+    uint64_t body_size;     // Bytes of the body once inflated
+    uint64_t stored_size;   // Bytes of the body as stored
+    size_t header_size;     // Bytes of the encoded header, where the stored body starts
+} MetaTableHeader;
+
+#define META_FLAG_COMPRESSED 0x01   // The data of the entry is compressed
+
+// Tracks the directory each entry of a list belongs to, from the dirContents counts
+typedef struct {
+    struct {
+        uint64_t index;     // Index of the directory among the stored entries
+        int remaining;      // Entries of the directory not seen yet
+    } *stack;
+    int depth;
+    int capacity;
+    uint64_t count;         // Number of stored entries seen so far
+} MetaParents;
+
+// Start tracking a list from its first entry
+void meta_parents_init(MetaParents *parents);
+
+// Get the parent reference of the next entry of the list (0 at the top level).
+// Entries that are not stored in the metadata only count towards their directory
+uint64_t meta_parent(MetaParents *parents, const MyzNode *node, bool stored);
+
+// Free the state of the tracker
+void meta_parents_free(MetaParents *parents);
+
+// Check if an entry of a table is stored in the metadata
+bool meta_stored(const MyzNode *node);
+
+// Encode the stored entries of a table as a metadata table. Returns a buffer to be
+// freed and sets *size, or NULL. If recordOffsets is not NULL it gets the offset in
+// the body of every record, followed by the size of the body
+unsigned char *meta_encode_table(const EntryTable *entries, bool compress, uint64_t *recordOffsets, size_t *size);
+
+// Read the header of a metadata table from its first bytes, up to META_TABLE_HEADER_MAX
+// of them. The table takes header_size + stored_size bytes. Returns -1 if it is corrupt
+int meta_read_table_header(const unsigned char *data, size_t size, MetaTableHeader *header);
+
+// Inflate the stored body of a compressed table. Returns a buffer to be freed, or NULL
+unsigned char *meta_inflate_body(const MetaTableHeader *header, const unsigned char *stored);
+
+// Store the width low bytes of value at data, little-endian
+void meta_store_le(unsigned char *data, uint64_t value, int width);
+
+// Load a little-endian integer of width bytes from data
+uint64_t meta_load_le(const unsigned char *data, int width);
+
+// Convert a copy of the extra metadata of a decoded record to the host structs of extra.h
+void meta_extra_decode(unsigned char *extra, uint32_t size);
+
+// Decode the record of a table body that starts at data. The parent reference and the
+// offset of the name in the string table are returned; the path and name are left to
+// the caller. The extra metadata of the node points into the record and must be copied
+// and converted with meta_extra_decode. Returns the end of the record, or NULL if it
+// is corrupt
+const unsigned char *meta_decode_table_record(const unsigned char *data, const unsigned char *end, MyzNode *node,
+                                              uint64_t *parent, uint64_t *name);
+
+// Encode one entry as a self-contained record, with its name inline, for the entry
+// records of a stream archive. Returns a buffer to be freed and sets *size, or NULL
+unsigned char *meta_encode_record(const MyzNode *node, uint64_t parent, size_t *size);
+
+// Decode a self-contained record. The path is set to the name, copied to path, a buffer
+// of MAX_PATH_LEN bytes; the caller joins it with the path of the parent. Returns -1 if
+// the record is corrupt
+int meta_decode_record(const unsigned char *data, size_t size, MyzNode *node, char *path, uint64_t *parent);
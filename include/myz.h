@@ -1,15 +1,31 @@
 #pragma once
 
 #include "common.h"
-#include "ADTList.h"
+
+#define MYZ_MAGIC "MYZ"          // Magic of an archive of the first release, read only
+#define MYZ_STREAM_MAGIC "MYZS"  // Magic of a version 1 stream archive, read only
+#define MYZ_MAGIC_V2 "MYZ2"      // Archive with compact (version 2) metadata
+#define MYZ_STREAM_MAGIC_V2 "MZS2"   // Stream archive with compact (version 2) metadata
+#define MYZ_FOOTER_MAGIC "MYZE"  // Magic of the footer of a stream archive
+#define MYZ_STREAM_ENTRY "ENT"   // Tag before each entry of a stream archive
+#define MYZ_STREAM_END "END"     // Tag before the trailing metadata of a stream archive
+#define MYZ_TAG_LEN 4
 
 // Header of the archive
 typedef struct {
-    char magic[4];  // Identifier "MYZ\0"
+    char magic[4];  // Identifier "MYZ\0", "MYZS", "MYZ2" or "MZS2"
     uint64_t total_bytes;   // Total bytes of the archive
     uint64_t metadata_offset;  // Byte offset to the metadata section
 } MyzHeader;
 
+// Footer of a stream archive. The header of a stream archive is written before
+// the sizes are known, so they are stored at the end instead
+typedef struct {
+    uint64_t total_bytes;   // Total bytes of the archive
+    uint64_t metadata_offset;  // Byte offset to the trailing metadata section
+    char magic[4];  // Identifier "MYZE"
+} MyzFooter;
+
 typedef enum {
     MYZ_NODE_TYPE_FILE,     // Regular file
     MYZ_NODE_TYPE_DIR,      // Directory
@@ -17,21 +33,55 @@ typedef enum {
     MYZ_NODE_TYPE_HARDLINK  // Hard link
 } myz_node_type;
 
-// Metadata node
+// Metadata node. Its path is not stored in it: the entries of a table keep it in the
+// arena of the table, like their extra metadata, and decoded nodes in a buffer of the
+// decoder. The name is the last part of the path
 typedef struct {
     struct stat stat;      // File status information
-    char name[MAX_NAME_LEN];
-    char path[MAX_PATH_LEN];
+    const char *name;
+    const char *path;
     myz_node_type type;     // Type of the entry
     off_t data_offset;      // Byte offset to the data section
+    off_t data_size;        // Number of bytes stored in the data section
     bool compressed;        // Data is compressed
     int dirContents;        // Number of directory contents
+    uint32_t extra_size;    // Bytes of extra metadata stored after the node
+    unsigned char *extra;   // Extra metadata, only in memory
+    bool extra_borrowed;    // The extra metadata belongs to an entry table and is copied before it changes
 } MyzNode;
 
-void create_archive(char *archiveFile, char **fileList, bool gzip);
-void append_archive(char *archiveFile, char **fileList, bool gzip);
-void extract_archive(char *archiveFile, char **fileList);
-void delete_archive(char *archiveFile, char **fileList);
+// Node of a version 1 stream archive ("MYZS"), with its strings inline. The extra
+// metadata follows it. "MYZ" archives hold the shorter node of the first release
+typedef struct {
+    struct stat stat;
+    char name[MAX_NAME_LEN];
+    char path[MAX_PATH_LEN];
+    myz_node_type type;
+    off_t data_offset;
+    off_t data_size;
+    bool compressed;
+    int dirContents;
+    uint32_t extra_size;
+} MyzStoredNode;
+
+// Size of a node of a version 1 stream archive.
+// Version 2 archives store nodes in the compact encoding of meta.h
+#define MYZ_NODE_SIZE sizeof(MyzStoredNode)
+
+// A uringDepth above 0 batches the I/O of small members through an io_uring with a
+// submission queue of that depth, when the kernel allows it. Raw members copied in the
+// kernel are checksummed unless checksum is false, which saves reading each of them once more.
+// They return -1 if the archive could not be written
+int create_archive(char *archiveFile, char **fileList, bool gzip, bool dedup, bool align, bool checksum, int uringDepth);
+int append_archive(char *archiveFile, char **fileList, bool gzip, bool dedup, bool align, bool checksum, int uringDepth);
+// With toStdout, the data of the extracted files is written to the standard output
+// in archive order instead, and nothing is created
+void extract_archive(char *archiveFile, char **fileList, int jobs, int uringDepth, bool toStdout);
+// Deleting only writes the metadata again; punchHoles also frees the unused data.
+// A vacuum copies the data that is still used to a new archive that replaces the old one
+int delete_archive(char *archiveFile, char **fileList, bool punchHoles);
+int vacuum_archive(char *archiveFile);
 void print_metadata(char *archiveFile);
 void query_archive(char *archiveFile, char **fileList);
-void print_hierarchy(char *archiveFile);
\ No newline at end of file
+void print_hierarchy(char *archiveFile);
+int test_archive(char *archiveFile);
\ No newline at end of file
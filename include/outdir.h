@@ -0,0 +1,63 @@
+#pragma once
+
+#include "common.h"
+
+#define OUTDIR_MAX_OPEN 256                 // Directories kept open during an extraction
+#define OUTPUT_PREALLOC_MIN (64 * 1024)     // Smallest file whose blocks are allocated up front
+#define OUTPUT_DONTNEED_MIN (1024 * 1024)   // Smallest file dropped from the page cache once written
+
+// Directory created by an extraction. Files are created relative to its descriptor;
+// past OUTDIR_MAX_OPEN directories, through its path instead
+typedef struct {
+    char *path;         // Path from the current directory
+    int fd;             // Open descriptor, or -1
+    struct stat stat;   // Stored status, restored once the contents are extracted
+    bool restore;       // Created by the extraction and not restored yet
+} OutDir;
+
+// Directories of an extraction, by number. Directory -1 is the current directory
+typedef struct {
+    OutDir *dirs;
+    size_t count;
+    size_t capacity;
+    int open;           // Directories with an open descriptor
+} OutDirs;
+
+void outdirs_init(OutDirs *dirs);
+
+// Create the directory name in directory dir, writable by its owner until it is
+// closed, when the stored status st is restored. An existing directory is used as
+// it is. Returns the number of the directory or -1
+int outdir_create(OutDirs *dirs, int dir, const char *name, const struct stat *st);
+
+// Add an existing directory by its path from the current directory. Returns its number or -1
+int outdir_add_path(OutDirs *dirs, const char *path);
+
+// Get the descriptor and name to pass to the *at calls for name in directory dir.
+// Past the open directories, name is joined to the path of dir in buffer (PATH_MAX)
+// and AT_FDCWD is returned. Returns -1 if the path is too long
+int outdir_at(const OutDirs *dirs, int dir, const char *name, char *buffer, const char **atName);
+
+// Restore the status of a directory and close it. Its contents must all be extracted
+void outdir_close(OutDirs *dirs, int dir);
+
+// Close the directories still open, the most recently created first, and free them
+void outdirs_free(OutDirs *dirs);
+
+// Create the file name in directory dir exclusively, as "name(N).ext" if the name is
+// taken. Its path from the current directory is stored in filePath (PATH_MAX).
+// Returns the descriptor or -1
+int output_create(const OutDirs *dirs, int dir, const char *name, char *filePath);
+
+// Link name in directory dir to the file at target, with a suffix if the name is taken
+int output_link(const OutDirs *dirs, int dir, const char *name, const char *target);
+
+// Allocate the blocks of a file of size bytes before it is written, so that it is
+// laid out in few extents. The size of the file is left as it is
+void output_preallocate(int fd, off_t size);
+
+// Restore the owner (as root), mode and times of a file or directory from its stored status
+void restore_attributes(int fd, const struct stat *st);
+
+// Restore the status of a written file and drop a large one from the page cache
+void output_finish(int fd, const struct stat *st);
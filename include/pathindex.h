@@ -0,0 +1,65 @@
+#pragma once
+
+#include "common.h"
+#include "myz.h"
+#include "entries.h"
+
+// Path index written after the metadata table of a version 2 archive, so that single
+// entries can be found without decoding the whole table:
+//   PathIndexHeader
+//   uint64_t record_offsets[count + 1]  offset of every record in the table body, by
+//                                       table order, followed by the size of the body
+//   PathIndexSlot slots[count]          one per entry, sorted by path (strcmp order)
+//   char paths[paths_size]              full paths, in the order of the slots
+// All integers are little-endian, written byte by byte with meta_store_le. The structs
+// below hold them once decoded.
+
+#define PATH_INDEX_MAGIC "MYZI"
+#define PATH_INDEX_HEADER_SIZE 24   // Encoded size of a PathIndexHeader
+#define PATH_INDEX_SLOT_SIZE 24     // Encoded size of a PathIndexSlot
+
+typedef struct {
+    char magic[4];          // Identifier "MYZI"
+    uint32_t reserved;
+    uint64_t count;         // Number of entries
+    uint64_t paths_size;    // Bytes of the paths
+} PathIndexHeader;
+
+typedef struct {
+    uint64_t path_offset;   // Offset of the path among the paths
+    uint32_t path_length;   // Length of the path, without a terminating null
+    uint32_t reserved;
+    uint64_t entry;         // Position of the entry in the metadata table
+} PathIndexSlot;
+
+typedef struct path_index* PathIndex;
+
+// Build the path index of the stored entries of a table, given the record offsets
+// returned by meta_encode_table. Returns a buffer to be freed and sets *size, or NULL
+unsigned char *path_index_build(const EntryTable *entries, const uint64_t *recordOffsets, uint64_t count, size_t *size);
+
+// Open the path index that starts at data, right after the metadata table of count
+// entries. The index refers to the data, which must stay mapped while it is used.
+// Returns NULL if there is no valid index, so that the caller falls back to a scan
+PathIndex path_index_open(const unsigned char *data, size_t size, uint64_t count);
+
+// Find the slots whose path is exactly path: [*first, *last)
+int path_index_find(PathIndex index, const char *path, uint64_t *first, uint64_t *last);
+
+// Find the slots of the paths that start with the length bytes of prefix: [*first, *last)
+int path_index_prefix(PathIndex index, const char *prefix, size_t length, uint64_t *first, uint64_t *last);
+
+// Find the slots of the paths inside directory path: [*first, *last)
+int path_index_descendants(PathIndex index, const char *path, uint64_t *first, uint64_t *last);
+
+// Get the position in the metadata table of the entry of a slot
+int path_index_number(PathIndex index, uint64_t slot, uint64_t *number);
+
+// Get the position and the path of the entry of a slot. The path is not null terminated
+int path_index_slot(PathIndex index, uint64_t slot, uint64_t *number, const char **path, uint32_t *length);
+
+// Get the offset and size in the table body of the record of an entry
+int path_index_record(PathIndex index, uint64_t number, uint64_t *offset, uint64_t *size);
+
+// Free the index
+void path_index_close(PathIndex index);
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "common.h"
+
+// Paths and patterns that select the entries of an extraction. A pattern holds one
+// of the wildcards "*?[\" of fnmatch, where '*' also matches '/', or ends with '/',
+// which matches everything inside that directory. Any other argument is an exact path.
+// The literal prefixes of all of them, up to the first wildcard, are kept in a trie,
+// so an entry is matched in one walk of its path whatever the number of patterns
+
+// How an entry was matched
+typedef enum {
+    PATTERN_NONE,       // Not selected
+    PATTERN_EXACT,      // Equal to a path: extracted under its name in the current directory
+    PATTERN_GLOB        // Matched by a pattern: extracted at its path in the archive
+} pattern_match;
+
+typedef struct pattern_set* PatternSet;
+
+// Compile the paths and patterns of a list. The list must stay valid while the set is
+// used, since the positions in it identify the requests. Returns NULL if out of memory
+PatternSet pattern_set_create(char **fileList);
+
+// Match the path of an entry. The position in the list of the request that selected it
+// is stored in *request: an exact path first, otherwise the first matching pattern
+pattern_match pattern_set_match(PatternSet set, const char *path, int *request);
+
+// Check if an entry inside directory dirPath may be matched. Directories for which it
+// is false are skipped with everything inside them
+bool pattern_set_inside(PatternSet set, const char *dirPath);
+
+// Get the literal prefix of request number request, which every path it matches starts
+// with. Returns false if the request is an exact path
+bool pattern_set_prefix(PatternSet set, int request, const char **prefix, size_t *length);
+
+// Check if a path is matched by the pattern of request number request
+bool pattern_set_matches(PatternSet set, int request, const char *path);
+
+void pattern_set_destroy(PatternSet set);
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "common.h"
+#include "myz.h"
+#include "meta.h"
+#include "pathindex.h"
+
+// Read-only view of the metadata of an archive. The metadata section is mapped into
+// memory and records are decoded in place while they are walked, so only the pages
+// that are touched are read and no entry is allocated
+typedef struct {
+    int fd;
+    MyzHeader header;           // Header, with the sizes of the footer for stream archives
+    unsigned char *map;         // Mapping that holds the metadata section, NULL if it is empty
+    size_t mapSize;
+    const unsigned char *data;  // Metadata section
+    size_t size;
+    bool compact;               // Version 2 metadata
+    bool baseline;              // "MYZ" metadata, in the layout of the first release
+    bool counted;               // Directory nodes hold the number of their entries
+    uint64_t count;             // Number of entries, when the directories are not counted
+    MetaTableHeader table;      // Header of the version 2 table
+    const unsigned char *body;  // Body of the table: in the mapping, or inflated on first use
+    unsigned char *inflated;
+    PathIndex index;            // Path index, NULL if the archive has none
+} ArchiveReader;
+
+// Walk over the entries of a reader, in archive order
+typedef struct {
+    ArchiveReader *reader;
+    const unsigned char *pos;   // Next record
+    const unsigned char *end;
+    uint64_t number;            // Position of the next entry
+    bool corrupt;               // The records cannot be walked
+    MetaParents parents;        // Directories of version 1 entries
+    struct {
+        uint64_t number;        // Position of the directory
+        size_t length;          // Length of its path
+    } *dirs;                    // Directories of the last entry, outermost first
+    int depth;
+    int capacity;
+    char path[MAX_PATH_LEN];    // Path of the last entry, which starts with those of its directories
+    unsigned char *extra;       // Extra metadata of the last entry, aligned
+    uint32_t extraCapacity;
+} ArchiveCursor;
+
+// Check if a header belongs to a stream archive
+bool archive_is_stream(const MyzHeader *header);
+
+// Check if a header belongs to an archive with version 2 metadata
+bool archive_is_compact(const MyzHeader *header);
+
+// Get the end of the metadata section. A stream archive ends with the footer
+off_t archive_metadata_end(const MyzHeader *header);
+
+// Map the metadata section of an archive opened with open_archive. The reader owns fd
+// from then on, also if it fails. "MYZ" archives of the first release and those with
+// extra metadata share the magic, and are told apart by which layout their whole
+// metadata section parses as. Returns -1 if the metadata is corrupt
+int reader_open(ArchiveReader *reader, int fd, const MyzHeader *header);
+
+// Unmap the metadata and close the archive
+void reader_close(ArchiveReader *reader);
+
+// Start a walk over the entries
+void reader_begin(ArchiveReader *reader, ArchiveCursor *cursor);
+
+// Decode the next entry and the parent reference of its directory (0 at the top level).
+// The path and extra metadata of the node belong to the cursor and are valid until the
+// next call. The directory contents of version 2 directories are not counted.
+// Returns 1 for an entry, 0 at the end and -1 if the metadata is corrupt
+int reader_next(ArchiveCursor *cursor, MyzNode *node, uint64_t *parent);
+
+// Free the state of a walk
+void reader_end(ArchiveCursor *cursor);
+
+// Decode the entry of a slot of the path index, reading only its record. Its path is
+// copied to path, a buffer of MAX_PATH_LEN bytes, and its position stored in *number.
+// The extra metadata of the node must be freed
+int reader_entry(ArchiveReader *reader, uint64_t slot, MyzNode *node, char *path, uint64_t *number);
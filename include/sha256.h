@@ -0,0 +1,24 @@
+#pragma once
+
+#include "common.h"
+
+#define SHA256_DIGEST_LEN 32
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;            // Bytes hashed so far
+    unsigned char block[64];    // Partial block
+    size_t blockLen;
+} Sha256;
+
+// Start a new hash
+void sha256_init(Sha256 *ctx);
+
+// Add data to the hash
+void sha256_update(Sha256 *ctx, const void *data, size_t size);
+
+// Finish the hash and store the digest
+void sha256_final(Sha256 *ctx, unsigned char digest[SHA256_DIGEST_LEN]);
+
+// Hash a buffer in one call
+void sha256(const void *data, size_t size, unsigned char digest[SHA256_DIGEST_LEN]);
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "common.h"
+#include "extra.h"
+
+// Find the data extents of a file with lseek(SEEK_DATA/SEEK_HOLE). Returns 1 and sets
+// *extents (to be freed) when the file has holes, 0 when it has none or the
+// filesystem cannot tell, in which case the whole file is stored
+int sparse_scan(int fd, const struct stat *st, MyzExtent **extents, uint32_t *count);
+
+// Number of bytes of data in the extents
+off_t sparse_data_size(const MyzExtent *extents, uint32_t count);
+
+// Read size bytes of the stored data of a sparse file, starting at dataOffset.
+// Returns the number of bytes read or -1
+ssize_t sparse_pread(int fd, const MyzExtent *extents, uint32_t count, void *buffer, size_t size, off_t dataOffset);
+
+// Write size bytes of stored data, starting at dataOffset, at their place in the file
+int sparse_pwrite(int fd, const MyzExtent *extents, uint32_t count, const void *buffer, size_t size, off_t dataOffset);
+
+// Copy the extents of fileFd to the current position of archiveFd
+int sparse_pack(int fileFd, int archiveFd, const MyzExtent *extents, uint32_t count);
+
+// Copy stored data at inOffset of archiveFd (-1 for the current position) to the
+// extents of fileFd, which must already have the size of the file
+int sparse_unpack(int archiveFd, off_t inOffset, int fileFd, const MyzExtent *extents, uint32_t count);
+
+// Write size bytes of stored data, starting at dataOffset, to the current position of fd
+// in file order, each extent after the zeros of the hole before it. The data must be
+// written in order; the hole after the last extent is left to sparse_write_end
+int sparse_write(int fd, const MyzExtent *extents, uint32_t count, const void *buffer, size_t size, off_t dataOffset);
+
+// Write the zeros of the hole between the last extent and the end of a file of fileSize bytes
+int sparse_write_end(int fd, const MyzExtent *extents, uint32_t count, off_t fileSize);
+
+// Copy size bytes of stored data at inOffset of archiveFd, which start at dataOffset of
+// the stored data, to their place in outFd. With sequential, they are written at the
+// current position of outFd like sparse_write, each extent after the zeros of its hole
+int sparse_move(int archiveFd, off_t inOffset, int outFd, const MyzExtent *extents, uint32_t count, off_t size,
+                off_t dataOffset, bool sequential);
+
+// Copy stored data at inOffset of archiveFd (-1 for the current position) to the current
+// position of outFd, such as a pipe, in file order with the holes written as zeros
+int sparse_stream(int archiveFd, off_t inOffset, int outFd, const MyzExtent *extents, uint32_t count, off_t fileSize);
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "common.h"
+
+#define URING_DEFAULT_DEPTH 64          // Submission queue entries when no depth is given
+#define URING_MAX_DEPTH 4096
+#define URING_FILE_MAX (64 * 1024)      // Largest member whose data goes through the ring in one piece
+#define URING_BATCH_BYTES (8 * 1024 * 1024)   // Member data held in memory for one batch
+
+typedef struct uring* Uring;
+
+// Operations that can be batched on the ring
+typedef enum {
+    URING_OPENAT,       // openat(fd, path, flags, mode): result is the new descriptor
+    URING_READ,         // pread(fd, buffer, length, offset): result is the bytes read
+    URING_WRITE,        // pwrite(fd, buffer, length, offset): result is the bytes written
+    URING_CLOSE         // close(fd)
+} uring_opcode;
+
+// One operation and its result
+typedef struct {
+    uring_opcode opcode;
+    int fd;
+    const char *path;
+    int flags;
+    mode_t mode;
+    void *buffer;
+    uint32_t length;
+    off_t offset;
+    int result;         // Set by uring_run: the result of the call, or -errno
+} UringOp;
+
+// Set up a ring with a submission queue of depth entries through the raw system
+// calls. Returns NULL when the kernel has no io_uring or it is disabled, in which
+// case the callers keep to the blocking calls
+Uring uring_create(unsigned depth);
+
+// Number of operations the ring takes in one submission
+unsigned uring_depth(Uring ring);
+
+// Submit the operations, at most the queue depth at a time, and wait for all of them.
+// The operations are independent and may complete in any order. Returns -1 if the
+// ring itself fails; the result of each operation is in its result field
+int uring_run(Uring ring, UringOp *ops, size_t count);
+
+// Unmap and close the ring
+void uring_destroy(Uring ring);
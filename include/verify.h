@@ -0,0 +1,26 @@
+#pragma once
+
+#include "common.h"
+#include "myz.h"
+#include "entries.h"
+
+#define VERIFY_RANGE_SIZE (64 * 1024 * 1024)    // Bytes of raw data per verify task
+#define VERIFY_BLOCKS_PER_TASK 16               // Compressed blocks per verify task
+
+// Counts of a verify run
+typedef struct {
+    uint64_t members;       // File entries with data
+    uint64_t verified;      // Members whose data matches their checksum
+    uint64_t unchecked;     // Members without a checksum, from older archives
+    uint64_t failed;        // Members whose data is corrupt or could not be read
+    uint64_t bytes;         // Bytes of original data checked
+} VerifyReport;
+
+// Check the data of every file entry against its checksum, reading it from archiveFd
+// on numThreads threads. Large entries are split so that their parts are checked in
+// parallel too. Nothing is written; mismatches are reported on stderr.
+// Returns 0 if every checksummed member matches, -1 otherwise
+int verify_entries(int archiveFd, const EntryTable *entries, int numThreads, VerifyReport *report);
+
+// Print the counts of a verify run
+void verify_report(const VerifyReport *report, FILE *out);
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "common.h"
+#include "entries.h"
+
+#define WALK_THREADS_PER_CPU 2  // Walker threads mostly wait for stat, so use more than the CPUs
+#define WALK_MIN_THREADS 4      // Fewest walker threads by default
+#define WALK_MAX_OPEN_DIRS 256  // Queued directories that may keep a descriptor open
+#define WALK_DENTS_BUFFER_SIZE (64 * 1024)  // Bytes of directory entries read per getdents64 call
+
+// Walk the tree under dirPath on numThreads threads, each with its own deque of
+// directories to read; idle threads steal from the others. A node is appended to
+// the table for every entry, in the order of a sequential depth-first walk: each
+// directory is followed by its contents and has their number in dirContents.
+// Returns the number of entries directly under dirPath, or -1 if out of memory
+int walk_tree(const char *dirPath, EntryTable *table, bool gzip, int numThreads);
+
+// Number of walker threads to use by default
+int walk_default_threads(void);
+
+// Print how many directories, entries and system calls the walks used
+void walk_report(FILE *out);
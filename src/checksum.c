@@ -0,0 +1,203 @@
+#include "checksum.h"
+#include <sys/mman.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82f63b78u     // Castagnoli polynomial, bit-reversed
+#define CRC32C_LANE 8192            // Bytes of each of the three interleaved hardware CRCs
+
+// Tables of the software CRC, eight bytes at a time (slicing-by-8)
+static uint32_t crc32c_table[8][256];
+static uint32_t crc32c_x2n[32];     // x^(2^n) modulo the polynomial, for crc32c_combine
+static uint32_t crc32c_lane_shift[2];   // x^(8 * CRC32C_LANE) and x^(16 * CRC32C_LANE)
+static bool crc32c_hardware;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+// Function to multiply two polynomials modulo the CRC polynomial (bit-reversed)
+static uint32_t crc32c_multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = (uint32_t)1 << 31, p = 0;
+    while (true) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return p;
+}
+
+// Function to get x^(8 * length) modulo the polynomial: multiplying a CRC by it
+// moves the CRC over length zero bytes
+static uint32_t crc32c_x8nmodp(off_t length) {
+    uint32_t p = (uint32_t)1 << 31;     // x^0
+    for (unsigned k = 3; length > 0; length >>= 1, k++) {
+        if (length & 1)
+            p = crc32c_multmodp(crc32c_x2n[k & 31], p);
+    }
+    return p;
+}
+
+// Function to build the tables and check for the crc32 instruction, once
+static void crc32c_init(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = n;
+        for (int k = 0; k < 8; k++)
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        crc32c_table[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        for (int k = 1; k < 8; k++)
+            crc32c_table[k][n] = (crc32c_table[k - 1][n] >> 8) ^ crc32c_table[0][crc32c_table[k - 1][n] & 0xff];
+    }
+
+    uint32_t p = (uint32_t)1 << 30;     // x^1
+    crc32c_x2n[0] = p;
+    for (int n = 1; n < 32; n++)
+        crc32c_x2n[n] = p = crc32c_multmodp(p, p);
+    crc32c_lane_shift[0] = crc32c_x8nmodp(CRC32C_LANE);
+    crc32c_lane_shift[1] = crc32c_x8nmodp(2 * CRC32C_LANE);
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    crc32c_hardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+// Function to update a CRC without its final inversion, eight bytes at a time
+static uint32_t crc32c_software(uint32_t crc, const unsigned char *data, size_t size) {
+    while (size > 0 && ((uintptr_t)data & 7) != 0) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *data++) & 0xff];
+        size--;
+    }
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        word ^= crc;    // Little-endian: the CRC covers the first four bytes
+        crc = crc32c_table[7][word & 0xff] ^ crc32c_table[6][(word >> 8) & 0xff] ^
+              crc32c_table[5][(word >> 16) & 0xff] ^ crc32c_table[4][(word >> 24) & 0xff] ^
+              crc32c_table[3][(word >> 32) & 0xff] ^ crc32c_table[2][(word >> 40) & 0xff] ^
+              crc32c_table[1][(word >> 48) & 0xff] ^ crc32c_table[0][word >> 56];
+        data += 8;
+        size -= 8;
+    }
+    while (size-- > 0)
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *data++) & 0xff];
+    return crc;
+}
+
+#if defined(__x86_64__)
+// Function to update a CRC without its final inversion with the crc32 instruction.
+// The instruction takes three cycles but can start every cycle, so large inputs are
+// cut into three lanes whose CRCs are computed together and joined by shifting
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *data, size_t size) {
+    while (size > 0 && ((uintptr_t)data & 7) != 0) {
+        crc = _mm_crc32_u8(crc, *data++);
+        size--;
+    }
+    uint64_t crc64 = crc;
+    while (size >= 3 * CRC32C_LANE) {
+        uint64_t crc1 = 0, crc2 = 0;
+        for (size_t i = 0; i < CRC32C_LANE; i += 8) {
+            uint64_t word0, word1, word2;
+            memcpy(&word0, data + i, 8);
+            memcpy(&word1, data + CRC32C_LANE + i, 8);
+            memcpy(&word2, data + 2 * CRC32C_LANE + i, 8);
+            crc64 = _mm_crc32_u64(crc64, word0);
+            crc1 = _mm_crc32_u64(crc1, word1);
+            crc2 = _mm_crc32_u64(crc2, word2);
+        }
+        crc64 = crc32c_multmodp(crc32c_lane_shift[1], crc64) ^
+                crc32c_multmodp(crc32c_lane_shift[0], crc1) ^ crc2;
+        data += 3 * CRC32C_LANE;
+        size -= 3 * CRC32C_LANE;
+    }
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        size -= 8;
+    }
+    crc = (uint32_t)crc64;
+    while (size-- > 0)
+        crc = _mm_crc32_u8(crc, *data++);
+    return crc;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t size) {
+    pthread_once(&crc32c_once, crc32c_init);
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (crc32c_hardware)
+        return ~crc32c_sse42(crc, data, size);
+#endif
+    return ~crc32c_software(crc, data, size);
+}
+
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, off_t length2) {
+    pthread_once(&crc32c_once, crc32c_init);
+
+    // Shift the first CRC over the length2 bytes of the second piece
+    return crc32c_multmodp(crc32c_x8nmodp(length2), crc1) ^ crc2;
+}
+
+int checksum_range(int fd, off_t offset, off_t length, uint32_t *crc) {
+    // Small ranges are read into a buffer
+    if (length < CHECKSUM_MAP_MIN) {
+        unsigned char buffer[CHECKSUM_BUFFER_SIZE];
+        while (length > 0) {
+            size_t want = length < CHECKSUM_BUFFER_SIZE ? (size_t)length : CHECKSUM_BUFFER_SIZE;
+            ssize_t n = pread(fd, buffer, want, offset);
+            if (n == -1 && errno == EINTR) continue;
+            if (n <= 0) return -1;  // File shrank or could not be read
+            *crc = crc32c(*crc, buffer, n);
+            offset += n;
+            length -= n;
+        }
+        return 0;
+    }
+
+    // Larger ones are mapped a window at a time, so the data is not copied
+    off_t pageMask = sysconf(_SC_PAGESIZE) - 1;
+    while (length > 0) {
+        off_t start = offset & ~pageMask;
+        size_t skip = offset - start;
+        size_t size = length + skip < CHECKSUM_MAP_SIZE ? (size_t)(length + skip) : CHECKSUM_MAP_SIZE;
+        void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, start);
+        if (map == MAP_FAILED) {
+            perror("mmap");
+            return -1;
+        }
+        madvise(map, size, MADV_SEQUENTIAL);
+        *crc = crc32c(*crc, (unsigned char *)map + skip, size - skip);
+        munmap(map, size);
+        offset += size - skip;
+        length -= size - skip;
+    }
+    return 0;
+}
+
+int checksum_file(int fd, const MyzExtent *extents, uint32_t count, off_t size, uint32_t *crc) {
+    *crc = 0;
+    if (extents == NULL)
+        return checksum_range(fd, 0, size, crc);
+    for (uint32_t i = 0; i < count; i++) {
+        if (checksum_range(fd, extents[i].offset, extents[i].length, crc) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+int checksum_store(MyzNode *entry, uint32_t crc, uint64_t size) {
+    MyzChecksum checksum;
+    memset(&checksum, 0, sizeof(checksum));
+    checksum.crc32c = crc;
+    checksum.size = size;
+    return extra_add(entry, MYZ_EXTRA_CHECKSUM, &checksum, sizeof(checksum));
+}
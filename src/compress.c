@@ -0,0 +1,760 @@
+#include "compress.h"
+#include "datamove.h"
+#include "extra.h"
+#include "sparse.h"
+#include "checksum.h"
+#include <pthread.h>
+
+typedef enum {
+    JOB_FREE,       // Slot not in use
+    JOB_QUEUED,     // Waiting for a worker
+    JOB_RUNNING,    // Being compressed by a worker
+    JOB_DONE,       // Compressed output is ready
+    JOB_FAILED      // The chunk could not be read or compressed
+} job_state;
+
+// A chunk of a file to be compressed as an independent gzip member
+typedef struct {
+    MyzNode *entry;         // Entry the chunk belongs to
+    int fd;                 // Source file descriptor
+    off_t offset;           // Offset of the chunk in the stored data of the file
+    const MyzExtent *extents;   // Data extents of a sparse file, or NULL
+    uint32_t extentCount;
+    size_t length;          // Number of source bytes in the chunk
+    bool first;             // First chunk of the entry
+    bool last;              // Last chunk of the entry
+    unsigned char *out;     // Compressed output
+    size_t outCapacity;     // Allocated size of the output buffer
+    size_t outSize;         // Number of compressed bytes
+    uint32_t crc;           // CRC32C of the source bytes
+    job_state state;
+} CompressJob;
+
+struct compress_pool {
+    pthread_t *threads;
+    int numThreads;
+    CompressJob *jobs;      // Ring buffer of jobs, in archive order
+    int capacity;
+    int head;               // Oldest job, the next one to be written
+    int count;              // Number of jobs in the ring
+    int next;               // Next job to hand to a worker
+    int queued;             // Number of jobs not yet taken by a worker
+    bool stop;
+    pthread_mutex_t lock;
+    pthread_cond_t workAvailable;
+    pthread_cond_t jobDone;
+    int archiveFd;
+    off_t *archiveOffset;
+    bool framed;            // Prefix gzip members with their length
+    MyzBlock *blocks;       // Block index of the entry being written
+    uint32_t blockCount;
+    uint32_t blockCapacity;
+    uint32_t crc;           // CRC32C of the entry being written, up to the last written block
+    uint64_t crcLength;     // Source bytes covered by crc
+    int error;
+};
+
+// Function to compress one chunk of a file into a gzip member
+static int compress_chunk(CompressJob *job, unsigned char *in) {
+    // Read the source data of the chunk. Only the data extents of sparse files are stored
+    if (job->extents != NULL) {
+        if (sparse_pread(job->fd, job->extents, job->extentCount, in, job->length, job->offset) != (ssize_t)job->length)
+            return -1;
+    } else {
+        size_t done = 0;
+        while (done < job->length) {
+            ssize_t n = pread(job->fd, in + done, job->length - done, job->offset + done);
+            if (n == -1 && errno == EINTR) continue;
+            if (n <= 0) return -1;  // File shrank or could not be read
+            done += n;
+        }
+    }
+    // The source is in cache here, so the checksum costs one more pass over memory
+    job->crc = crc32c(0, in, job->length);
+
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    // windowBits 15 + 16 writes a gzip wrapper, so the data stays readable by gunzip
+    if (deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+
+    size_t bound = deflateBound(&strm, job->length);
+    if (job->outCapacity < bound) {
+        unsigned char *out = realloc(job->out, bound);
+        if (out == NULL) {
+            deflateEnd(&strm);
+            return -1;
+        }
+        job->out = out;
+        job->outCapacity = bound;
+    }
+
+    strm.next_in = in;
+    strm.avail_in = job->length;
+    strm.next_out = job->out;
+    strm.avail_out = job->outCapacity;
+    int ret = deflate(&strm, Z_FINISH);
+    job->outSize = strm.total_out;
+    deflateEnd(&strm);
+
+    return ret == Z_STREAM_END ? 0 : -1;
+}
+
+// Worker thread: compress queued chunks until the pool is stopped
+static void *compress_worker(void *arg) {
+    CompressPool pool = arg;
+    unsigned char *in = malloc(COMPRESS_CHUNK_SIZE);
+
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (!pool->stop && pool->queued == 0)
+            pthread_cond_wait(&pool->workAvailable, &pool->lock);
+        if (pool->queued == 0)
+            break;  // Stopped and nothing left to do
+
+        // Skip raw writes queued between compression jobs
+        while (pool->jobs[pool->next].state != JOB_QUEUED)
+            pool->next = (pool->next + 1) % pool->capacity;
+        CompressJob *job = &pool->jobs[pool->next];
+        pool->next = (pool->next + 1) % pool->capacity;
+        pool->queued--;
+        job->state = JOB_RUNNING;
+        pthread_mutex_unlock(&pool->lock);
+
+        int ret = (in != NULL) ? compress_chunk(job, in) : -1;
+
+        pthread_mutex_lock(&pool->lock);
+        job->state = (ret == 0) ? JOB_DONE : JOB_FAILED;
+        pthread_cond_broadcast(&pool->jobDone);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    free(in);
+    return NULL;
+}
+
+// Function to store a 32-bit value in little-endian order
+static void put_le32(unsigned char *p, uint32_t value) {
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+// Function to write the output of a compressed chunk, with its frame if needed
+static int write_job_output(CompressPool pool, CompressJob *job) {
+    unsigned char frame[4], end[4] = {0, 0, 0, 0};
+    struct iovec iov[3];
+    int count = 0;
+
+    if (pool->framed) {
+        put_le32(frame, job->outSize);
+        iov[count++] = (struct iovec){frame, sizeof(frame)};
+    }
+
+    // Record where the gzip member of the block starts
+    if (pool->blockCount == pool->blockCapacity) {
+        size_t capacity = pool->blockCapacity ? pool->blockCapacity * 2 : 64;
+        MyzBlock *blocks = realloc(pool->blocks, capacity * sizeof(MyzBlock));
+        if (blocks == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        pool->blocks = blocks;
+        pool->blockCapacity = capacity;
+    }
+    pool->blocks[pool->blockCount].offset = *pool->archiveOffset - job->entry->data_offset +
+                                            (pool->framed ? sizeof(frame) : 0);
+    pool->blocks[pool->blockCount].size = job->outSize;
+    pool->blockCount++;
+
+    iov[count++] = (struct iovec){job->out, job->outSize};
+    if (pool->framed && job->last)
+        iov[count++] = (struct iovec){end, sizeof(end)};
+
+    size_t total = 0;
+    for (int i = 0; i < count; i++)
+        total += iov[i].iov_len;
+
+    if (writev_all(pool->archiveFd, iov, count) == -1) {
+        perror("write");
+        return -1;
+    }
+    job->entry->data_size += total;
+    *pool->archiveOffset += total;
+    pool->crc = crc32c_combine(pool->crc, job->crc, job->length);
+    pool->crcLength += job->length;
+
+    // The block index and the checksum are complete with the last block of the entry
+    if (job->last) {
+        MyzBlockIndex index = {COMPRESS_CHUNK_SIZE, pool->blockCount};
+        size_t size = sizeof(index) + pool->blockCount * sizeof(MyzBlock);
+        unsigned char *data = malloc(size);
+        if (data == NULL) {
+            perror("malloc");
+            return -1;
+        }
+        memcpy(data, &index, sizeof(index));
+        memcpy(data + sizeof(index), pool->blocks, pool->blockCount * sizeof(MyzBlock));
+        int ret = extra_add(job->entry, MYZ_EXTRA_BLOCKS, data, size);
+        free(data);
+        if (ret == -1 || checksum_store(job->entry, pool->crc, pool->crcLength) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+// Function to wait for the oldest job and write its output to the archive
+static int write_head(CompressPool pool) {
+    CompressJob *job = &pool->jobs[pool->head];
+
+    pthread_mutex_lock(&pool->lock);
+    while (job->state == JOB_QUEUED || job->state == JOB_RUNNING)
+        pthread_cond_wait(&pool->jobDone, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+
+    if (job->state == JOB_FAILED) {
+        fprintf(stderr, "compress: failed to compress '%s'\n", job->entry->path);
+        pool->error = -1;
+    } else if (pool->error == 0 && job->entry == NULL) {
+        // Raw bytes queued with compress_pool_write
+        if (write_all(pool->archiveFd, job->out, job->outSize) == -1) {
+            perror("write");
+            pool->error = -1;
+        }
+        *pool->archiveOffset += job->outSize;
+    } else if (pool->error == 0) {
+        if (job->first) {
+            job->entry->data_offset = *pool->archiveOffset;
+            job->entry->data_size = 0;
+            pool->blockCount = 0;
+            pool->crc = 0;
+            pool->crcLength = 0;
+        }
+        if (write_job_output(pool, job) == -1)
+            pool->error = -1;
+    }
+
+    if (job->last)
+        close(job->fd);
+
+    // Release the slot
+    pthread_mutex_lock(&pool->lock);
+    job->state = JOB_FREE;
+    pool->head = (pool->head + 1) % pool->capacity;
+    pool->count--;
+    pthread_mutex_unlock(&pool->lock);
+
+    return pool->error;
+}
+
+int compress_default_threads(void) {
+    // sysconf reads the online CPUs from /sys, which is too slow to do for every member
+    static int threads = 0;
+    int n = __atomic_load_n(&threads, __ATOMIC_RELAXED);
+    if (n == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        n = online > 0 ? (int)online : 1;
+        __atomic_store_n(&threads, n, __ATOMIC_RELAXED);
+    }
+    return n;
+}
+
+CompressPool compress_pool_create(int numThreads, int archiveFd, off_t *archiveOffset, bool framed) {
+    if (numThreads < 1)
+        numThreads = 1;
+
+    CompressPool pool = calloc(1, sizeof(*pool));
+    if (pool == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    pool->numThreads = numThreads;
+    pool->capacity = numThreads * COMPRESS_JOBS_PER_THREAD;
+    pool->jobs = calloc(pool->capacity, sizeof(CompressJob));
+    pool->threads = malloc(numThreads * sizeof(pthread_t));
+    pool->archiveFd = archiveFd;
+    pool->archiveOffset = archiveOffset;
+    pool->framed = framed;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->workAvailable, NULL);
+    pthread_cond_init(&pool->jobDone, NULL);
+    if (pool->jobs == NULL || pool->threads == NULL) {
+        perror("malloc");
+        pool->numThreads = 0;
+        pool->capacity = 0;
+        compress_pool_destroy(pool);
+        return NULL;
+    }
+
+    for (int i = 0; i < numThreads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, compress_worker, pool) != 0) {
+            perror("pthread_create");
+            pool->numThreads = i;
+            break;
+        }
+    }
+
+    if (pool->numThreads == 0) {
+        compress_pool_destroy(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+int compress_pool_submit(CompressPool pool, MyzNode *entry, int fileFd) {
+    // Split the file into chunks. Empty files still get one (empty) gzip member
+    uint32_t extentCount = 0;
+    const MyzExtent *extents = extra_extents(entry, &extentCount);
+    off_t size = extents != NULL ? sparse_data_size(extents, extentCount) : entry->stat.st_size;
+    off_t numChunks = (size + COMPRESS_CHUNK_SIZE - 1) / COMPRESS_CHUNK_SIZE;
+    if (numChunks == 0)
+        numChunks = 1;
+
+    for (off_t i = 0; i < numChunks; i++) {
+        // Make room in the ring by writing out the oldest job
+        if (pool->count == pool->capacity && write_head(pool) == -1) {
+            if (i == 0) {
+                close(fileFd);  // No queued chunk owns the descriptor yet
+            } else {
+                // The newest queued chunk now closes the descriptor
+                pthread_mutex_lock(&pool->lock);
+                pool->jobs[(pool->head + pool->count - 1) % pool->capacity].last = true;
+                pthread_mutex_unlock(&pool->lock);
+            }
+            return -1;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        CompressJob *job = &pool->jobs[(pool->head + pool->count) % pool->capacity];
+        job->entry = entry;
+        job->fd = fileFd;
+        job->offset = i * COMPRESS_CHUNK_SIZE;
+        job->extents = extents;
+        job->extentCount = extentCount;
+        job->length = (i == numChunks - 1) ? (size_t)(size - job->offset) : COMPRESS_CHUNK_SIZE;
+        job->first = (i == 0);
+        job->last = (i == numChunks - 1);
+        job->outSize = 0;
+        job->state = JOB_QUEUED;
+        pool->count++;
+        pool->queued++;
+        pthread_cond_signal(&pool->workAvailable);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return pool->error;
+}
+
+int compress_pool_write(CompressPool pool, const void *data, size_t size) {
+    if (pool->count == pool->capacity && write_head(pool) == -1)
+        return -1;
+
+    // The job is complete from the start; it only keeps its place in the ring
+    CompressJob *job = &pool->jobs[(pool->head + pool->count) % pool->capacity];
+    if (job->outCapacity < size) {
+        unsigned char *out = realloc(job->out, size);
+        if (out == NULL)
+            return -1;
+        job->out = out;
+        job->outCapacity = size;
+    }
+    memcpy(job->out, data, size);
+    job->outSize = size;
+    job->entry = NULL;
+    job->fd = -1;
+    job->first = false;
+    job->last = false;
+
+    pthread_mutex_lock(&pool->lock);
+    job->state = JOB_DONE;
+    pool->count++;
+    pthread_mutex_unlock(&pool->lock);
+
+    return pool->error;
+}
+
+int compress_pool_drain(CompressPool pool) {
+    while (pool->count > 0) {
+        write_head(pool);
+    }
+    return pool->error;
+}
+
+void compress_pool_destroy(CompressPool pool) {
+    // Let the workers finish what is queued and exit
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->workAvailable);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->numThreads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    // Close the files of entries that were never fully written
+    for (int i = 0; i < pool->count; i++) {
+        CompressJob *job = &pool->jobs[(pool->head + i) % pool->capacity];
+        if (job->last)
+            close(job->fd);
+    }
+
+    for (int i = 0; i < pool->capacity; i++)
+        free(pool->jobs[i].out);
+    free(pool->blocks);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->workAvailable);
+    pthread_cond_destroy(&pool->jobDone);
+    free(pool->jobs);
+    free(pool->threads);
+    free(pool);
+}
+
+int decompress_data(int archiveFd, off_t offset, off_t size, int outFd) {
+    unsigned char *in = malloc(DECOMPRESS_BUFFER_SIZE);
+    unsigned char *out = malloc(DECOMPRESS_BUFFER_SIZE);
+    if (in == NULL || out == NULL) {
+        free(in);
+        free(out);
+        return -1;
+    }
+
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    // windowBits 15 + 16 accepts only gzip wrapped data
+    if (inflateInit2(&strm, 15 + 16) != Z_OK) {
+        free(in);
+        free(out);
+        return -1;
+    }
+
+    int ret = Z_OK;
+    off_t remaining = size;
+    while (remaining > 0) {
+        // Refill the input buffer from the archive
+        size_t want = remaining < DECOMPRESS_BUFFER_SIZE ? (size_t)remaining : DECOMPRESS_BUFFER_SIZE;
+        ssize_t n = pread(archiveFd, in, want, offset);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            ret = Z_DATA_ERROR;
+            break;
+        }
+        offset += n;
+        remaining -= n;
+        strm.next_in = in;
+        strm.avail_in = n;
+
+        // Inflate until the input is consumed and the output is flushed
+        do {
+            strm.next_out = out;
+            strm.avail_out = DECOMPRESS_BUFFER_SIZE;
+            ret = inflate(&strm, Z_NO_FLUSH);
+            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+                goto done;
+
+            if (write_all(outFd, out, DECOMPRESS_BUFFER_SIZE - strm.avail_out) == -1) {
+                perror("write");
+                ret = Z_ERRNO;
+                goto done;
+            }
+
+            // Continue with the next gzip member, if any
+            if (ret == Z_STREAM_END && (strm.avail_in > 0 || remaining > 0)) {
+                inflateReset(&strm);
+                ret = Z_OK;
+            }
+        } while (strm.avail_out == 0 || strm.avail_in > 0);
+    }
+
+done:
+    inflateEnd(&strm);
+    free(in);
+    free(out);
+
+    if (ret != Z_STREAM_END && size > 0) {
+        fprintf(stderr, "decompress: corrupt compressed data\n");
+        return -1;
+    }
+    return 0;
+}
+
+int decompress_frames(int inFd, int outFd, const MyzNode *entry, bool inOrder) {
+    uint32_t extentCount = 0;
+    const MyzExtent *extents = entry != NULL ? extra_extents(entry, &extentCount) : NULL;
+    off_t dataOffset = 0;   // Offset of the inflated data in the stored data
+
+    unsigned char *in = NULL;
+    size_t inCapacity = 0;
+    unsigned char *out = malloc(DECOMPRESS_BUFFER_SIZE);
+    if (out == NULL)
+        return -1;
+
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, 15 + 16) != Z_OK) {
+        free(out);
+        return -1;
+    }
+
+    int ret = 0;
+    while (true) {
+        // Read the length of the next frame
+        unsigned char frame[4];
+        if (read_all(inFd, frame, sizeof(frame)) != sizeof(frame)) {
+            ret = -1;
+            break;
+        }
+        uint32_t length = frame[0] | frame[1] << 8 | frame[2] << 16 | (uint32_t)frame[3] << 24;
+        if (length == 0)
+            break;  // End of the entry
+
+        if (inCapacity < length) {
+            unsigned char *p = realloc(in, length);
+            if (p == NULL) {
+                ret = -1;
+                break;
+            }
+            in = p;
+            inCapacity = length;
+        }
+        if (read_all(inFd, in, length) != (ssize_t)length) {
+            ret = -1;
+            break;
+        }
+        if (outFd == -1)
+            continue;   // Skipped entry
+
+        // Every frame holds one complete gzip member
+        inflateReset(&strm);
+        strm.next_in = in;
+        strm.avail_in = length;
+        int zret;
+        do {
+            strm.next_out = out;
+            strm.avail_out = DECOMPRESS_BUFFER_SIZE;
+            zret = inflate(&strm, Z_NO_FLUSH);
+            if (zret != Z_OK && zret != Z_STREAM_END)
+                break;
+            size_t produced = DECOMPRESS_BUFFER_SIZE - strm.avail_out;
+            int wret = extents == NULL ? write_all(outFd, out, produced)
+                       : inOrder ? sparse_write(outFd, extents, extentCount, out, produced, dataOffset)
+                                 : sparse_pwrite(outFd, extents, extentCount, out, produced, dataOffset);
+            if (wret == -1) {
+                perror("write");
+                zret = Z_ERRNO;
+                break;
+            }
+            dataOffset += produced;
+        } while (zret != Z_STREAM_END);
+
+        if (zret != Z_STREAM_END) {
+            ret = -1;
+            break;
+        }
+    }
+
+    inflateEnd(&strm);
+    free(in);
+    free(out);
+
+    if (ret == -1)
+        fprintf(stderr, "decompress: corrupt or truncated stream\n");
+    return ret;
+}
+
+// Function to inflate one block, a complete gzip member, into a buffer
+static ssize_t inflate_block(unsigned char *in, size_t inSize, unsigned char *out, size_t outCapacity) {
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, 15 + 16) != Z_OK)
+        return -1;
+
+    strm.next_in = in;
+    strm.avail_in = inSize;
+    strm.next_out = out;
+    strm.avail_out = outCapacity;
+    int ret = inflate(&strm, Z_FINISH);
+    ssize_t size = strm.total_out;
+    inflateEnd(&strm);
+
+    return ret == Z_STREAM_END ? size : -1;
+}
+
+// Function to read and inflate block i of an entry
+static ssize_t read_block(int archiveFd, const MyzNode *entry, const MyzBlockIndex *index, uint32_t i,
+                          unsigned char **in, size_t *inCapacity, unsigned char *out) {
+    const MyzBlock *block = &extra_block_list(index)[i];
+    if (*inCapacity < block->size) {
+        unsigned char *p = realloc(*in, block->size);
+        if (p == NULL)
+            return -1;
+        *in = p;
+        *inCapacity = block->size;
+    }
+
+    ssize_t n = pread(archiveFd, *in, block->size, entry->data_offset + block->offset);
+    if (n != (ssize_t)block->size)
+        return -1;
+    return inflate_block(*in, block->size, out, index->block_size);
+}
+
+// Function to check if an entry has a block index that extra_blocks rejects. Its data
+// cannot be inflated as one stream either
+static bool corrupt_blocks(const MyzNode *entry) {
+    if (extra_find(entry, MYZ_EXTRA_BLOCKS, NULL) == NULL)
+        return false;
+    fprintf(stderr, "decompress: corrupt block index of '%s'\n", entry->path);
+    return true;
+}
+
+int decompress_range(int archiveFd, const MyzNode *entry, off_t offset, off_t length, int outFd) {
+    const MyzBlockIndex *index = extra_blocks(entry);
+    if (index == NULL) {
+        if (corrupt_blocks(entry))
+            return -1;
+        // Without a block index only the whole data can be inflated
+        if (offset != 0 || length < entry->stat.st_size)
+            return -1;
+        return decompress_data(archiveFd, entry->data_offset, entry->data_size, outFd);
+    }
+
+    unsigned char *in = NULL;
+    size_t inCapacity = 0;
+    unsigned char *out = malloc(index->block_size);
+    if (out == NULL)
+        return -1;
+
+    // Start at the block that holds the first requested byte
+    uint32_t extentCount = 0;
+    const MyzExtent *extents = extra_extents(entry, &extentCount);
+    int ret = 0;
+    for (uint32_t i = offset / index->block_size; i < index->count && length > 0; i++) {
+        ssize_t n = read_block(archiveFd, entry, index, i, &in, &inCapacity, out);
+        if (n == -1) {
+            fprintf(stderr, "decompress: corrupt block %u of '%s'\n", i, entry->path);
+            ret = -1;
+            break;
+        }
+
+        off_t skip = offset - (off_t)i * index->block_size;
+        if (skip < 0)
+            skip = 0;
+        off_t take = n - skip;
+        if (take > length)
+            take = length;
+        if (take > 0 && (extents != NULL ? sparse_write(outFd, extents, extentCount, out + skip, take,
+                                                        (off_t)i * index->block_size + skip)
+                                         : write_all(outFd, out + skip, take)) == -1) {
+            perror("write");
+            ret = -1;
+            break;
+        }
+        length -= take > 0 ? take : 0;
+    }
+
+    free(in);
+    free(out);
+    return ret;
+}
+
+int decompress_checksum(int archiveFd, const MyzNode *entry, uint32_t first, uint32_t count,
+                        uint32_t *crc, uint64_t *length) {
+    const MyzBlockIndex *index = extra_blocks(entry);
+    if (index == NULL || first > index->count || count > index->count - first)
+        return -1;
+
+    unsigned char *in = NULL;
+    size_t inCapacity = 0;
+    unsigned char *out = malloc(index->block_size);
+    int ret = out != NULL ? 0 : -1;
+    *crc = 0;
+    *length = 0;
+
+    for (uint32_t i = first; i < first + count && ret == 0; i++) {
+        ssize_t n = read_block(archiveFd, entry, index, i, &in, &inCapacity, out);
+        if (n == -1) {
+            ret = -1;
+            break;
+        }
+        *crc = crc32c(*crc, out, n);
+        *length += n;
+    }
+
+    free(in);
+    free(out);
+    return ret;
+}
+
+// State shared by the threads that inflate the blocks of one entry
+typedef struct {
+    int archiveFd;
+    const MyzNode *entry;
+    const MyzBlockIndex *index;
+    const MyzExtent *extents;   // Data extents of a sparse file, or NULL
+    uint32_t extentCount;
+    int outFd;
+    uint32_t next;          // Next block to inflate
+    int error;
+} BlockJob;
+
+// Worker thread: inflate blocks and write them at their place in the output file
+static void *block_worker(void *arg) {
+    BlockJob *job = arg;
+    unsigned char *in = NULL;
+    size_t inCapacity = 0;
+    unsigned char *out = malloc(job->index->block_size);
+
+    while (out != NULL) {
+        uint32_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (i >= job->index->count || __atomic_load_n(&job->error, __ATOMIC_RELAXED))
+            break;
+
+        ssize_t n = read_block(job->archiveFd, job->entry, job->index, i, &in, &inCapacity, out);
+        off_t dataOffset = (off_t)i * job->index->block_size;
+        if (n == -1 || (job->extents != NULL
+                        ? sparse_pwrite(job->outFd, job->extents, job->extentCount, out, n, dataOffset)
+                        : pwrite_all(job->outFd, out, n, dataOffset)) == -1) {
+            fprintf(stderr, "decompress: failed on block %u of '%s'\n", i, job->entry->path);
+            __atomic_store_n(&job->error, -1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+
+    if (out == NULL)
+        __atomic_store_n(&job->error, -1, __ATOMIC_RELAXED);
+    free(in);
+    free(out);
+    return NULL;
+}
+
+int decompress_blocks(int archiveFd, const MyzNode *entry, int outFd, int numThreads) {
+    const MyzBlockIndex *index = extra_blocks(entry);
+    if (index == NULL)
+        return corrupt_blocks(entry) ? -1 : decompress_data(archiveFd, entry->data_offset, entry->data_size, outFd);
+
+    // Small entries are not worth starting threads for. Sparse entries are written
+    // extent by extent, so they always go through the block writer
+    uint32_t extentCount = 0;
+    const MyzExtent *extents = extra_extents(entry, &extentCount);
+    if (numThreads > (int)index->count)
+        numThreads = index->count;
+    if (numThreads <= 1 && extents == NULL)
+        return decompress_range(archiveFd, entry, 0, entry->stat.st_size, outFd);
+
+    BlockJob job = {archiveFd, entry, index, extents, extentCount, outFd, 0, 0};
+    pthread_t *threads = malloc(numThreads * sizeof(pthread_t));
+    int started = 0;
+    for (int i = 0; i < numThreads && numThreads > 1; i++) {
+        if (pthread_create(&threads[i], NULL, block_worker, &job) != 0)
+            break;
+        started++;
+    }
+    if (started == 0)
+        block_worker(&job);     // One or no threads: inflate in this one
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    return job.error;
+}
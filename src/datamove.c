@@ -0,0 +1,297 @@
+#include "datamove.h"
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <limits.h>
+
+// Members and bytes moved through each path
+static struct {
+    uint64_t members;
+    uint64_t bytes;
+} move_stats[MOVE_NUM_PATHS];
+
+static const char *move_path_names[MOVE_NUM_PATHS] = {
+    "clone", "copy_file_range", "sendfile", "splice", "buffer", "io_uring"
+};
+
+// Set once a filesystem refuses to clone, so later members do not try again
+static bool move_clone_unsupported = false;
+
+// Function to check whether an error means the path is not usable for these files
+static bool move_unsupported(int err) {
+    return err == EXDEV || err == EINVAL || err == ENOSYS || err == EOPNOTSUPP ||
+           err == ENOTSUP || err == EBADF || err == ESPIPE;
+}
+
+// Function to move data through a pipe with splice
+static ssize_t move_splice(int inFd, off_t *inOffset, int outFd, size_t size) {
+    int pipeFds[2];
+    if (pipe(pipeFds) == -1)
+        return -1;
+    fcntl(pipeFds[1], F_SETPIPE_SZ, MOVE_PIPE_SIZE);
+
+    unsigned char buffer[64 * 1024];
+    bool drainByWrite = false;
+    ssize_t total = 0;
+    while ((size_t)total < size) {
+        ssize_t n = splice(inFd, inOffset, pipeFds[1], NULL, size - total, SPLICE_F_MOVE);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) continue;
+            if (total == 0) total = n;
+            break;
+        }
+
+        // Drain the pipe into the output. Data left in the pipe would be lost, so an
+        // output that takes no splice, such as a file opened for appending, gets it
+        // through a buffer
+        ssize_t left = n;
+        while (left > 0) {
+            ssize_t m = drainByWrite ? -1 : splice(pipeFds[0], NULL, outFd, NULL, left, SPLICE_F_MOVE);
+            if (m == -1 && errno == EINTR) continue;
+            if (m == -1 && (drainByWrite || move_unsupported(errno))) {
+                drainByWrite = true;
+                m = read(pipeFds[0], buffer, left < (ssize_t)sizeof(buffer) ? (size_t)left : sizeof(buffer));
+                if (m > 0 && write_all(outFd, buffer, m) == -1)
+                    m = -1;
+            }
+            if (m <= 0) {
+                close(pipeFds[0]);
+                close(pipeFds[1]);
+                errno = EIO;
+                return -1;
+            }
+            left -= m;
+        }
+        total += n;
+    }
+
+    close(pipeFds[0]);
+    close(pipeFds[1]);
+    return total;
+}
+
+// Function to move data through a user space buffer
+static ssize_t move_buffer(int inFd, off_t *inOffset, int outFd, size_t size) {
+    static __thread unsigned char *buffer = NULL;
+    if (buffer == NULL && posix_memalign((void **)&buffer, 4096, MOVE_BUFFER_SIZE) != 0) {
+        buffer = NULL;
+        errno = ENOMEM;
+        return -1;
+    }
+
+    size_t want = size < MOVE_BUFFER_SIZE ? size : MOVE_BUFFER_SIZE;
+    ssize_t n = (inOffset != NULL) ? pread(inFd, buffer, want, *inOffset) : read(inFd, buffer, want);
+    if (n <= 0)
+        return n;
+    if (write_all(outFd, buffer, n) == -1)
+        return -1;
+    if (inOffset != NULL)
+        *inOffset += n;
+    return n;
+}
+
+off_t move_block_size(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_blksize <= 0)
+        return 4096;
+    return st.st_blksize;
+}
+
+bool move_clone_possible(off_t inOffset) {
+    return !__atomic_load_n(&move_clone_unsupported, __ATOMIC_RELAXED) && inOffset >= 0 && inOffset % 512 == 0;
+}
+
+// Function to clone the whole blocks of size bytes at inOffset of inFd to the current
+// position of outFd, and move past them. Returns the number of bytes cloned, or 0
+// if the data is not block aligned or the files cannot share extents
+static off_t move_clone(int inFd, off_t inOffset, int outFd, off_t size) {
+    // No block is smaller than a sector: most unaligned data is ruled out without a system call
+    if (!move_clone_possible(inOffset) || size < 512)
+        return 0;
+
+    // The tail of the data is not a whole block, and only the end of a file can be
+    // cloned partially, so it is left to the copy
+    off_t blockSize = move_block_size(inFd);
+    off_t outOffset = lseek(outFd, 0, SEEK_CUR);
+    off_t length = size / blockSize * blockSize;
+    if (length == 0 || outOffset == -1 || inOffset % blockSize != 0 || outOffset % blockSize != 0)
+        return 0;
+    struct file_clone_range range = {inFd, (uint64_t)inOffset, (uint64_t)length, (uint64_t)outOffset};
+    if (ioctl(outFd, FICLONERANGE, &range) == -1) {
+        if (errno == EXDEV || errno == EOPNOTSUPP || errno == ENOTTY || errno == ENOSYS)
+            __atomic_store_n(&move_clone_unsupported, true, __ATOMIC_RELAXED);
+        return 0;
+    }
+    if (lseek(outFd, outOffset + length, SEEK_SET) == -1)
+        return -1;
+    return length;
+}
+
+int move_data(int inFd, off_t inOffset, int outFd, off_t size) {
+    move_path path = MOVE_CLONE;
+    off_t *inOff = (inOffset >= 0) ? &inOffset : NULL;
+    off_t done = 0;
+
+    // Share the whole blocks of aligned data, and copy the rest
+    if (inOff != NULL) {
+        done = move_clone(inFd, inOffset, outFd, size);
+        if (done == -1) {
+            perror("move_data");
+            return -1;
+        }
+        __atomic_fetch_add(&move_stats[MOVE_CLONE].bytes, done, __ATOMIC_RELAXED);
+        inOffset += done;
+    }
+    if (done == 0 || done < size)
+        path = MOVE_COPY_FILE_RANGE;
+
+    while (done < size) {
+        size_t want = (size - done) > SSIZE_MAX ? SSIZE_MAX : (size_t)(size - done);
+        ssize_t n;
+        switch (path) {
+            case MOVE_COPY_FILE_RANGE:
+                n = copy_file_range(inFd, inOff, outFd, NULL, want, 0);
+                break;
+            case MOVE_SENDFILE:
+                n = sendfile(outFd, inFd, inOff, want);
+                break;
+            case MOVE_SPLICE:
+                n = move_splice(inFd, inOff, outFd, want);
+                break;
+            default:
+                n = move_buffer(inFd, inOff, outFd, want);
+                break;
+        }
+
+        if (n > 0) {
+            __atomic_fetch_add(&move_stats[path].bytes, n, __ATOMIC_RELAXED);
+            done += n;
+            continue;
+        }
+        if (n == -1 && errno == EINTR)
+            continue;
+
+        // Nothing was moved: try the next path. Special files may report 0 bytes
+        // instead of an error. Only the plain buffer copy treats 0 as end of file
+        if (path != MOVE_BUFFER && (n == 0 || move_unsupported(errno))) {
+            path++;
+            continue;
+        }
+
+        if (n == 0)
+            fprintf(stderr, "move_data: unexpected end of file\n");
+        else
+            perror("move_data");
+        return -1;
+    }
+
+    __atomic_fetch_add(&move_stats[path].members, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+ssize_t read_all(int fd, void *buffer, size_t size) {
+    unsigned char *p = buffer;
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = read(fd, p + done, size - done);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0)
+            break;  // End of file
+        done += n;
+    }
+    return done;
+}
+
+int discard_data(int fd, off_t size) {
+    // Seek over the data when possible
+    if (lseek(fd, size, SEEK_CUR) != -1)
+        return 0;
+
+    unsigned char buffer[64 * 1024];
+    while (size > 0) {
+        size_t want = size < (off_t)sizeof(buffer) ? (size_t)size : sizeof(buffer);
+        if (read_all(fd, buffer, want) != (ssize_t)want)
+            return -1;
+        size -= want;
+    }
+    return 0;
+}
+
+int write_all(int fd, const void *buffer, size_t size) {
+    const unsigned char *p = buffer;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+int pwrite_all(int fd, const void *buffer, size_t size, off_t offset) {
+    const unsigned char *p = buffer;
+    while (size > 0) {
+        ssize_t n = pwrite(fd, p, size, offset);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        size -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+int write_zeros(int fd, off_t size) {
+    static const unsigned char zeros[64 * 1024];
+    while (size > 0) {
+        size_t want = size < (off_t)sizeof(zeros) ? (size_t)size : sizeof(zeros);
+        if (write_all(fd, zeros, want) == -1)
+            return -1;
+        size -= want;
+    }
+    return 0;
+}
+
+int writev_all(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t n = writev(fd, iov, count < IOV_MAX ? count : IOV_MAX);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        // Skip the buffers that were written completely
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        // Continue from the middle of a partially written buffer
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+void move_count(move_path path, off_t size) {
+    __atomic_fetch_add(&move_stats[path].members, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&move_stats[path].bytes, size, __ATOMIC_RELAXED);
+}
+
+void move_report(FILE *out) {
+    fprintf(out, "=== Data Transfer ===\n");
+    for (int i = 0; i < MOVE_NUM_PATHS; i++) {
+        fprintf(out, "%-16s %10lu members %14lu bytes\n", move_path_names[i],
+                (unsigned long)move_stats[i].members, (unsigned long)move_stats[i].bytes);
+    }
+}
@@ -0,0 +1,364 @@
+#include "dedup.h"
+#include "datamove.h"
+#include "extra.h"
+#include "sha256.h"
+#include "checksum.h"
+#include "sparse.h"
+
+// Masks of the normalized chunking (FastCDC). Cut points are harder to find
+// before the average chunk size and easier after it
+#define DEDUP_MASK_SMALL 0x0003590703530000ULL
+#define DEDUP_MASK_LARGE 0x0000d90003530000ULL
+
+#define DEDUP_OUT_SIZE (1024 * 1024)    // New chunks are written in batches of this size
+
+// A chunk already stored in the archive
+typedef struct {
+    unsigned char digest[SHA256_DIGEST_LEN];
+    MyzChunk chunk;
+    bool used;
+} DedupSlot;
+
+struct dedup_store {
+    uint64_t gear[256];     // Random values of the rolling hash
+    DedupSlot *slots;       // Hash table of stored chunks
+    size_t capacity;
+    size_t count;
+    unsigned char *in;      // Data read from the file being chunked
+    unsigned char *out;     // New chunks not written yet
+    size_t outLen;
+    uint64_t totalBytes;    // Bytes of file data chunked
+    uint64_t totalChunks;
+    uint64_t storedBytes;   // Bytes written for new chunks
+};
+
+// Function to generate the table of the rolling hash. It is fixed, so the same
+// data is always split at the same places
+static void dedup_init_gear(uint64_t gear[256]) {
+    uint64_t x = 0x6d797a2d63646321ULL;
+    for (int i = 0; i < 256; i++) {
+        // splitmix64
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+// Function to find the length of the next chunk in size bytes of data
+static size_t dedup_cut(const uint64_t gear[256], const unsigned char *data, size_t size) {
+    if (size <= DEDUP_MIN_CHUNK)
+        return size;
+
+    size_t normal = size < DEDUP_AVG_CHUNK ? size : DEDUP_AVG_CHUNK;
+    size_t limit = size < DEDUP_MAX_CHUNK ? size : DEDUP_MAX_CHUNK;
+    uint64_t fp = 0;
+    size_t i = DEDUP_MIN_CHUNK;
+
+    for (; i < normal; i++) {
+        fp = (fp << 1) + gear[data[i]];
+        if ((fp & DEDUP_MASK_SMALL) == 0)
+            return i;
+    }
+    for (; i < limit; i++) {
+        fp = (fp << 1) + gear[data[i]];
+        if ((fp & DEDUP_MASK_LARGE) == 0)
+            return i;
+    }
+    return limit;
+}
+
+// Function to find the slot of a digest: either the stored chunk or an empty slot
+static DedupSlot *dedup_lookup(DedupStore store, const unsigned char *digest) {
+    uint64_t h;
+    memcpy(&h, digest, sizeof(h));
+    size_t i = h & (store->capacity - 1);
+    while (store->slots[i].used && memcmp(store->slots[i].digest, digest, SHA256_DIGEST_LEN) != 0)
+        i = (i + 1) & (store->capacity - 1);
+    return &store->slots[i];
+}
+
+// Function to double the hash table
+static int dedup_grow(DedupStore store) {
+    DedupSlot *old = store->slots;
+    size_t oldCapacity = store->capacity;
+
+    store->capacity *= 2;
+    store->slots = calloc(store->capacity, sizeof(DedupSlot));
+    if (store->slots == NULL) {
+        store->slots = old;
+        store->capacity = oldCapacity;
+        return -1;
+    }
+    for (size_t i = 0; i < oldCapacity; i++) {
+        if (old[i].used)
+            *dedup_lookup(store, old[i].digest) = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+// Function to write the new chunks collected so far to the archive
+static int dedup_flush(DedupStore store, int archiveFd) {
+    if (store->outLen > 0 && write_all(archiveFd, store->out, store->outLen) == -1) {
+        perror("write");
+        return -1;
+    }
+    store->outLen = 0;
+    return 0;
+}
+
+// Function to store one chunk, or find the copy stored before
+static int dedup_add_chunk(DedupStore store, const unsigned char *data, size_t size, bool compress,
+                           int archiveFd, off_t *archiveOffset, MyzChunk *ref) {
+    unsigned char digest[SHA256_DIGEST_LEN];
+    sha256(data, size, digest);
+
+    store->totalBytes += size;
+    store->totalChunks++;
+
+    DedupSlot *slot = dedup_lookup(store, digest);
+    if (slot->used) {
+        *ref = slot->chunk;
+        return 0;
+    }
+
+    // New chunk: deflate it if asked and if that saves space
+    if (store->outLen + compressBound(DEDUP_MAX_CHUNK) > DEDUP_OUT_SIZE && dedup_flush(store, archiveFd) == -1)
+        return -1;
+    unsigned char *dest = store->out + store->outLen;
+    uLongf storedSize = compressBound(size);
+    if (!compress || compress2(dest, &storedSize, data, size, Z_DEFAULT_COMPRESSION) != Z_OK || storedSize >= size) {
+        memcpy(dest, data, size);
+        storedSize = size;
+    }
+
+    ref->offset = *archiveOffset;
+    ref->stored_size = storedSize;
+    ref->size = size;
+    store->outLen += storedSize;
+    *archiveOffset += storedSize;
+    store->storedBytes += storedSize;
+
+    memcpy(slot->digest, digest, SHA256_DIGEST_LEN);
+    slot->chunk = *ref;
+    slot->used = true;
+    store->count++;
+
+    // Keep the table at most half full
+    if (store->count * 2 > store->capacity)
+        return dedup_grow(store);
+    return 0;
+}
+
+DedupStore dedup_create(void) {
+    DedupStore store = calloc(1, sizeof(*store));
+    if (store == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    dedup_init_gear(store->gear);
+    store->capacity = 1024;
+    store->slots = calloc(store->capacity, sizeof(DedupSlot));
+    store->in = malloc(DEDUP_BUFFER_SIZE);
+    store->out = malloc(DEDUP_OUT_SIZE);
+    if (store->slots == NULL || store->in == NULL || store->out == NULL) {
+        perror("malloc");
+        dedup_destroy(store);
+        return NULL;
+    }
+    return store;
+}
+
+int dedup_store_file(DedupStore store, MyzNode *entry, int fileFd, int archiveFd, off_t *archiveOffset) {
+    MyzChunk *refs = NULL;
+    size_t numRefs = 0, refCapacity = 0;
+    uint32_t extentCount;
+    const MyzExtent *extents = extra_extents(entry, &extentCount);
+    off_t dataSize = extents != NULL ? sparse_data_size(extents, extentCount) : entry->stat.st_size;
+    off_t remaining = dataSize;
+    size_t start = 0, end = 0;
+    uint32_t crc = 0;
+    int ret = 0;
+
+    entry->data_offset = *archiveOffset;
+
+    while (true) {
+        // Keep at least one maximum chunk in the buffer while the file has more data
+        if (end - start < DEDUP_MAX_CHUNK && remaining > 0) {
+            memmove(store->in, store->in + start, end - start);
+            end -= start;
+            start = 0;
+            size_t want = DEDUP_BUFFER_SIZE - end;
+            if ((off_t)want > remaining)
+                want = remaining;
+            ssize_t n = extents != NULL ? sparse_pread(fileFd, extents, extentCount, store->in + end, want,
+                                                       dataSize - remaining)
+                                        : read_all(fileFd, store->in + end, want);
+            if (n != (ssize_t)want) {
+                fprintf(stderr, "dedup: failed to read '%s'\n", entry->path);
+                ret = -1;
+                break;
+            }
+            crc = crc32c(crc, store->in + end, n);
+            end += n;
+            remaining -= n;
+        }
+        if (start == end)
+            break;
+
+        size_t length = dedup_cut(store->gear, store->in + start, end - start);
+        if (numRefs == refCapacity) {
+            size_t capacity = refCapacity ? refCapacity * 2 : 64;
+            MyzChunk *grown = realloc(refs, capacity * sizeof(MyzChunk));
+            if (grown == NULL) {
+                perror("realloc");
+                ret = -1;
+                break;
+            }
+            refs = grown;
+            refCapacity = capacity;
+        }
+        if (dedup_add_chunk(store, store->in + start, length, entry->compressed,
+                            archiveFd, archiveOffset, &refs[numRefs]) == -1) {
+            ret = -1;
+            break;
+        }
+        numRefs++;
+        start += length;
+    }
+
+    if (dedup_flush(store, archiveFd) == -1)
+        ret = -1;
+
+    // Only new chunks count as data of this entry
+    entry->data_size = *archiveOffset - entry->data_offset;
+    if (ret == 0 && extra_add(entry, MYZ_EXTRA_CHUNKS, refs, numRefs * sizeof(MyzChunk)) == -1)
+        ret = -1;
+    if (ret == 0 && checksum_store(entry, crc, dataSize) == -1)
+        ret = -1;
+    free(refs);
+    return ret;
+}
+
+void dedup_report(DedupStore store, FILE *out) {
+    double ratio = store->storedBytes ? (double)store->totalBytes / store->storedBytes : 1.0;
+    fprintf(out, "=== Deduplication ===\n");
+    fprintf(out, "Chunks: %lu (%lu unique)\n", (unsigned long)store->totalChunks, (unsigned long)store->count);
+    fprintf(out, "File data: %lu bytes\n", (unsigned long)store->totalBytes);
+    fprintf(out, "Stored data: %lu bytes\n", (unsigned long)store->storedBytes);
+    fprintf(out, "Reduction: %.2fx\n", ratio);
+}
+
+void dedup_destroy(DedupStore store) {
+    free(store->slots);
+    free(store->in);
+    free(store->out);
+    free(store);
+}
+
+// Function to write size bytes of the data of an entry, which start at dataOffset, from
+// the archive at archiveOffset or from buffer when it is not NULL
+static int dedup_write(int archiveFd, off_t archiveOffset, const void *buffer, const MyzNode *entry, int outFd,
+                       off_t size, off_t dataOffset, bool sequential) {
+    uint32_t count;
+    const MyzExtent *extents = extra_extents(entry, &count);
+    if (extents == NULL)
+        return buffer != NULL ? write_all(outFd, buffer, size) : move_data(archiveFd, archiveOffset, outFd, size);
+    if (buffer == NULL)
+        return sparse_move(archiveFd, archiveOffset, outFd, extents, count, size, dataOffset, sequential);
+    return sequential ? sparse_write(outFd, extents, count, buffer, size, dataOffset)
+                      : sparse_pwrite(outFd, extents, count, buffer, size, dataOffset);
+}
+
+int dedup_extract(int archiveFd, const MyzNode *entry, int outFd, bool sequential) {
+    uint32_t count, extentCount;
+    const MyzChunk *chunks = extra_chunks(entry, &count);
+    if (chunks == NULL)
+        return -1;
+    const MyzExtent *extents = extra_extents(entry, &extentCount);
+
+    unsigned char *in = malloc(compressBound(DEDUP_MAX_CHUNK));
+    unsigned char *out = malloc(DEDUP_MAX_CHUNK);
+    off_t runOffset = 0, runSize = 0;   // Raw chunks stored one after the other
+    off_t dataOffset = 0;               // Data written so far
+    int ret = 0;
+    if (in == NULL || out == NULL) {
+        perror("malloc");
+        ret = -1;
+    }
+
+    for (uint32_t i = 0; i <= count && ret == 0; i++) {
+        bool raw = i < count && chunks[i].stored_size == chunks[i].size;
+
+        // Extend the run of raw chunks, or copy it in one go
+        if (raw && runSize > 0 && (off_t)chunks[i].offset == runOffset + runSize) {
+            runSize += chunks[i].size;
+            continue;
+        }
+        if (runSize > 0 && dedup_write(archiveFd, runOffset, NULL, entry, outFd, runSize, dataOffset, sequential) == -1)
+            ret = -1;
+        dataOffset += runSize;
+        runSize = 0;
+
+        if (i == count || ret == -1)
+            break;
+        if (raw) {
+            runOffset = chunks[i].offset;
+            runSize = chunks[i].size;
+            continue;
+        }
+
+        // Deflated chunk
+        uLongf size = DEDUP_MAX_CHUNK;
+        if (chunks[i].stored_size > compressBound(DEDUP_MAX_CHUNK) ||
+            pread(archiveFd, in, chunks[i].stored_size, chunks[i].offset) != chunks[i].stored_size ||
+            uncompress(out, &size, in, chunks[i].stored_size) != Z_OK || size != chunks[i].size ||
+            dedup_write(archiveFd, 0, out, entry, outFd, size, dataOffset, sequential) == -1) {
+            fprintf(stderr, "dedup: corrupt chunk %u of '%s'\n", i, entry->path);
+            ret = -1;
+        }
+        dataOffset += size;
+    }
+
+    // The hole after the last extent, which a file that has the size already has
+    if (ret == 0 && extents != NULL && sequential &&
+        sparse_write_end(outFd, extents, extentCount, entry->stat.st_size) == -1)
+        ret = -1;
+
+    free(in);
+    free(out);
+    return ret;
+}
+
+int dedup_checksum(int archiveFd, const MyzNode *entry, uint32_t *crc) {
+    uint32_t count;
+    const MyzChunk *chunks = extra_chunks(entry, &count);
+    if (chunks == NULL)
+        return -1;
+
+    unsigned char *in = malloc(compressBound(DEDUP_MAX_CHUNK));
+    unsigned char *out = malloc(DEDUP_MAX_CHUNK);
+    int ret = (in != NULL && out != NULL) ? 0 : -1;
+    *crc = 0;
+
+    for (uint32_t i = 0; i < count && ret == 0; i++) {
+        // Raw chunks are read straight from the archive
+        if (chunks[i].stored_size == chunks[i].size) {
+            ret = checksum_range(archiveFd, chunks[i].offset, chunks[i].size, crc);
+            continue;
+        }
+
+        uLongf size = DEDUP_MAX_CHUNK;
+        if (chunks[i].stored_size > compressBound(DEDUP_MAX_CHUNK) ||
+            pread(archiveFd, in, chunks[i].stored_size, chunks[i].offset) != chunks[i].stored_size ||
+            uncompress(out, &size, in, chunks[i].stored_size) != Z_OK || size != chunks[i].size)
+            ret = -1;
+        else
+            *crc = crc32c(*crc, out, size);
+    }
+
+    free(in);
+    free(out);
+    return ret;
+}
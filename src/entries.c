@@ -0,0 +1,213 @@
+#include "entries.h"
+
+void entries_init(EntryTable *table) {
+    memset(table, 0, sizeof(*table));
+}
+
+int entries_reserve(EntryTable *table, size_t count) {
+    if (count <= table->capacity - table->count)
+        return 0;
+
+    // Grow geometrically, so that adding entries one by one stays linear
+    size_t capacity = table->capacity ? table->capacity : 1024;
+    while (capacity - table->count < count)
+        capacity *= 2;
+    MyzNode *entries = realloc(table->entries, capacity * sizeof(MyzNode));
+    if (entries == NULL) {
+        perror("realloc");
+        return -1;
+    }
+    table->entries = entries;
+    table->capacity = capacity;
+    return 0;
+}
+
+MyzNode *entries_add(EntryTable *table) {
+    if (entries_reserve(table, 1) == -1)
+        return NULL;
+    MyzNode *entry = &table->entries[table->count++];
+    memset(entry, 0, sizeof(MyzNode));
+    return entry;
+}
+
+void *entries_alloc(EntryTable *table, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    EntryArenaBlock *block = table->arena;
+    if (block == NULL || size > block->size - block->used) {
+        size_t blockSize = size > ENTRY_ARENA_BLOCK_SIZE ? size : ENTRY_ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(EntryArenaBlock) + blockSize);
+        if (block == NULL) {
+            perror("malloc");
+            return NULL;
+        }
+        block->next = table->arena;
+        block->size = blockSize;
+        block->used = 0;
+        table->arena = block;
+    }
+    void *data = block->data + block->used;
+    block->used += size;
+    return data;
+}
+
+int entries_set_path(EntryTable *table, MyzNode *entry, const char *path) {
+    size_t length = strnlen(path, MAX_PATH_LEN - 1);
+    char *copy = entries_alloc(table, length + 1);
+    if (copy == NULL)
+        return -1;
+    memcpy(copy, path, length);
+    copy[length] = '\0';
+    entry->path = copy;
+    entry->name = entries_name(copy);
+    return 0;
+}
+
+const char *entries_name(const char *path) {
+    const char *lastPart = strrchr(path, '/');
+    return lastPart != NULL ? lastPart + 1 : path;
+}
+
+int entries_set_extra(EntryTable *table, MyzNode *entry, const void *extra, uint32_t size) {
+    entry->extra = NULL;
+    entry->extra_size = size;
+    entry->extra_borrowed = false;
+    if (size == 0)
+        return 0;
+    entry->extra = entries_alloc(table, size);
+    if (entry->extra == NULL) {
+        entry->extra_size = 0;
+        return -1;
+    }
+    memcpy(entry->extra, extra, size);
+    entry->extra_borrowed = true;
+    return 0;
+}
+
+void entries_compact(EntryTable *table, const bool *removed) {
+    size_t kept = 0;
+    size_t i = 0;
+    while (i < table->count) {
+        if (removed[i]) {
+            if (!table->entries[i].extra_borrowed)
+                free(table->entries[i].extra);
+            i++;
+            continue;
+        }
+
+        // Kept entries are moved a run at a time
+        size_t run = i;
+        while (i < table->count && !removed[i])
+            i++;
+        if (kept != run)
+            memmove(&table->entries[kept], &table->entries[run], (i - run) * sizeof(MyzNode));
+        kept += i - run;
+    }
+    table->count = kept;
+}
+
+void entries_free(EntryTable *table) {
+    // Only extra metadata added while writing is owned by its entry
+    for (size_t i = 0; i < table->count; i++) {
+        if (!table->entries[i].extra_borrowed)
+            free(table->entries[i].extra);
+    }
+    free(table->entries);
+
+    // The arena goes a block at a time
+    EntryArenaBlock *block = table->arena;
+    while (block != NULL) {
+        EntryArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    entries_init(table);
+}
+
+int entries_tree_build(const EntryTable *table, EntryTree *tree) {
+    tree->count = table->count;
+    tree->links = malloc((table->count > 0 ? table->count : 1) * sizeof(EntryLink));
+    struct {
+        size_t index;
+        int remaining;      // Entries of the directory not seen yet
+    } *open = malloc((table->count > 0 ? table->count : 1) * sizeof(*open));
+    if (tree->links == NULL || open == NULL) {
+        perror("malloc");
+        free(tree->links);
+        free(open);
+        tree->links = NULL;
+        tree->count = 0;
+        return -1;
+    }
+
+    // The entries that follow a directory belong to it, as in meta_parent
+    size_t depth = 0;
+    for (size_t i = 0; i < table->count; i++) {
+        // Close the directories whose entries have all been seen
+        while (depth > 0 && open[depth - 1].remaining == 0) {
+            depth--;
+            tree->links[open[depth].index].size = i - open[depth].index;
+        }
+
+        EntryLink *link = &tree->links[i];
+        link->parent = ENTRY_NONE;
+        link->firstChild = ENTRY_NONE;
+        link->size = 1;
+        if (depth > 0) {
+            link->parent = open[depth - 1].index;
+            open[depth - 1].remaining--;
+            if (tree->links[link->parent].firstChild == ENTRY_NONE)
+                tree->links[link->parent].firstChild = i;
+        }
+
+        const MyzNode *entry = &table->entries[i];
+        if (entry->type == MYZ_NODE_TYPE_DIR && entry->dirContents > 0) {
+            open[depth].index = i;
+            open[depth].remaining = entry->dirContents;
+            depth++;
+        }
+    }
+    while (depth > 0) {
+        depth--;
+        tree->links[open[depth].index].size = table->count - open[depth].index;
+    }
+    free(open);
+    return 0;
+}
+
+size_t entries_tree_find(const EntryTable *table, const EntryTree *tree, const char *path) {
+    // Top level entries keep their whole path, so more than one may lead to the path
+    for (size_t top = 0; top < tree->count; top += tree->links[top].size) {
+        size_t i = top;
+        size_t end = top + 1;
+        while (i < end) {
+            const char *entryPath = table->entries[i].path;
+            size_t length = strlen(entryPath);
+            if (strncmp(path, entryPath, length) != 0 || (path[length] != '\0' && path[length] != '/')) {
+                i += tree->links[i].size;   // Next entry of the same directory
+                continue;
+            }
+            if (path[length] == '\0')
+                return i;
+
+            // The path is inside this entry: look among its contents
+            end = i + tree->links[i].size;
+            i = tree->links[i].firstChild != ENTRY_NONE ? tree->links[i].firstChild : end;
+        }
+    }
+    return ENTRY_NONE;
+}
+
+void entries_tree_remove(EntryTable *table, const EntryTree *tree, size_t index, bool *removed) {
+    if (removed[index])
+        return;
+    for (size_t i = index; i < index + tree->links[index].size; i++)
+        removed[i] = true;
+    if (tree->links[index].parent != ENTRY_NONE)
+        table->entries[tree->links[index].parent].dirContents--;
+}
+
+void entries_tree_free(EntryTree *tree) {
+    free(tree->links);
+    tree->links = NULL;
+    tree->count = 0;
+}
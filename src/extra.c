@@ -0,0 +1,126 @@
+#include "extra.h"
+#include "sparse.h"
+
+// Records are padded so that the data of every record is 8-byte aligned
+#define EXTRA_PAD(length) (((length) + 7u) & ~7u)
+
+// Function to give a node its own copy of borrowed extra metadata, with room for size bytes
+static unsigned char *extra_own(MyzNode *node, uint32_t size) {
+    unsigned char *extra = malloc(size);
+    if (extra == NULL)
+        return NULL;
+    if (node->extra_size > 0)
+        memcpy(extra, node->extra, node->extra_size);
+    node->extra = extra;
+    node->extra_borrowed = false;
+    return extra;
+}
+
+int extra_add(MyzNode *node, myz_extra_type type, const void *data, uint32_t length) {
+    uint32_t size = node->extra_size + sizeof(MyzExtraHeader) + EXTRA_PAD(length);
+    unsigned char *extra = node->extra_borrowed ? extra_own(node, size) : realloc(node->extra, size);
+    if (extra == NULL)
+        return -1;
+
+    MyzExtraHeader header = {type, length};
+    memcpy(extra + node->extra_size, &header, sizeof(header));
+    memcpy(extra + node->extra_size + sizeof(header), data, length);
+    memset(extra + node->extra_size + sizeof(header) + length, 0, EXTRA_PAD(length) - length);
+    node->extra = extra;
+    node->extra_size = size;
+    return 0;
+}
+
+void extra_remove(MyzNode *node, myz_extra_type type) {
+    // Borrowed metadata is only copied when a record goes away
+    if (node->extra_borrowed) {
+        if (extra_find(node, type, NULL) == NULL)
+            return;
+        if (extra_own(node, node->extra_size) == NULL)
+            return;
+    }
+
+    uint32_t pos = 0, kept = 0;
+    while (node->extra != NULL && pos + sizeof(MyzExtraHeader) <= node->extra_size) {
+        MyzExtraHeader header;
+        memcpy(&header, node->extra + pos, sizeof(header));
+        uint32_t size = sizeof(header) + EXTRA_PAD(header.length);
+        if (size > node->extra_size - pos)
+            break;  // Corrupt record
+        if (header.type != type) {
+            memmove(node->extra + kept, node->extra + pos, size);
+            kept += size;
+        }
+        pos += size;
+    }
+    node->extra_size = kept;
+    if (kept == 0) {
+        free(node->extra);
+        node->extra = NULL;
+    }
+}
+
+const void *extra_find(const MyzNode *node, myz_extra_type type, uint32_t *length) {
+    uint32_t pos = 0;
+    while (node->extra != NULL && pos + sizeof(MyzExtraHeader) <= node->extra_size) {
+        MyzExtraHeader header;
+        memcpy(&header, node->extra + pos, sizeof(header));
+        pos += sizeof(header);
+        if (header.length > node->extra_size - pos)
+            break;  // Corrupt record
+        if (header.type == type) {
+            if (length != NULL)
+                *length = header.length;
+            return node->extra + pos;
+        }
+        pos += EXTRA_PAD(header.length);
+    }
+    return NULL;
+}
+
+const MyzBlockIndex *extra_blocks(const MyzNode *node) {
+    uint32_t length;
+    const MyzBlockIndex *index = extra_find(node, MYZ_EXTRA_BLOCKS, &length);
+    if (index == NULL || length < sizeof(MyzBlockIndex) ||
+        length != sizeof(MyzBlockIndex) + (uint64_t)index->count * sizeof(MyzBlock) || index->block_size == 0)
+        return NULL;
+
+    // Every block but the last is full, and empty data still has one
+    uint32_t extentCount;
+    const MyzExtent *extents = extra_extents(node, &extentCount);
+    uint64_t size = extents != NULL ? (uint64_t)sparse_data_size(extents, extentCount) : (uint64_t)node->stat.st_size;
+    uint64_t blocks = size / index->block_size + (size % index->block_size != 0);
+    if (index->count != (blocks > 0 ? blocks : 1))
+        return NULL;
+    return index;
+}
+
+const MyzBlock *extra_block_list(const MyzBlockIndex *index) {
+    return (const MyzBlock *)(index + 1);
+}
+
+const MyzChunk *extra_chunks(const MyzNode *node, uint32_t *count) {
+    uint32_t length;
+    const MyzChunk *chunks = extra_find(node, MYZ_EXTRA_CHUNKS, &length);
+    if (chunks == NULL || length % sizeof(MyzChunk) != 0)
+        return NULL;
+    *count = length / sizeof(MyzChunk);
+    return chunks;
+}
+
+const MyzExtent *extra_extents(const MyzNode *node, uint32_t *count) {
+    uint32_t length;
+    const MyzExtent *extents = extra_find(node, MYZ_EXTRA_EXTENTS, &length);
+    if (extents == NULL || length % sizeof(MyzExtent) != 0)
+        return NULL;
+    *count = length / sizeof(MyzExtent);
+    return extents;
+}
+
+const MyzChecksum *extra_checksum(const MyzNode *node) {
+    uint32_t length;
+    const MyzChecksum *checksum = extra_find(node, MYZ_EXTRA_CHECKSUM, &length);
+    if (checksum == NULL || length != sizeof(MyzChecksum))
+        return NULL;
+    return checksum;
+}
@@ -0,0 +1,70 @@
+#include "linkmap.h"
+
+// An inode stored in the map
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    void *value;    // NULL for an empty slot
+} LinkSlot;
+
+struct link_map {
+    LinkSlot *slots;
+    size_t capacity;    // Always a power of two
+    size_t count;
+};
+
+// Function to find the slot of an inode: either its own or an empty one
+static LinkSlot *linkmap_slot(LinkMap map, dev_t dev, ino_t ino) {
+    uint64_t h = ((uint64_t)ino ^ ((uint64_t)dev << 32)) * 0x9e3779b97f4a7c15ULL;
+    size_t i = (h >> 32) & (map->capacity - 1);
+    while (map->slots[i].value != NULL && (map->slots[i].dev != dev || map->slots[i].ino != ino))
+        i = (i + 1) & (map->capacity - 1);
+    return &map->slots[i];
+}
+
+LinkMap linkmap_create(void) {
+    LinkMap map = malloc(sizeof(*map));
+    map->capacity = 64;
+    map->count = 0;
+    map->slots = calloc(map->capacity, sizeof(LinkSlot));
+    return map;
+}
+
+void *linkmap_find(LinkMap map, dev_t dev, ino_t ino) {
+    return linkmap_slot(map, dev, ino)->value;
+}
+
+int linkmap_insert(LinkMap map, dev_t dev, ino_t ino, void *value) {
+    // Keep the map at most half full
+    if ((map->count + 1) * 2 > map->capacity) {
+        LinkSlot *old = map->slots;
+        size_t oldCapacity = map->capacity;
+        LinkSlot *slots = calloc(oldCapacity * 2, sizeof(LinkSlot));
+        if (slots == NULL)
+            return -1;
+        map->slots = slots;
+        map->capacity = oldCapacity * 2;
+        for (size_t i = 0; i < oldCapacity; i++) {
+            if (old[i].value != NULL)
+                *linkmap_slot(map, old[i].dev, old[i].ino) = old[i];
+        }
+        free(old);
+    }
+
+    LinkSlot *slot = linkmap_slot(map, dev, ino);
+    if (slot->value == NULL)
+        map->count++;
+    *slot = (LinkSlot){dev, ino, value};
+    return 0;
+}
+
+void linkmap_destroy(LinkMap map, LinkMapDestroy destroy_value) {
+    if (destroy_value != NULL) {
+        for (size_t i = 0; i < map->capacity; i++) {
+            if (map->slots[i].value != NULL)
+                destroy_value(map->slots[i].value);
+        }
+    }
+    free(map->slots);
+    free(map);
+}
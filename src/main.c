@@ -1,6 +1,8 @@
 #include "common.h"
 #include "utils.h"
 #include "myz.h"
+#include "datamove.h"
+#include "walk.h"
 
 int main(int argc, char *argv[]) {
     CommandLineArgs args;
@@ -8,11 +10,17 @@ int main(int argc, char *argv[]) {
     if (parse_arguments(argc, argv, &args) != 0)
         return 1;
 
-    // Call the appropriate function based on the command line arguments
+    // Without --uring, every member goes through the blocking calls
+    int uringDepth = args.uring ? args.queueDepth : 0;
+
+    // Call the appropriate function based on the command line arguments. A command
+    // that fails leaves a status of 1
+    int status = 0;
     if (args.create && args.fileList) {
-        create_archive(args.archiveFile, args.fileList, args.gzip);
+        if (create_archive(args.archiveFile, args.fileList, args.gzip, args.dedup, args.align, !args.noChecksum, uringDepth) == -1)
+            status = 1;
     } else if (args.export) {
-        extract_archive(args.archiveFile, args.fileList);
+        extract_archive(args.archiveFile, args.fileList, args.jobs, uringDepth, args.toStdout);
     } else if (args.metadata && !args.fileList) {
         print_metadata(args.archiveFile);
     } else if (args.query && args.fileList) {
@@ -20,13 +28,28 @@ int main(int argc, char *argv[]) {
     } else if (args.print && !args.fileList) {
         print_hierarchy(args.archiveFile);
     } else if (args.append && args.fileList) {
-        append_archive(args.archiveFile, args.fileList, args.gzip);
+        if (append_archive(args.archiveFile, args.fileList, args.gzip, args.dedup, args.align, !args.noChecksum, uringDepth) == -1)
+            status = 1;
     } else if (args.delete && args.fileList) {
-        delete_archive(args.archiveFile, args.fileList);
+        if (delete_archive(args.archiveFile, args.fileList, args.punchHoles) == -1)
+            status = 1;
+    } else if (args.vacuum && !args.fileList) {
+        if (vacuum_archive(args.archiveFile) == -1)
+            status = 1;
+    } else if (args.test && !args.fileList) {
+        // A damaged archive fails the command, after the report
+        if (test_archive(args.archiveFile) != 0)
+            return 1;
     } else {
         print_usage();
         return 1;
     }
 
-    return 0;
+    // Report how the tree was walked and how the member data was moved
+    if (args.verbose) {
+        walk_report(stderr);
+        move_report(stderr);
+    }
+
+    return status;
 }
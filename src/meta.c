@@ -0,0 +1,497 @@
+#include "meta.h"
+#include "extra.h"
+
+// Growable output buffer
+typedef struct {
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+    bool error;
+} MetaBuf;
+
+// Bounded input
+typedef struct {
+    const unsigned char *pos;
+    const unsigned char *end;
+    bool error;
+} MetaReader;
+
+// Function to make room for size more bytes
+static bool meta_reserve(MetaBuf *buf, size_t size) {
+    if (buf->error)
+        return false;
+    if (buf->size + size > buf->capacity) {
+        size_t capacity = buf->capacity ? buf->capacity * 2 : 4096;
+        while (capacity < buf->size + size)
+            capacity *= 2;
+        unsigned char *data = realloc(buf->data, capacity);
+        if (data == NULL) {
+            buf->error = true;
+            return false;
+        }
+        buf->data = data;
+        buf->capacity = capacity;
+    }
+    return true;
+}
+
+static void meta_put_bytes(MetaBuf *buf, const void *data, size_t size) {
+    if (size > 0 && meta_reserve(buf, size)) {
+        memcpy(buf->data + buf->size, data, size);
+        buf->size += size;
+    }
+}
+
+static void meta_put_varint(MetaBuf *buf, uint64_t value) {
+    unsigned char bytes[10];
+    int n = 0;
+    do {
+        bytes[n] = value & 0x7f;
+        value >>= 7;
+        if (value != 0)
+            bytes[n] |= 0x80;
+        n++;
+    } while (value != 0);
+    meta_put_bytes(buf, bytes, n);
+}
+
+static void meta_put_signed(MetaBuf *buf, int64_t value) {
+    meta_put_varint(buf, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+static uint64_t meta_get_varint(MetaReader *in) {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (in->pos >= in->end)
+            break;
+        unsigned char byte = *in->pos++;
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return value;
+    }
+    in->error = true;
+    return 0;
+}
+
+static int64_t meta_get_signed(MetaReader *in) {
+    uint64_t value = meta_get_varint(in);
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static const unsigned char *meta_get_bytes(MetaReader *in, uint64_t size) {
+    if (in->error || size > (uint64_t)(in->end - in->pos)) {
+        in->error = true;
+        return NULL;
+    }
+    const unsigned char *data = in->pos;
+    in->pos += size;
+    return data;
+}
+
+void meta_store_le(unsigned char *data, uint64_t value, int width) {
+    for (int i = 0; i < width; i++)
+        data[i] = value >> (8 * i);
+}
+
+uint64_t meta_load_le(const unsigned char *data, int width) {
+    uint64_t value = 0;
+    for (int i = 0; i < width; i++)
+        value |= (uint64_t)data[i] << (8 * i);
+    return value;
+}
+
+// Widths of the integers of an extra record: those at its start, then those of each
+// element of the array that fills the rest of it
+typedef struct {
+    uint32_t type;
+    unsigned char head[4];
+    unsigned char element[4];
+} MetaExtraLayout;
+
+static const MetaExtraLayout metaExtraLayouts[] = {
+    {MYZ_EXTRA_BLOCKS, {4, 4}, {8, 8}},         // MyzBlockIndex, then MyzBlock
+    {MYZ_EXTRA_CHUNKS, {0}, {8, 4, 4}},         // MyzChunk
+    {MYZ_EXTRA_EXTENTS, {0}, {8, 8, 8}},        // MyzExtent
+    {MYZ_EXTRA_CHECKSUM, {4, 4, 8}, {0}},       // MyzChecksum
+};
+
+// Function to convert an integer of width bytes from host order to little-endian,
+// or back with toHost
+static void meta_convert_int(unsigned char *dest, const unsigned char *src, int width, bool toHost) {
+    if (toHost) {
+        uint64_t value = meta_load_le(src, width);
+        uint32_t value32 = value;
+        memcpy(dest, width == 4 ? (void *)&value32 : (void *)&value, width);
+    } else {
+        uint32_t value32;
+        uint64_t value;
+        if (width == 4) {
+            memcpy(&value32, src, 4);
+            value = value32;
+        } else {
+            memcpy(&value, src, 8);
+        }
+        meta_store_le(dest, value, width);
+    }
+}
+
+// Function to convert the integers of extra metadata between the host structs of
+// extra.h and their little-endian encoding in archives. dest and src may be the same.
+// Padding, records of an unknown type and what follows a corrupt record are copied
+static void meta_convert_extra(unsigned char *dest, const unsigned char *src, uint32_t size, bool toHost) {
+    uint32_t pos = 0;
+    while (pos + sizeof(MyzExtraHeader) <= size) {
+        // The length is read from whichever side holds the host order
+        MyzExtraHeader header;
+        unsigned char headerBytes[sizeof(header)];
+        memcpy(headerBytes, src + pos, sizeof(headerBytes));
+        meta_convert_int(dest + pos, headerBytes, 4, toHost);
+        meta_convert_int(dest + pos + 4, headerBytes + 4, 4, toHost);
+        memcpy(&header, toHost ? dest + pos : headerBytes, sizeof(header));
+        uint32_t start = pos + sizeof(header);
+        if (header.length > size - start || ((header.length + 7u) & ~7u) > size - start) {
+            pos = start;
+            break;
+        }
+        uint32_t end = start + header.length;
+        pos = start;
+
+        const MetaExtraLayout *layout = NULL;
+        for (size_t i = 0; i < sizeof(metaExtraLayouts) / sizeof(metaExtraLayouts[0]); i++) {
+            if (metaExtraLayouts[i].type == header.type)
+                layout = &metaExtraLayouts[i];
+        }
+        if (layout != NULL) {
+            for (int i = 0; i < 4 && layout->head[i] != 0 && pos + layout->head[i] <= end; i++) {
+                meta_convert_int(dest + pos, src + pos, layout->head[i], toHost);
+                pos += layout->head[i];
+            }
+            uint32_t elementSize = layout->element[0] + layout->element[1] + layout->element[2] + layout->element[3];
+            while (elementSize > 0 && pos + elementSize <= end) {
+                for (int i = 0; i < 4 && layout->element[i] != 0; i++) {
+                    meta_convert_int(dest + pos, src + pos, layout->element[i], toHost);
+                    pos += layout->element[i];
+                }
+            }
+        }
+
+        uint32_t next = start + ((header.length + 7u) & ~7u);
+        if (dest != src)
+            memcpy(dest + pos, src + pos, next - pos);
+        pos = next;
+    }
+    if (dest != src)
+        memcpy(dest + pos, src + pos, size - pos);
+}
+
+void meta_extra_decode(unsigned char *extra, uint32_t size) {
+    meta_convert_extra(extra, extra, size, true);
+}
+
+// Function to write the fields of an entry other than its parent and name
+static void meta_put_fields(MetaBuf *buf, const MyzNode *node) {
+    meta_put_varint(buf, node->type);
+    meta_put_varint(buf, node->compressed ? META_FLAG_COMPRESSED : 0);
+    meta_put_varint(buf, node->stat.st_mode);
+    meta_put_varint(buf, node->stat.st_uid);
+    meta_put_varint(buf, node->stat.st_gid);
+    meta_put_varint(buf, node->stat.st_nlink);
+    meta_put_varint(buf, node->stat.st_dev);
+    meta_put_varint(buf, node->stat.st_ino);
+    meta_put_varint(buf, node->stat.st_size);
+    meta_put_varint(buf, node->stat.st_blocks);
+    meta_put_signed(buf, node->stat.st_mtim.tv_sec);
+    meta_put_varint(buf, node->stat.st_mtim.tv_nsec);
+    meta_put_signed(buf, node->stat.st_atim.tv_sec);
+    meta_put_varint(buf, node->stat.st_atim.tv_nsec);
+    meta_put_signed(buf, node->stat.st_ctim.tv_sec);
+    meta_put_varint(buf, node->stat.st_ctim.tv_nsec);
+    meta_put_varint(buf, node->data_offset);
+    meta_put_varint(buf, node->data_size);
+    meta_put_varint(buf, node->extra_size);
+    if (node->extra_size > 0 && meta_reserve(buf, node->extra_size)) {
+        meta_convert_extra(buf->data + buf->size, node->extra, node->extra_size, false);
+        buf->size += node->extra_size;
+    }
+}
+
+// Function to read the fields written by meta_put_fields. The extra metadata is
+// left in place in the input, little-endian
+static int meta_get_fields(MetaReader *in, MyzNode *node) {
+    memset(&node->stat, 0, sizeof(node->stat));
+    node->type = meta_get_varint(in);
+    node->compressed = (meta_get_varint(in) & META_FLAG_COMPRESSED) != 0;
+    node->stat.st_mode = meta_get_varint(in);
+    node->stat.st_uid = meta_get_varint(in);
+    node->stat.st_gid = meta_get_varint(in);
+    node->stat.st_nlink = meta_get_varint(in);
+    node->stat.st_dev = meta_get_varint(in);
+    node->stat.st_ino = meta_get_varint(in);
+    node->stat.st_size = meta_get_varint(in);
+    node->stat.st_blocks = meta_get_varint(in);
+    node->stat.st_mtim.tv_sec = meta_get_signed(in);
+    node->stat.st_mtim.tv_nsec = meta_get_varint(in);
+    node->stat.st_atim.tv_sec = meta_get_signed(in);
+    node->stat.st_atim.tv_nsec = meta_get_varint(in);
+    node->stat.st_ctim.tv_sec = meta_get_signed(in);
+    node->stat.st_ctim.tv_nsec = meta_get_varint(in);
+    node->data_offset = meta_get_varint(in);
+    node->data_size = meta_get_varint(in);
+    node->dirContents = node->type == MYZ_NODE_TYPE_DIR ? 0 : -1;
+
+    uint64_t extraSize = meta_get_varint(in);
+    const unsigned char *extra = meta_get_bytes(in, extraSize);
+    if (in->error || extraSize > UINT32_MAX)
+        return -1;
+    node->extra_size = extraSize;
+    node->extra = extraSize > 0 ? (unsigned char *)extra : NULL;
+    return 0;
+}
+
+void meta_parents_init(MetaParents *parents) {
+    memset(parents, 0, sizeof(*parents));
+}
+
+uint64_t meta_parent(MetaParents *parents, const MyzNode *node, bool stored) {
+    // Leave the directories whose entries have all been seen
+    while (parents->depth > 0 && parents->stack[parents->depth - 1].remaining == 0)
+        parents->depth--;
+
+    uint64_t parent = 0;
+    if (parents->depth > 0) {
+        parent = parents->stack[parents->depth - 1].index + 1;
+        parents->stack[parents->depth - 1].remaining--;
+    }
+    if (!stored)
+        return parent;
+
+    // The entries that follow a directory belong to it
+    uint64_t index = parents->count++;
+    if (node->type == MYZ_NODE_TYPE_DIR && node->dirContents > 0) {
+        if (parents->depth == parents->capacity) {
+            parents->capacity = parents->capacity ? parents->capacity * 2 : 16;
+            parents->stack = realloc(parents->stack, parents->capacity * sizeof(*parents->stack));
+        }
+        parents->stack[parents->depth].index = index;
+        parents->stack[parents->depth].remaining = node->dirContents;
+        parents->depth++;
+    }
+    return parent;
+}
+
+void meta_parents_free(MetaParents *parents) {
+    free(parents->stack);
+    parents->stack = NULL;
+}
+
+bool meta_stored(const MyzNode *node) {
+    return node->type == MYZ_NODE_TYPE_FILE || node->type == MYZ_NODE_TYPE_DIR ||
+           node->type == MYZ_NODE_TYPE_HARDLINK;
+}
+
+// String table where every distinct string is stored once
+typedef struct {
+    MetaBuf strings;
+    uint64_t *slots;        // Offset + 1 of the string in each slot, 0 if empty
+    size_t capacity;
+    size_t count;
+} MetaStrings;
+
+static uint64_t meta_hash(const char *s) {
+    uint64_t h = 1469598103934665603ULL;    // FNV-1a
+    while (*s)
+        h = (h ^ (unsigned char)*s++) * 1099511628211ULL;
+    return h;
+}
+
+// Function to find the slot of a string: either its own or an empty one
+static uint64_t *meta_string_slot(MetaStrings *table, const char *s) {
+    size_t i = meta_hash(s) & (table->capacity - 1);
+    while (table->slots[i] != 0 && strcmp((char *)table->strings.data + table->slots[i] - 1, s) != 0)
+        i = (i + 1) & (table->capacity - 1);
+    return &table->slots[i];
+}
+
+// Function to get the offset of a string in the table, adding it if needed
+static uint64_t meta_intern(MetaStrings *table, const char *s) {
+    uint64_t *slot = meta_string_slot(table, s);
+    if (*slot != 0)
+        return *slot - 1;
+
+    uint64_t offset = table->strings.size;
+    meta_put_bytes(&table->strings, s, strlen(s) + 1);
+    *slot = offset + 1;
+
+    // Keep the table at most half full
+    if (++table->count * 2 > table->capacity) {
+        uint64_t *old = table->slots;
+        size_t oldCapacity = table->capacity;
+        table->capacity *= 2;
+        table->slots = calloc(table->capacity, sizeof(uint64_t));
+        for (size_t i = 0; i < oldCapacity; i++) {
+            if (old[i] != 0)
+                *meta_string_slot(table, (char *)table->strings.data + old[i] - 1) = old[i];
+        }
+        free(old);
+    }
+    return offset;
+}
+
+unsigned char *meta_encode_table(const EntryTable *entries, bool compress, uint64_t *recordOffsets, size_t *size) {
+    MetaStrings table = {{NULL, 0, 0, false}, calloc(1024, sizeof(uint64_t)), 1024, 0};
+    MetaBuf records = {NULL, 0, 0, false};
+    MetaParents parents;
+    meta_parents_init(&parents);
+
+    uint64_t count = 0;
+    for (size_t i = 0; i < entries->count; i++) {
+        const MyzNode *entry = &entries->entries[i];
+        uint64_t parent = meta_parent(&parents, entry, meta_stored(entry));
+        if (!meta_stored(entry))
+            continue;
+
+        // Top level entries keep their path, the others only their name
+        if (recordOffsets != NULL)
+            recordOffsets[count] = records.size;
+        meta_put_varint(&records, parent);
+        meta_put_varint(&records, meta_intern(&table, parent == 0 ? entry->path : entry->name));
+        meta_put_fields(&records, entry);
+        count++;
+    }
+    meta_parents_free(&parents);
+
+    // Records are placed after the string table in the body
+    if (recordOffsets != NULL) {
+        for (uint64_t i = 0; i < count; i++)
+            recordOffsets[i] += table.strings.size;
+        recordOffsets[count] = table.strings.size + records.size;
+    }
+
+    // The body is the string table followed by the records
+    MetaBuf body = table.strings;
+    meta_put_bytes(&body, records.data, records.size);
+    free(records.data);
+    free(table.slots);
+
+    // Deflate the body if that makes it smaller
+    unsigned char flags = 0;
+    unsigned char *stored = body.data;
+    uLongf storedSize = body.size;
+    if (compress && body.size > 0 && !body.error) {
+        uLongf bound = compressBound(body.size);
+        unsigned char *deflated = malloc(bound);
+        if (deflated != NULL && compress2(deflated, &bound, body.data, body.size, Z_DEFAULT_COMPRESSION) == Z_OK &&
+            bound < body.size) {
+            flags = META_TABLE_COMPRESSED;
+            stored = deflated;
+            storedSize = bound;
+        } else {
+            free(deflated);
+        }
+    }
+
+    MetaBuf out = {NULL, 0, 0, body.error};
+    meta_put_bytes(&out, &flags, 1);
+    meta_put_varint(&out, count);
+    meta_put_varint(&out, table.strings.size);
+    meta_put_varint(&out, body.size);
+    meta_put_varint(&out, storedSize);
+    meta_put_bytes(&out, stored, storedSize);
+    if (stored != body.data)
+        free(stored);
+    free(body.data);
+
+    if (out.error) {
+        free(out.data);
+        return NULL;
+    }
+    *size = out.size;
+    return out.data;
+}
+
+int meta_read_table_header(const unsigned char *data, size_t size, MetaTableHeader *header) {
+    MetaReader in = {data, data + size, false};
+    const unsigned char *flags = meta_get_bytes(&in, 1);
+    header->count = meta_get_varint(&in);
+    header->strings_size = meta_get_varint(&in);
+    header->body_size = meta_get_varint(&in);
+    header->stored_size = meta_get_varint(&in);
+    if (in.error || header->strings_size > header->body_size || header->count > header->body_size)
+        return -1;
+    header->flags = *flags;
+    header->header_size = in.pos - data;
+    if (!(header->flags & META_TABLE_COMPRESSED) && header->stored_size != header->body_size)
+        return -1;
+    return 0;
+}
+
+unsigned char *meta_inflate_body(const MetaTableHeader *header, const unsigned char *stored) {
+    uLongf length = header->body_size;
+    unsigned char *body = malloc(header->body_size > 0 ? header->body_size : 1);
+    if (body == NULL || uncompress(body, &length, stored, header->stored_size) != Z_OK ||
+        length != header->body_size) {
+        free(body);
+        return NULL;
+    }
+    return body;
+}
+
+const unsigned char *meta_decode_table_record(const unsigned char *data, const unsigned char *end, MyzNode *node,
+                                              uint64_t *parent, uint64_t *name) {
+    MetaReader in = {data, end, false};
+    *parent = meta_get_varint(&in);
+    *name = meta_get_varint(&in);
+    if (in.error || meta_get_fields(&in, node) == -1)
+        return NULL;
+    return in.pos;
+}
+
+unsigned char *meta_encode_record(const MyzNode *node, uint64_t parent, size_t *size) {
+    MetaBuf out = {NULL, 0, 0, false};
+    const char *name = parent == 0 ? node->path : node->name;
+    size_t length = strlen(name);
+    meta_put_varint(&out, parent);
+    meta_put_varint(&out, length);
+    meta_put_bytes(&out, name, length);
+    meta_put_fields(&out, node);
+    if (out.error) {
+        free(out.data);
+        return NULL;
+    }
+    *size = out.size;
+    return out.data;
+}
+
+int meta_decode_record(const unsigned char *data, size_t size, MyzNode *node, char *path, uint64_t *parent) {
+    memset(node, 0, sizeof(MyzNode));
+    MetaReader in = {data, data + size, false};
+    *parent = meta_get_varint(&in);
+    uint64_t length = meta_get_varint(&in);
+    const unsigned char *name = meta_get_bytes(&in, length);
+    if (in.error || length >= MAX_PATH_LEN)
+        return -1;
+    memcpy(path, name, length);
+    path[length] = '\0';
+    node->path = path;
+
+    if (meta_get_fields(&in, node) == -1 || in.pos != in.end) {
+        node->extra = NULL;
+        return -1;
+    }
+
+    // The record buffer belongs to the caller, so the extra metadata is copied
+    if (node->extra != NULL) {
+        unsigned char *extra = malloc(node->extra_size);
+        if (extra == NULL) {
+            node->extra = NULL;
+            return -1;
+        }
+        memcpy(extra, node->extra, node->extra_size);
+        meta_extra_decode(extra, node->extra_size);
+        node->extra = extra;
+    }
+
+    // Top level entries carry their path, the others only their name
+    node->name = entries_name(path);
+    return 0;
+}
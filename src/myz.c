@@ -1,567 +1,1812 @@
 #include "myz.h"
+#include "compress.h"
+#include "datamove.h"
+#include "extra.h"
+#include "dedup.h"
+#include "linkmap.h"
+#include "sparse.h"
+#include "walk.h"
+#include "meta.h"
+#include "pathindex.h"
+#include "reader.h"
+#include "checksum.h"
+#include "verify.h"
+#include "outdir.h"
+#include "uring.h"
+#include "pattern.h"
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
-#include <sys/wait.h>
 #include <dirent.h>
+#include <pthread.h>
+
+// Function to write bytes to the archive, after any compressed data still in the pool
+static int writeArchiveBytes(int fd, CompressPool pool, off_t *dataEnd, const void *data, size_t size) {
+    if (pool != NULL)
+        return compress_pool_write(pool, data, size);
+
+    if (write_all(fd, data, size) == -1) {
+        perror("write");
+        return -1;
+    }
+    *dataEnd += size;
+    return 0;
+}
+
+// Function to write the record of an entry inside a stream archive: the tag, the
+// 32-bit little-endian length of the record and the compact record
+static int writeStreamEntry(int fd, CompressPool pool, off_t *dataEnd, MyzNode *entry, uint64_t parent) {
+    size_t size;
+    unsigned char *record = meta_encode_record(entry, parent, &size);
+    if (record == NULL)
+        return -1;
+
+    char tag[MYZ_TAG_LEN] = MYZ_STREAM_ENTRY;
+    unsigned char length[4] = {size & 0xff, (size >> 8) & 0xff, (size >> 16) & 0xff, (size >> 24) & 0xff};
+    int ret = 0;
+    if (writeArchiveBytes(fd, pool, dataEnd, tag, sizeof(tag)) == -1 ||
+        writeArchiveBytes(fd, pool, dataEnd, length, sizeof(length)) == -1 ||
+        writeArchiveBytes(fd, pool, dataEnd, record, size) == -1)
+        ret = -1;
+    free(record);
+    return ret;
+}
+
+// Function to read one node of a version 1 stream archive and its extra metadata from the current
+// position. Its path is copied to path, a buffer of MAX_PATH_LEN bytes
+int read_entry(int fd, MyzNode *entry, char *path) {
+    MyzStoredNode stored;
+    memset(entry, 0, sizeof(MyzNode));
+    if (read_all(fd, &stored, MYZ_NODE_SIZE) != (ssize_t)MYZ_NODE_SIZE)
+        return -1;
+    entry->stat = stored.stat;
+    entry->type = stored.type;
+    entry->data_offset = stored.data_offset;
+    entry->data_size = stored.data_size;
+    entry->compressed = stored.compressed;
+    entry->dirContents = stored.dirContents;
+    entry->extra_size = stored.extra_size;
+    stored.path[MAX_PATH_LEN - 1] = '\0';
+    memcpy(path, stored.path, strlen(stored.path) + 1);
+    entry->path = path;
+    entry->name = entries_name(path);
+
+    if (entry->extra_size > 0) {
+        entry->extra = malloc(entry->extra_size);
+        if (entry->extra == NULL || read_all(fd, entry->extra, entry->extra_size) != (ssize_t)entry->extra_size) {
+            free(entry->extra);
+            entry->extra = NULL;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Small files read ahead through io_uring while the archive is written. Their opens,
+// reads and closes are submitted a batch at a time instead of one blocking call each
+typedef struct {
+    Uring ring;             // NULL when every file goes through the blocking calls
+    size_t next;            // First entry not looked at yet
+    size_t *index;          // Entries of the batch, in table order
+    unsigned char **data;   // Their data, or NULL if it could not be read ahead
+    size_t count;
+    size_t taken;           // Files of the batch already written
+    unsigned char *buffer;  // Holds the data of the batch
+    UringOp *ops;
+} ReadAhead;
+
+static void read_ahead_free(ReadAhead *ahead) {
+    uring_destroy(ahead->ring);
+    free(ahead->index);
+    free(ahead->data);
+    free(ahead->buffer);
+    free(ahead->ops);
+    memset(ahead, 0, sizeof(*ahead));
+}
+
+// Function to set up the ring of a read ahead. Without one, nothing is read ahead
+static void read_ahead_init(ReadAhead *ahead, int uringDepth) {
+    memset(ahead, 0, sizeof(*ahead));
+    if (uringDepth <= 0 || (ahead->ring = uring_create(uringDepth)) == NULL)
+        return;
+    unsigned depth = uring_depth(ahead->ring);
+    ahead->index = malloc(depth * sizeof(size_t));
+    ahead->data = malloc(depth * sizeof(unsigned char *));
+    ahead->buffer = malloc(URING_BATCH_BYTES);
+    ahead->ops = malloc(depth * sizeof(UringOp));
+    if (ahead->index == NULL || ahead->data == NULL || ahead->buffer == NULL || ahead->ops == NULL)
+        read_ahead_free(ahead);
+}
+
+// Function to check if the data of an entry is read ahead: small files with one link
+// and no holes, whose data is stored as it is
+static bool read_ahead_wanted(const MyzNode *entry) {
+    return (entry->type == MYZ_NODE_TYPE_FILE || entry->type == MYZ_NODE_TYPE_HARDLINK) &&
+           entry->stat.st_nlink == 1 && !entry->compressed && entry->stat.st_size <= URING_FILE_MAX &&
+           (off_t)entry->stat.st_blocks * 512 >= entry->stat.st_size;
+}
+
+// Function to open, read and close the next batch of files, starting at entry first.
+// Each step is one submission; a file that fails any of them is left to the blocking path
+static void read_ahead_fill(ReadAhead *ahead, const EntryTable *entries, size_t first) {
+    unsigned depth = uring_depth(ahead->ring);
+    size_t used = 0, i;
+    ahead->count = ahead->taken = 0;
+    for (i = first; i < entries->count && ahead->count < depth; i++) {
+        const MyzNode *entry = &entries->entries[i];
+        if (!read_ahead_wanted(entry))
+            continue;
+        if (used + entry->stat.st_size > URING_BATCH_BYTES)
+            break;
+        ahead->index[ahead->count] = i;
+        ahead->data[ahead->count] = ahead->buffer + used;
+        ahead->ops[ahead->count] = (UringOp){URING_OPENAT, AT_FDCWD, entry->path, O_RDONLY | O_CLOEXEC, 0, NULL, 0, 0, -ECANCELED};
+        used += entry->stat.st_size;
+        ahead->count++;
+    }
+    ahead->next = i;
+
+    // Files that were not opened get -EBADF from the read and the close
+    int ret = uring_run(ahead->ring, ahead->ops, ahead->count);
+    for (size_t k = 0; k < ahead->count; k++) {
+        int fd = ahead->ops[k].result >= 0 ? ahead->ops[k].result : -1;
+        ahead->ops[k] = (UringOp){URING_READ, fd, NULL, 0, 0, ahead->data[k],
+                                  entries->entries[ahead->index[k]].stat.st_size, 0, -ECANCELED};
+    }
+    if (ret == 0)
+        ret = uring_run(ahead->ring, ahead->ops, ahead->count);
+    for (size_t k = 0; k < ahead->count; k++) {
+        if (ret == -1 || ahead->ops[k].result != (int)ahead->ops[k].length)
+            ahead->data[k] = NULL;  // Shrunk or unreadable: the blocking path reports it
+        ahead->ops[k] = (UringOp){URING_CLOSE, ahead->ops[k].fd, NULL, 0, 0, NULL, 0, 0, -ECANCELED};
+    }
+    if (ret == -1 || uring_run(ahead->ring, ahead->ops, ahead->count) == -1) {
+        // The ring failed: close what is still open and read the rest with the blocking calls
+        for (size_t k = 0; k < ahead->count; k++) {
+            if (ahead->ops[k].fd != -1 && ahead->ops[k].result == -ECANCELED)
+                close(ahead->ops[k].fd);
+            ahead->data[k] = NULL;
+        }
+        uring_destroy(ahead->ring);
+        ahead->ring = NULL;
+    }
+}
+
+// Function to get the data of entry i if it was read ahead, reading the next batch
+// when i is past the current one. Returns NULL for files read with the blocking calls
+static const unsigned char *read_ahead_take(ReadAhead *ahead, const EntryTable *entries, size_t i) {
+    if (ahead->ring == NULL || !read_ahead_wanted(&entries->entries[i]))
+        return NULL;
+    if (ahead->taken == ahead->count && i >= ahead->next)
+        read_ahead_fill(ahead, entries, i);
+    while (ahead->taken < ahead->count && ahead->index[ahead->taken] < i)
+        ahead->taken++;
+    if (ahead->taken < ahead->count && ahead->index[ahead->taken] == i)
+        return ahead->data[ahead->taken++];
+    return NULL;
+}
+
+// Function to start the data of an entry at the next block of the archive when it is
+// aligned. The padding is left as a hole
+static int align_data(int fd, off_t blockSize, off_t *dataEnd, off_t size) {
+    off_t aligned = (*dataEnd + blockSize - 1) / blockSize * blockSize;
+    if (size > 0 && aligned != *dataEnd) {
+        if (lseek(fd, aligned, SEEK_SET) == -1) {
+            perror("lseek");
+            return -1;
+        }
+        *dataEnd = aligned;
+    }
+    return 0;
+}
+
+// Function to write the metadata table, the path index and, for a stream archive, the
+// footer after the data, which ends at dataEnd, and to patch the header with the sizes
+static int write_metadata(int fd, MyzHeader *header, EntryTable *entries, off_t dataEnd, bool stream) {
+    header->metadata_offset = dataEnd;
+    header->total_bytes = dataEnd;
+
+    // Encode the metadata of the files and directories. It is compressed along with the data
+    bool compressMeta = false;
+    uint64_t stored = 0;
+    for (size_t i = 0; i < entries->count; i++) {
+        compressMeta |= entries->entries[i].compressed;
+        stored += meta_stored(&entries->entries[i]);
+    }
+    uint64_t *recordOffsets = malloc((stored + 1) * sizeof(uint64_t));
+    size_t metaSize;
+    unsigned char *meta = recordOffsets != NULL ? meta_encode_table(entries, compressMeta, recordOffsets, &metaSize) : NULL;
+
+    // The sorted path index follows the table, for lookups of single entries
+    size_t indexSize;
+    unsigned char *pathIndex = meta != NULL ? path_index_build(entries, recordOffsets, stored, &indexSize) : NULL;
+    free(recordOffsets);
+    if (pathIndex == NULL) {
+        fprintf(stderr, "Failed to encode the metadata\n");
+        free(meta);
+        return -1;
+    }
+    header->total_bytes += metaSize + indexSize;
+    struct iovec iov[3] = {{meta, metaSize}, {pathIndex, indexSize}, {NULL, 0}};
+    int iovCount = 2;
+
+    // A stream archive ends with the footer
+    MyzFooter footer;
+    if (stream) {
+        header->total_bytes += sizeof(MyzFooter);
+        memset(&footer, 0, sizeof(footer));
+        footer.total_bytes = header->total_bytes;
+        footer.metadata_offset = header->metadata_offset;
+        memcpy(footer.magic, MYZ_FOOTER_MAGIC, sizeof(footer.magic));
+        iov[iovCount].iov_base = &footer;
+        iov[iovCount].iov_len = sizeof(MyzFooter);
+        iovCount++;
+    }
+
+    // Write the metadata, the index and the footer in one batch
+    int ret = writev_all(fd, iov, iovCount);
+    free(meta);
+    free(pathIndex);
+    if (ret == -1) {
+        perror("writev");
+        return -1;
+    }
+
+    // Patch the header now that the sizes are known
+    if (!stream && pwrite(fd, header, sizeof(MyzHeader), 0) == -1) {
+        perror("pwrite");
+        return -1;
+    }
+    return 0;
+}
+
+// Function to transfer the table of archive entries to the archive file.
+// An archive file of "-" writes a stream archive to the standard output.
+// With dedup the file data is stored as chunks shared by all entries. With align the
+// raw data of every file starts at a block of the archive, so that it can be cloned.
+// A uringDepth above 0 reads small files ahead through io_uring. Data that passes
+// through this process is always checksummed; unless checksum is false, so is the raw
+// data that is copied in the kernel, at the cost of reading it once more.
+// A header with sizes describes an archive that is written in place. Its first kept
+// entries are already in it: their data is left where it is, and the data of the
+// others is written after the end of the archive, followed by the new metadata. The header is patched last, so until then
+// the archive still reads as before, and it is truncated back to its old end if
+// anything fails
+int transferEntriesToFile(MyzHeader header, EntryTable *entries, size_t kept, char *archiveFile, bool dedup,
+                          bool align, bool checksum, int uringDepth) {
+    bool stream = strcmp(archiveFile, "-") == 0;
+    bool inPlace = header.total_bytes > 0 && !stream;
+
+    // Chunks refer back to earlier data, which a reader of a pipe cannot seek to
+    if (stream && dedup) {
+        fprintf(stderr, "Deduplication is not supported for stream archives, ignoring --dedup\n");
+        dedup = false;
+    }
+    // Stream records are interleaved with the data, which could not be cloned anyway
+    if (stream && align) {
+        fprintf(stderr, "Alignment is not supported for stream archives, ignoring --align\n");
+        align = false;
+    }
 
-// Function to transfer the list of archive entries to the archive file
-int transferListToFile(MyzHeader header, List list, char *archiveFile) {
     // Open the archive file
-    int fd = open(archiveFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int fd = stream ? STDOUT_FILENO : open(archiveFile, O_WRONLY | (inPlace ? 0 : O_CREAT | O_TRUNC), 0644);
     if (fd == -1) {
         perror("open");
         return -1;
     }
-
-    // Write the header to the archive file
-    if (write(fd, &header, sizeof(MyzHeader)) == -1) {
-        perror("write");
+    // Archives are always written with the compact metadata, whatever version they were read as
+    memcpy(header.magic, stream ? MYZ_STREAM_MAGIC_V2 : MYZ_MAGIC_V2, sizeof(header.magic));
+
+    // Write the header to the archive file. It is patched once the sizes are known;
+    // everything else is written sequentially: data first, then the metadata table.
+    // Stream archives are never patched: each entry is written right before its data
+    // and the sizes go to a footer after the trailing metadata table. In place, the
+    // old metadata section is left as unused data before the new data
+    off_t oldEnd = header.total_bytes;  // End of the archive before an in-place write
+    off_t dataEnd = inPlace ? oldEnd : (off_t)sizeof(MyzHeader); // End of the data written so far
+    if (inPlace ? lseek(fd, dataEnd, SEEK_SET) == -1 : write_all(fd, &header, sizeof(MyzHeader)) == -1) {
+        perror(inPlace ? "lseek" : "write");
         close(fd);
         return -1;
     }
 
-    int metadataBytesWritten = 0;   // Number of metadata bytes written
-    int dataBytesWritten = 0;       // Number of data bytes written
+    off_t blockSize = align ? move_block_size(fd) : 1;
+    CompressPool pool = NULL;           // Created on the first compressed entry
+    DedupStore store = dedup ? dedup_create() : NULL;
+    LinkMap links = linkmap_create();   // Files with several links whose data is written
+    MetaParents parents;                // Directory of each entry, for stream records
+    meta_parents_init(&parents);
+    ReadAhead ahead;                    // Small files read through io_uring; not with dedup, which chunks them
+    read_ahead_init(&ahead, store == NULL ? uringDepth : 0);
+    if (dedup && store == NULL)
+        goto fail;
+
+    // Write the data of the archive entries to the archive file. The table does not
+    // grow while it is written, so the pool and the link map may keep entry pointers
+    for (size_t i = inPlace ? kept : 0; i < entries->count; i++) {
+        MyzNode *entry = &entries->entries[i];
+        uint64_t parent = meta_parent(&parents, entry, meta_stored(entry));
+
+        if (entry->type == MYZ_NODE_TYPE_FILE || entry->type == MYZ_NODE_TYPE_HARDLINK) {
+            // Any block index, chunk list or checksum belongs to data written by a previous archive
+            extra_remove(entry, MYZ_EXTRA_BLOCKS);
+            extra_remove(entry, MYZ_EXTRA_CHUNKS);
+            extra_remove(entry, MYZ_EXTRA_EXTENTS);
+            extra_remove(entry, MYZ_EXTRA_CHECKSUM);
+
+            // The data of a file with several links is written for its first path only.
+            // The other paths become hard links, found by device and inode number
+            entry->type = MYZ_NODE_TYPE_FILE;
+            if (entry->stat.st_nlink > 1) {
+                if (linkmap_find(links, entry->stat.st_dev, entry->stat.st_ino) != NULL) {
+                    entry->type = MYZ_NODE_TYPE_HARDLINK;
+                    entry->data_offset = 0;
+                    entry->data_size = 0;
+                    if (stream && writeStreamEntry(fd, pool, &dataEnd, entry, parent) == -1)
+                        goto fail;
+                    continue;
+                }
+                if (linkmap_insert(links, entry->stat.st_dev, entry->stat.st_ino, entry) == -1)
+                    goto fail;
+            }
 
-    // Write the list of archive entries to the archive file
-    ListNode node = list_first(list);
-    while (node != NULL) {
-        MyzNode *entry = list_value(node);
+            // Small files read ahead are written from memory
+            const unsigned char *data = read_ahead_take(&ahead, entries, i);
+            if (data != NULL) {
+                if (pool != NULL && compress_pool_drain(pool) == -1)
+                    goto fail;
+                entry->data_size = entry->stat.st_size;
+                if (checksum_store(entry, crc32c(0, data, entry->data_size), entry->data_size) == -1 ||
+                    (stream && writeStreamEntry(fd, NULL, &dataEnd, entry, parent) == -1) ||
+                    align_data(fd, blockSize, &dataEnd, entry->data_size) == -1)
+                    goto fail;
+                entry->data_offset = dataEnd;
+                if (write_all(fd, data, entry->data_size) == -1) {
+                    perror("write");
+                    goto fail;
+                }
+                dataEnd += entry->data_size;
+                move_count(MOVE_URING, entry->data_size);
+                continue;
+            }
 
-        if (entry->type == MYZ_NODE_TYPE_FILE) {
             // Open the file to read its data
             int file_fd = open(entry->path, O_RDONLY);
             if (file_fd == -1) {
                 perror("open");
-                close(fd);
-                return -1;
+                goto fail;
             }
 
-            // Calculate the data offset
-            entry->data_offset = sizeof(MyzHeader) + dataBytesWritten;
+            // Only the data extents of a sparse file are stored, for raw, compressed and
+            // deduplicated data
+            MyzExtent *extents;
+            uint32_t extentCount;
+            if (sparse_scan(file_fd, &entry->stat, &extents, &extentCount) == 1) {
+                int ret = extra_add(entry, MYZ_EXTRA_EXTENTS, extents, extentCount * sizeof(MyzExtent));
+                free(extents);
+                if (ret == -1) {
+                    close(file_fd);
+                    goto fail;
+                }
+            }
 
-            // Move the fd to the data section
-            if (lseek(fd, entry->data_offset, SEEK_SET) == -1) {
-                perror("lseek");
-                close(fd);
+            // Deduplicated data is chunked and written here, compressed or not
+            if (store != NULL) {
+                int ret = dedup_store_file(store, entry, file_fd, fd, &dataEnd);
                 close(file_fd);
-                return -1;
+                if (ret == -1)
+                    goto fail;
+                continue;
             }
 
-            // Copy the data from the file to the archive file
-            char buffer[1024];
-            ssize_t bytesRead;
-            size_t bytesToRead = entry->stat.st_size;
-            while (bytesToRead > 0) {
-                int min = bytesToRead < sizeof(buffer) ? bytesToRead : sizeof(buffer);
-                bytesRead = read(file_fd, buffer, min);
-                if (bytesRead <= 0) {
-                    perror("read");
-                    close(fd);
+            // Compressed data is produced by the worker pool and written in list order
+            if (entry->compressed) {
+                if (pool == NULL)
+                    pool = compress_pool_create(compress_default_threads(), fd, &dataEnd, stream);
+                if (pool == NULL) {
                     close(file_fd);
-                    return -1;
+                    goto fail;
                 }
-
-                if (write(fd, buffer, bytesRead) == -1) {
-                    perror("write");
-                    close(fd);
+                if (stream && writeStreamEntry(fd, pool, &dataEnd, entry, parent) == -1) {
                     close(file_fd);
-                    return -1;
+                    goto fail;
                 }
-                bytesToRead -= bytesRead;
-                dataBytesWritten += bytesRead;
+                if (compress_pool_submit(pool, entry, file_fd) == -1)
+                    goto fail;
+                continue;
             }
 
-            // Close the file
-            close(file_fd);
-
-            // Move the fd to the metadata section. We put the metadata at the end of the archive file
-            if (lseek(fd, header.metadata_offset + metadataBytesWritten, SEEK_SET) == -1) {
-                perror("lseek");
-                close(fd);
-                return -1;
+            // Flush any pending compressed data before writing raw data
+            if (pool != NULL && compress_pool_drain(pool) == -1) {
+                close(file_fd);
+                goto fail;
             }
 
-            // Write the updated metadata (entry) to the archive file
-            if (write(fd, entry, sizeof(MyzNode)) == -1) {
-                perror("write");
-                close(fd);
-                return -1;
+            // The data is written right after the data of the previous entry
+            const MyzExtent *dataExtents = extra_extents(entry, &extentCount);
+            entry->data_size = dataExtents != NULL ? sparse_data_size(dataExtents, extentCount) : entry->stat.st_size;
+
+            // The data is copied without passing through this process, so it is
+            // checksummed from a mapping of the file first; the copy then reads it from the
+            // page cache if it still fits there
+            uint32_t crc;
+            if (checksum && (checksum_file(file_fd, dataExtents, extentCount, entry->data_size, &crc) == -1 ||
+                             checksum_store(entry, crc, entry->data_size) == -1)) {
+                fprintf(stderr, "Failed to checksum '%s'\n", entry->path);
+                close(file_fd);
+                goto fail;
+            }
+            if (stream && writeStreamEntry(fd, NULL, &dataEnd, entry, parent) == -1) {
+                close(file_fd);
+                goto fail;
             }
-            metadataBytesWritten += sizeof(MyzNode);    // Increment the number of metadata bytes written
 
-        } else if (entry->type == MYZ_NODE_TYPE_DIR) {
-            // Move the fd to the metadata section. We put the metadata at the end of the archive file
-            if (lseek(fd, header.metadata_offset + metadataBytesWritten, SEEK_SET) == -1) {
-                perror("lseek");
-                close(fd);
-                return -1;
+            if (align_data(fd, blockSize, &dataEnd, entry->data_size) == -1) {
+                close(file_fd);
+                goto fail;
             }
+            entry->data_offset = dataEnd;
 
-            // Write the directory metadata to the archive file
-            if (write(fd, entry, sizeof(MyzNode)) == -1) {
-                perror("write");
-                close(fd);
-                return -1;
+            // Copy the data from the file to the archive file. Storing the checksum may
+            // have moved the extra metadata, extents included
+            dataExtents = extra_extents(entry, &extentCount);
+            if ((dataExtents != NULL ? sparse_pack(file_fd, fd, dataExtents, extentCount)
+                                     : move_data(file_fd, 0, fd, entry->data_size)) == -1) {
+                close(file_fd);
+                goto fail;
             }
-            metadataBytesWritten += sizeof(MyzNode);
-        }
+            dataEnd += entry->data_size;
 
-        node = list_next(node);
+            // Close the file
+            close(file_fd);
+        } else if (entry->type == MYZ_NODE_TYPE_DIR && stream) {
+            if (writeStreamEntry(fd, pool, &dataEnd, entry, parent) == -1)
+                goto fail;
+        }
     }
 
-    return fd;
-}
+    // Wait for the remaining compressed data
+    if (pool != NULL) {
+        int ret = compress_pool_drain(pool);
+        compress_pool_destroy(pool);
+        pool = NULL;
+        if (ret == -1)
+            goto fail;
+    }
 
+    if (store != NULL) {
+        dedup_report(store, stdout);
+        dedup_destroy(store);
+        store = NULL;
+    }
 
-// Function to process a directory recursively and return the number of directory contents
-int processDirectory(char *dirPath, List list, bool gzip, uint64_t *totalDataBytes) {
-    // Open the directory
-    DIR *dir = opendir(dirPath);
-    if (dir == NULL) {
-        perror("opendir");
-        return 0;
+    // Mark the end of the entries of a stream archive
+    if (stream) {
+        char tag[MYZ_TAG_LEN] = MYZ_STREAM_END;
+        if (writeArchiveBytes(fd, NULL, &dataEnd, tag, sizeof(tag)) == -1)
+            goto fail;
     }
 
-    // Initialize the number of directory contents
-    int numDirContents = 0;
+    // The metadata section follows the data of all entries. Once the header is
+    // patched the archive is complete, and bytes left after it are only unused
+    if (write_metadata(fd, &header, entries, dataEnd, stream) == -1)
+        goto fail;
+    if (inPlace && ftruncate(fd, header.total_bytes) == -1)
+        perror("ftruncate");
 
-    // Process each file and directory in the directory
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        // Skip the current and parent directories
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-            continue;
+    linkmap_destroy(links, NULL);
+    meta_parents_free(&parents);
+    read_ahead_free(&ahead);
+    return fd;
 
-        // Get the full path of the file or directory
-        char fullPath[PATH_MAX];
-        snprintf(fullPath, PATH_MAX, "%s/%s", dirPath, entry->d_name);
+fail:
+    linkmap_destroy(links, NULL);
+    meta_parents_free(&parents);
+    read_ahead_free(&ahead);
+    if (pool != NULL)
+        compress_pool_destroy(pool);
+    if (store != NULL)
+        dedup_destroy(store);
+    // The header was not patched: drop what was written after the old archive
+    if (inPlace && ftruncate(fd, oldEnd) == -1)
+        perror("ftruncate");
+    close(fd);
+    return -1;
+}
 
-        // Get file information
-        struct stat st;
-        if (lstat(fullPath, &st) == -1) {
-            perror("lstat");
-            continue;
-        }
+// Function to open an archive and read its header. The fd is moved to the metadata
+// section, except for stream archives when forward is set: those are left right
+// after the header so that they can be read in one pass, even from a pipe.
+// An archive file of "-" reads from the standard input
+int open_archive(char *archiveFile, int flags, MyzHeader *header, bool forward) {
+    // Open the archive file
+    int fd = strcmp(archiveFile, "-") == 0 ? STDIN_FILENO : open(archiveFile, flags);
+    if (fd == -1) {
+        perror("open");
+        return -1;
+    }
 
-        // Initialize the node for the file or directory and allocate memory dynamically
-        MyzNode *node = malloc(sizeof(MyzNode));
-        memset(node, 0, sizeof(MyzNode)); // Initialize memory to zero
-        node->stat = st;
-        strncpy(node->name, entry->d_name, MAX_NAME_LEN - 1);
-        node->name[MAX_NAME_LEN - 1] = '\0';
-        strncpy(node->path, fullPath, MAX_PATH_LEN - 1);
-        node->path[MAX_PATH_LEN - 1] = '\0';
-        node->type = S_ISDIR(st.st_mode) ? MYZ_NODE_TYPE_DIR : 
-                      S_ISLNK(st.st_mode) ? MYZ_NODE_TYPE_SYMLINK : 
-                      S_ISREG(st.st_mode) ? MYZ_NODE_TYPE_FILE : MYZ_NODE_TYPE_HARDLINK;
-        node->data_offset = 0;    // This will be set later
-        node->compressed = gzip;
-        node->dirContents = (node->type == MYZ_NODE_TYPE_DIR) ? 0 : -1;
-        if (node->type == MYZ_NODE_TYPE_FILE)
-            *totalDataBytes += node->stat.st_size;
+    // Read the header of the archive
+    if (read_all(fd, header, sizeof(MyzHeader)) != sizeof(MyzHeader)) {
+        fprintf(stderr, "Invalid archive file\n");
+        close(fd);
+        return -1;
+    }
 
-        // Add the node to the list
-        list_insert_after(list, list_last(list), node);
+    // Check if the archive file is valid
+    bool stream = archive_is_stream(header);
+    if (!stream && !archive_is_compact(header) && memcmp(header->magic, MYZ_MAGIC, sizeof(header->magic)) != 0) {
+        fprintf(stderr, "Invalid archive file\n");
+        close(fd);
+        return -1;
+    }
 
-        // Process the directory recursively
-        if (node->type == MYZ_NODE_TYPE_DIR) {
-            node->dirContents = processDirectory(fullPath, list, gzip, totalDataBytes);
+    if (stream && forward)
+        return fd;
+
+    // The sizes of a stream archive are in its footer
+    if (stream) {
+        MyzFooter footer;
+        off_t end = lseek(fd, 0, SEEK_END);
+        if (end == -1) {
+            fprintf(stderr, "This command needs a seekable archive\n");
+            close(fd);
+            return -1;
         }
+        if (end < (off_t)(sizeof(MyzHeader) + sizeof(MyzFooter)) ||
+            pread(fd, &footer, sizeof(footer), end - sizeof(footer)) != sizeof(footer) ||
+            memcmp(footer.magic, MYZ_FOOTER_MAGIC, sizeof(footer.magic)) != 0) {
+            fprintf(stderr, "Invalid or truncated stream archive\n");
+            close(fd);
+            return -1;
+        }
+        header->total_bytes = footer.total_bytes;
+        header->metadata_offset = footer.metadata_offset;
+    }
 
-        // Increment the number of directory contents
-        numDirContents++;
+    // Move the file descriptor to the metadata offset
+    if (lseek(fd, header->metadata_offset, SEEK_SET) == -1) {
+        if (errno == ESPIPE)
+            fprintf(stderr, "Only stream archives can be read from a pipe\n");
+        else
+            perror("lseek");
+        close(fd);
+        return -1;
     }
 
-    // Close the directory
-    closedir(dir);
+    return fd;
+}
 
-    return numDirContents;  // Return only the immediate children
+// Function to open an archive and map its metadata for reading
+static int open_reader(char *archiveFile, int flags, ArchiveReader *reader) {
+    MyzHeader header;
+    int fd = open_archive(archiveFile, flags, &header, false);
+    if (fd == -1)
+        return -1;
+    return reader_open(reader, fd, &header);
 }
 
-// Function to create an archive
-void compress_files_recursive(char *path) {
-    struct stat st;
-    if (lstat(path, &st) == -1) {
-        perror("lstat");
-        return;
-    }
+// Function to copy the entries of an archive into a table that can be changed.
+// Their paths and extra metadata go to the arena of the table. Returns -1 if the metadata
+// could not be read whole; the table must be freed either way
+static int load_entries(ArchiveReader *reader, EntryTable *table) {
+    entries_init(table);
+    if (!reader->counted && entries_reserve(table, reader->count) == -1)
+        return -1;
 
-    if (S_ISDIR(st.st_mode)) {
-        DIR *dir = opendir(path);
-        if (dir == NULL) {
-            perror("opendir");
-            return;
+    ArchiveCursor cursor;
+    reader_begin(reader, &cursor);
+    MyzNode entry;
+    uint64_t parent;
+    int ret;
+    while ((ret = reader_next(&cursor, &entry, &parent)) == 1) {
+        MyzNode *node = entries_add(table);
+        if (node == NULL) {
+            ret = -2;
+            break;
         }
-
-        struct dirent *entry;
-        while ((entry = readdir(dir)) != NULL) {
-            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-                continue;
-
-            char fullPath[PATH_MAX];
-            snprintf(fullPath, PATH_MAX, "%s/%s", path, entry->d_name);
-            compress_files_recursive(fullPath);
+        *node = entry;
+        if (entries_set_path(table, node, entry.path) == -1 ||
+            entries_set_extra(table, node, entry.extra, entry.extra_size) == -1) {
+            ret = -2;
+            break;
         }
 
-        closedir(dir);
-    } else if (S_ISREG(st.st_mode)) {
-        pid_t pid = fork();
-        if (pid == -1) {
-            perror("fork");
-            exit(EXIT_FAILURE);
-        } else if (pid == 0) {  // Child
-            execlp("gzip", "gzip", path, NULL);
-            perror("exec");  // Only if exec fails
-            exit(EXIT_FAILURE);
-        } else {
-            wait(NULL);  // Wait for the child process to finish
-            // Update the size of the compressed file
-            char gzPath[PATH_MAX];
-            snprintf(gzPath, PATH_MAX, "%s.gz", path);
-            struct stat gzSt;
-            if (stat(gzPath, &gzSt) == 0) {
-                st.st_size = gzSt.st_size;
-            }
-        }
+        // Version 2 and first release directories count the entries that refer to
+        // them. Every entry is in the table, so its position is its number
+        if (!reader->counted && parent > 0)
+            table->entries[parent - 1].dirContents++;
     }
+    if (ret == -1)
+        fprintf(stderr, "Corrupt metadata section\n");
+    reader_end(&cursor);
+    return ret == 0 ? 0 : -1;
 }
 
-void compress_files(char **files) {
-    for (int i = 0; files[i] != NULL; i++) {
-        compress_files_recursive(files[i]);
-    }
-
-    while (wait(NULL) > 0);
+// Function to process a directory recursively and return the number of directory contents,
+// or -1 if out of memory. The tree is read by a pool of walker threads; the table gets the same order either way
+int processDirectory(char *dirPath, EntryTable *entries, bool gzip) {
+    return walk_tree(dirPath, entries, gzip, walk_default_threads());
 }
 
-void create_archive(char *archiveFile, char **fileList, bool gzip) {
-    if (gzip) {
-        compress_files(fileList);
-    }
-
-    List list = list_create(NULL);  // List to store the file and directory information
-
-    uint64_t totalDataBytes = 0;    // Total number of data bytes in the archive
+// Function to create an archive. Returns -1 if it could not be written
+int create_archive(char *archiveFile, char **fileList, bool gzip, bool dedup, bool align, bool checksum, int uringDepth) {
+    EntryTable entries;     // Table to store the file and directory information
+    entries_init(&entries);
 
     // Process each file and directory in the list
     for (int i = 0; fileList[i] != NULL; i++) {
         struct stat st; // File information
         if (lstat(fileList[i], &st) == -1) {
             perror("lstat");
-            list_destroy(list);
-            return;
+            entries_free(&entries);
+            return -1;
         }
 
-        // Initialize the node for the file or directory
-        MyzNode *node = malloc(sizeof(MyzNode));
-        memset(node, 0, sizeof(MyzNode)); // Initialize memory to zero
-        node->stat = st;    // Copy the file information
-        
-        // Get the name of the file or directory
-        char *lastPart = strrchr(fileList[i], '/');
-        if (lastPart == NULL) { // No directory part
-            strncpy(node->name, fileList[i], MAX_NAME_LEN - 1);
-            node->name[MAX_NAME_LEN - 1] = '\0';
-        } else {    // Directory part exists
-            strncpy(node->name, lastPart + 1, MAX_NAME_LEN - 1);
-            node->name[MAX_NAME_LEN - 1] = '\0';
+        // Add a zeroed node for the file or directory to the table
+        MyzNode *node = entries_add(&entries);
+        if (node == NULL) {
+            entries_free(&entries);
+            return -1;
         }
-        strncpy(node->path, fileList[i], MAX_PATH_LEN - 1); // Copy the path
-        node->path[MAX_PATH_LEN - 1] = '\0';
-        // Update the path and name and the size of the file if it was compressed   
-        if (gzip && S_ISREG(st.st_mode)) {
-            char *dot = strrchr(node->name, '.');
-            if (dot != NULL && strcmp(dot, ".gz") == 0) {
-                *dot = '\0';    // Remove the .gz extension
-            }
-            snprintf(node->path, MAX_PATH_LEN, "%s.gz", fileList[i]);
-            strncpy(node->name, basename(node->path), MAX_NAME_LEN - 1);
+        node->stat = st;    // Copy the file information
 
-            struct stat gzSt;
-            if (stat(node->path, &gzSt) == 0) {
-                node->stat.st_size = gzSt.st_size;
-            }
+        // Copy the path to the arena, the name is its last part
+        if (entries_set_path(&entries, node, fileList[i]) == -1) {
+            entries_free(&entries);
+            return -1;
         }
-
         node->type = S_ISDIR(st.st_mode) ? MYZ_NODE_TYPE_DIR : MYZ_NODE_TYPE_FILE;  // Set the type
         node->data_offset = 0;    // This will be set later
         node->dirContents = (node->type == MYZ_NODE_TYPE_DIR) ? 0 : -1; // Set the number of directory contents
-        node->compressed = gzip;
-
-        // Add the file size to the total bytes
-        if (node->type == MYZ_NODE_TYPE_FILE)
-            totalDataBytes += node->stat.st_size;
+        node->compressed = gzip && node->type == MYZ_NODE_TYPE_FILE;
 
-        // Add the node to the list
-        list_insert_after(list, list_last(list), node);
-
-        // Process the directory recursively
-        if (node->type == MYZ_NODE_TYPE_DIR)
-            node->dirContents = processDirectory(fileList[i], list, gzip, &totalDataBytes);
+        // Process the directory recursively. The walk adds entries, so the node is found again by position
+        if (node->type == MYZ_NODE_TYPE_DIR) {
+            size_t index = entries.count - 1;
+            int dirContents = processDirectory(fileList[i], &entries, gzip);
+            if (dirContents == -1) {
+                entries_free(&entries);
+                return -1;
+            }
+            entries.entries[index].dirContents = dirContents;
+        }
     }
 
-    // Initialize the header of the archive
-    MyzHeader header = {
-        "MYZ",
-        sizeof(MyzHeader) + sizeof(MyzNode) * list_size(list) + totalDataBytes,
-        sizeof(MyzHeader) + totalDataBytes
-    };
+    // Initialize the header of the archive. The sizes are filled in while writing
+    MyzHeader header = {"MYZ", 0, 0};
 
-    // Transfer the list to the archive file
-    int fd = transferListToFile(header, list, archiveFile);
+    // Transfer the table to the archive file
+    int fd = transferEntriesToFile(header, &entries, 0, archiveFile, dedup, align, checksum, uringDepth);
     if (fd == -1) {
-        list_destroy(list);
-        return;
+        entries_free(&entries);
+        return -1;
     }
 
     // Close the archive file
     close(fd);
-    
-    // Free dynamically allocated memory
-    ListNode node = list_first(list);
-    while (node != NULL) {
-        MyzNode *entry = list_value(node);
-        free(entry);
-        node = list_next(node);
-    }
 
-    // Destroy the list
-    list_destroy(list);
+    // Free the table and everything it holds at once
+    entries_free(&entries);
+    return 0;
 }
 
-// Function to extract an archive
-void extract_file(int fd, MyzNode *file_entry, const char *basePath) {
-    // Remove any leading "./" from the base path
-    while (strncmp(basePath, "./", 2) == 0) {
-        basePath += 2;
-    }
-
-    // Remove any leading "./" from the file name as well
-    const char *fileName = file_entry->name;
+// Function to remove any leading "./" from the name of an entry
+static const char *clean_output_name(const char *fileName) {
     while (strncmp(fileName, "./", 2) == 0) {
         fileName += 2;
     }
+    return fileName;
+}
+
+// Function to remember where a file with several links was extracted
+static void remember_link_target(LinkMap links, MyzNode *file_entry, const char *filePath) {
+    if (file_entry->stat.st_nlink > 1 &&
+        linkmap_find(links, file_entry->stat.st_dev, file_entry->stat.st_ino) == NULL) {
+        char *path = strdup(filePath);
+        if (linkmap_insert(links, file_entry->stat.st_dev, file_entry->stat.st_ino, path) == -1)
+            free(path);
+    }
+}
+
+// Function to prepare an output file for the data of an entry. The blocks of the
+// file are allocated up front, unless its data may be cloned from the archive at
+// archiveOffset (-1 for a stream), and sparse files get their size so that their
+// holes are left
+static int prepare_output(int file_fd, MyzNode *file_entry, off_t archiveOffset) {
+    uint32_t count;
+    if (extra_extents(file_entry, &count) != NULL) {
+        if (ftruncate(file_fd, file_entry->stat.st_size) == -1) {
+            perror("ftruncate");
+            return -1;
+        }
+        return 0;
+    }
+    bool raw = !file_entry->compressed && extra_chunks(file_entry, &count) == NULL;
+    if (!raw || !move_clone_possible(archiveOffset))
+        output_preallocate(file_fd, file_entry->stat.st_size);
+    return 0;
+}
+
+// Function to write the data of an entry to its output file at filePath, inflating
+// compressed data on numThreads threads
+static void write_file_data(int fd, MyzNode *file_entry, int file_fd, const char *filePath, int numThreads) {
+    if (prepare_output(file_fd, file_entry, file_entry->data_offset) == -1)
+        return;
+
+    int ret;
+    uint32_t numChunks, extentCount;
+    const MyzExtent *extents = extra_extents(file_entry, &extentCount);
+    if (extra_chunks(file_entry, &numChunks) != NULL) {
+        // Rebuild deduplicated data from its chunks
+        ret = dedup_extract(fd, file_entry, file_fd, false);
+    } else if (file_entry->compressed) {
+        // Inflate compressed data straight into the destination file, one block per thread
+        ret = decompress_blocks(fd, file_entry, file_fd, numThreads);
+    } else {
+        // Copy the data from the archive to the file
+        ret = extents != NULL ? sparse_unpack(fd, file_entry->data_offset, file_fd, extents, extentCount)
+                              : move_data(fd, file_entry->data_offset, file_fd, file_entry->data_size);
+    }
+    if (ret == -1)
+        fprintf(stderr, "Failed to extract '%s'\n", filePath);
+}
+
+// Function to create the output file of an entry in directory dir and write its data.
+// The path of the file is stored in filePath. Returns -1 if the file could not be created
+static int extract_file_data(int fd, MyzNode *file_entry, const OutDirs *dirs, int dir, char *filePath, int numThreads) {
+    int file_fd = output_create(dirs, dir, clean_output_name(file_entry->name), filePath);
+    if (file_fd == -1)
+        return -1;
+    write_file_data(fd, file_entry, file_fd, filePath, numThreads);
+    output_finish(file_fd, &file_entry->stat);
+    close(file_fd);
+    return 0;
+}
 
-    // Construct the file path using the cleaned file name
+// Function to extract a file of an archive into directory dir. The paths of files
+// with several links are kept in links, so that their other paths can be linked to them
+void extract_file(int fd, MyzNode *file_entry, const OutDirs *dirs, int dir, LinkMap links) {
     char filePath[PATH_MAX];
-    snprintf(filePath, sizeof(filePath), "%s/%s", basePath, fileName);
-
-    // Check if the file already exists and append a suffix if necessary
-    int suffix = 1;
-    char originalFilePath[PATH_MAX];
-    strcpy(originalFilePath, filePath);
-    char *dot = strrchr(originalFilePath, '.');
-    while (access(filePath, F_OK) == 0) {
-        if (dot) {
-            int prefix_length = (int)(dot - originalFilePath);
-            snprintf(filePath, sizeof(filePath), "%s/%.*s(%d)%s",
-                     basePath, prefix_length, originalFilePath, suffix++, dot);
-        } else {
-            snprintf(filePath, sizeof(filePath), "%s/%s(%d)",
-                     basePath, fileName, suffix++);
+    if (extract_file_data(fd, file_entry, dirs, dir, filePath, compress_default_threads()) == 0)
+        remember_link_target(links, file_entry, filePath);
+}
+
+// Function to extract a hard link of an archive into directory dir. It is linked to
+// the first path of its file, or gets a copy of the data when that path was not extracted
+void extract_link(ArchiveReader *reader, MyzNode *link_entry, const OutDirs *dirs, int dir, LinkMap links) {
+    const char *target = linkmap_find(links, link_entry->stat.st_dev, link_entry->stat.st_ino);
+    if (target != NULL && output_link(dirs, dir, clean_output_name(link_entry->name), target) == 0)
+        return;
+
+    // Find the entry that holds the data
+    ArchiveCursor cursor;
+    MyzNode entry;
+    uint64_t parent;
+    reader_begin(reader, &cursor);
+    while (reader_next(&cursor, &entry, &parent) == 1) {
+        if (entry.type == MYZ_NODE_TYPE_FILE && entry.stat.st_dev == link_entry->stat.st_dev &&
+            entry.stat.st_ino == link_entry->stat.st_ino) {
+            entry.name = link_entry->name;
+            entry.path = link_entry->path;
+            extract_file(reader->fd, &entry, dirs, dir, links);
+            reader_end(&cursor);
+            return;
         }
     }
+    reader_end(&cursor);
+    fprintf(stderr, "Missing data of hard link '%s'\n", link_entry->path);
+}
 
-    // Remove any leading "./" from the file path before printing
-    const char *cleanFilePath = filePath;
-    while (strncmp(cleanFilePath, "./", 2) == 0) {
-        cleanFilePath += 2;
+// Function to write the original data of a file to the standard output, with the
+// holes of a sparse file as zeros. Raw data is spliced or sent from the archive
+static int write_file_stdout(int fd, MyzNode *file_entry) {
+    uint32_t count, extentCount;
+    const MyzExtent *extents = extra_extents(file_entry, &extentCount);
+    if (extra_chunks(file_entry, &count) != NULL)
+        return dedup_extract(fd, file_entry, STDOUT_FILENO, true);
+    if (!file_entry->compressed)
+        return extents != NULL ? sparse_stream(fd, file_entry->data_offset, STDOUT_FILENO, extents,
+                                               extentCount, file_entry->stat.st_size)
+                               : move_data(fd, file_entry->data_offset, STDOUT_FILENO, file_entry->data_size);
+    if (extents == NULL)
+        return decompress_range(fd, file_entry, 0, file_entry->stat.st_size, STDOUT_FILENO);
+    if (decompress_range(fd, file_entry, 0, sparse_data_size(extents, extentCount), STDOUT_FILENO) == -1)
+        return -1;
+    return sparse_write_end(STDOUT_FILENO, extents, extentCount, file_entry->stat.st_size);
+}
+
+// Function to write the data of a file or hard link to the standard output. A hard
+// link writes the data of its file, wherever that is in the archive
+static void write_member_stdout(ArchiveReader *reader, MyzNode *member) {
+    if (member->type != MYZ_NODE_TYPE_HARDLINK) {
+        if (write_file_stdout(reader->fd, member) == -1)
+            fprintf(stderr, "Failed to write '%s'\n", member->path);
+        return;
+    }
+
+    ArchiveCursor cursor;
+    MyzNode entry;
+    uint64_t parent;
+    reader_begin(reader, &cursor);
+    while (reader_next(&cursor, &entry, &parent) == 1) {
+        if (entry.type == MYZ_NODE_TYPE_FILE && entry.stat.st_dev == member->stat.st_dev &&
+            entry.stat.st_ino == member->stat.st_ino) {
+            if (write_file_stdout(reader->fd, &entry) == -1)
+                fprintf(stderr, "Failed to write '%s'\n", member->path);
+            reader_end(&cursor);
+            return;
+        }
     }
+    reader_end(&cursor);
+    fprintf(stderr, "Missing data of hard link '%s'\n", member->path);
+}
 
-    int file_fd = open(filePath, O_WRONLY | O_CREAT | O_TRUNC, file_entry->stat.st_mode);
+// Entry read from a stream archive, kept for the entries that follow it
+typedef struct {
+    char *path;     // Path of a directory in the archive, NULL for other entries
+    struct stat *stat;  // Stored status of a directory, to create it for a match inside
+    uint64_t parent;    // Reference of its directory, 0 at the top level
+    int outDir;     // Directory it was extracted to, -1 if it was not extracted
+    bool contents;  // Everything inside the directory is extracted
+    bool skip;      // Nothing inside the directory is matched
+} StreamEntry;
+
+// Function to get the extracted directory of the entries of directory parent (0 for
+// the current directory) of a stream archive, creating it and the directories it is
+// in when only a match inside is extracted. Returns -1 if one cannot be created
+static int stream_output_dir(OutDirs *dirs, StreamEntry *entries, uint64_t parent, int *dir) {
+    *dir = -1;
+    if (parent == 0)
+        return 0;
+    StreamEntry *entry = &entries[parent - 1];
+    if (entry->outDir == -1) {
+        int outer;
+        if (stream_output_dir(dirs, entries, entry->parent, &outer) == -1)
+            return -1;
+        const char *name = strrchr(entry->path, '/');
+        name = name != NULL ? name + 1 : entry->path;
+        entry->outDir = outdir_create(dirs, outer, clean_output_name(name), entry->stat);
+        if (entry->outDir == -1)
+            return -1;
+    }
+    *dir = entry->outDir;
+    return 0;
+}
+
+// Function to read the next entry record of a stream archive and find its parent.
+// Version 1 records hold raw nodes whose directories are tracked with dirContents;
+// compact records refer to their parent, whose path is joined with the name. The path
+// goes to path, a buffer of MAX_PATH_LEN bytes
+static int read_stream_entry(int fd, bool compact, MyzNode *entry, char *path, MetaParents *parents,
+                             StreamEntry *entries, uint64_t count, uint64_t *parent) {
+    if (!compact) {
+        if (read_entry(fd, entry, path) == -1)
+            return -1;
+        *parent = meta_parent(parents, entry, true);
+        return 0;
+    }
 
-    lseek(fd, file_entry->data_offset, SEEK_SET);   // Move to the data offset
+    unsigned char length[4];
+    if (read_all(fd, length, sizeof(length)) != sizeof(length))
+        return -1;
+    size_t size = length[0] | length[1] << 8 | length[2] << 16 | (size_t)length[3] << 24;
+    unsigned char *record = malloc(size > 0 ? size : 1);
+    int ret = -1;
+    if (record != NULL && read_all(fd, record, size) == (ssize_t)size)
+        ret = meta_decode_record(record, size, entry, path, parent);
+    free(record);
+    if (ret == -1 || *parent > count || (*parent > 0 && entries[*parent - 1].path == NULL))
+        return -1;
 
-    // Read the data from the archive and write it to the file
-    size_t bytesToRead = file_entry->stat.st_size;
-    char buffer[1024];
-    while (bytesToRead > 0) {
-        int min = bytesToRead < sizeof(buffer) ? bytesToRead : sizeof(buffer);
-        ssize_t bytesRead = read(fd, buffer, min);
-        if (bytesRead <= 0) break;
-        write(file_fd, buffer, bytesRead);
-        bytesToRead -= bytesRead;
+    if (*parent > 0) {
+        char name[MAX_PATH_LEN];
+        memcpy(name, path, strlen(path) + 1);
+        if (snprintf(path, MAX_PATH_LEN, "%s/%s", entries[*parent - 1].path, name) >= MAX_PATH_LEN)
+            return -1;
+        entry->name = entries_name(path);
     }
-    close(file_fd);
+    return 0;
+}
+
+// Function to extract a stream archive in one forward pass. Entries come in the
+// same order as in the metadata table, each one followed by its data. With toStdout,
+// the data of the files is written to the standard output and nothing is created
+void extract_stream(int fd, PatternSet patterns, bool compact, bool toStdout) {
+    StreamEntry *entries = NULL;    // Every entry read so far
+    uint64_t count = 0, capacity = 0;
+    MetaParents parents;
+    meta_parents_init(&parents);
+    LinkMap links = linkmap_create();   // Extracted paths of files with several links
+    OutDirs dirs;                       // Extracted directories
+    outdirs_init(&dirs);
+    MyzNode entry;
+    entry.extra = NULL;
+    char path[MAX_PATH_LEN];            // Path of the entry
+
+    while (true) {
+        // Read the tag of the next record
+        char tag[MYZ_TAG_LEN];
+        if (read_all(fd, tag, sizeof(tag)) != sizeof(tag)) {
+            fprintf(stderr, "Truncated stream archive\n");
+            break;
+        }
+        if (memcmp(tag, MYZ_STREAM_END, sizeof(tag)) == 0)
+            break;  // The trailing metadata table is not needed
+        free(entry.extra);  // Extra metadata of the previous entry
+        entry.extra = NULL;
+        uint64_t parent;
+        if (memcmp(tag, MYZ_STREAM_ENTRY, sizeof(tag)) != 0 ||
+            read_stream_entry(fd, compact, &entry, path, &parents, entries, count, &parent) == -1) {
+            fprintf(stderr, "Invalid stream archive\n");
+            break;
+        }
+
+        // Remember the entry for its children
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            entries = realloc(entries, capacity * sizeof(StreamEntry));
+        }
+        StreamEntry *current = &entries[count++];
+        *current = (StreamEntry){NULL, NULL, parent, -1, false, false};
+        if (entry.type == MYZ_NODE_TYPE_DIR) {
+            current->path = strdup(entry.path);
+            current->stat = malloc(sizeof(struct stat));
+            if (current->path == NULL || current->stat == NULL) {
+                perror("malloc");
+                break;
+            }
+            *current->stat = entry.stat;
+        }
+
+        // Children of an extracted directory are always extracted into it. Other entries
+        // are matched, unless their directory holds no match
+        const StreamEntry *up = parent > 0 ? &entries[parent - 1] : NULL;
+        int dir = -1, request;
+        bool extract = true;
+        if (up != NULL && up->contents) {
+            dir = up->outDir;
+        } else if (up != NULL && up->skip) {
+            extract = false;
+        } else if (patterns != NULL) {
+            // A match of a pattern keeps its path, below the directories it is in
+            pattern_match match = pattern_set_match(patterns, entry.path, &request);
+            extract = match == PATTERN_EXACT ||
+                      (match == PATTERN_GLOB && (toStdout || stream_output_dir(&dirs, entries, parent, &dir) == 0));
+        }
 
-    // Decompress the file if it was compressed
-    if (file_entry->compressed) {
-        pid_t pid = fork();
-        if (pid == -1) {
-            perror("fork");
-            exit(EXIT_FAILURE);
-        } else if (pid == 0) {  // Child
-            execlp("gunzip", "gunzip", filePath, NULL);
-            perror("exec");  // Only if exec fails
-            exit(EXIT_FAILURE);
+        if (entry.type == MYZ_NODE_TYPE_DIR) {
+            if (extract && !toStdout) {
+                current->outDir = outdir_create(&dirs, dir, clean_output_name(entry.name), &entry.stat);
+                if (current->outDir == -1)
+                    break;
+            }
+            if (extract) {
+                current->contents = true;
+            } else {
+                current->skip = (up != NULL && up->skip) || !pattern_set_inside(patterns, entry.path);
+            }
+        } else if (entry.type == MYZ_NODE_TYPE_HARDLINK) {
+            // Hard links have no data. Their first path came earlier in the stream
+            const char *target = linkmap_find(links, entry.stat.st_dev, entry.stat.st_ino);
+            if (extract && toStdout)
+                fprintf(stderr, "Cannot write hard link '%s', whose data came earlier in the stream\n", entry.path);
+            else if (extract && target == NULL)
+                fprintf(stderr, "Cannot extract hard link '%s' without its first path\n", entry.path);
+            else if (extract)
+                output_link(&dirs, dir, clean_output_name(entry.name), target);
         } else {
-            wait(NULL);  // Wait for the child process to finish
-            // Update the size of the decompressed file
-            struct stat st;
-            if (stat(filePath, &st) == 0) {
-                file_entry->stat.st_size = st.st_size;
+            char filePath[PATH_MAX];
+            int file_fd = !extract ? -1 : toStdout ? STDOUT_FILENO
+                                               : output_create(&dirs, dir, clean_output_name(entry.name), filePath);
+            if (file_fd != -1 && !toStdout) {
+                remember_link_target(links, &entry, filePath);
+                prepare_output(file_fd, &entry, -1);
+            }
+            uint32_t extentCount;
+            const MyzExtent *extents = extra_extents(&entry, &extentCount);
+
+            // Copy or skip the data that follows the entry
+            // The standard output gets the holes of sparse files as zeros
+            int ret;
+            if (entry.compressed)
+                ret = decompress_frames(fd, file_fd, &entry, toStdout);
+            else if (file_fd != -1 && extents != NULL)
+                ret = toStdout ? sparse_stream(fd, -1, file_fd, extents, extentCount, entry.stat.st_size)
+                               : sparse_unpack(fd, -1, file_fd, extents, extentCount);
+            else if (file_fd != -1)
+                ret = move_data(fd, -1, file_fd, entry.data_size);
+            else
+                ret = discard_data(fd, entry.data_size);
+            if (ret == 0 && toStdout && file_fd != -1 && entry.compressed && extents != NULL)
+                ret = sparse_write_end(file_fd, extents, extentCount, entry.stat.st_size);
+
+            if (file_fd != -1 && !toStdout) {
+                output_finish(file_fd, &entry.stat);
+                close(file_fd);
+            }
+            if (ret == -1) {
+                fprintf(stderr, "Failed to extract '%s'\n", entry.path);
+                break;  // The position in the stream is lost
             }
         }
     }
+
+    for (uint64_t i = 0; i < count; i++) {
+        free(entries[i].path);
+        free(entries[i].stat);
+    }
+    free(entries);
+    free(entry.extra);
+    meta_parents_free(&parents);
+    linkmap_destroy(links, free);
+    outdirs_free(&dirs);    // Directory times are restored after their contents
 }
 
+#define EXTRACT_STDOUT_DIR (-2)     // Directory of the members written to the standard output
+
+// Member queued for a parallel extraction, or batched for io_uring. Only what its
+// extraction needs is kept
+typedef struct {
+    char *path;             // Its name is the last part
+    int dir;                // Directory it is extracted to
+    myz_node_type type;
+    struct stat stat;
+    off_t data_offset;
+    off_t data_size;
+    bool compressed;
+    uint32_t extra_size;
+    unsigned char *extra;
+    char *outPath;          // Path a file with several links was extracted to
+    bool small;             // Data read and written through the ring
+} ExtractJob;
+
+// Buffers of the batch of a sequential extraction through io_uring, allocated once
+typedef struct {
+    UringOp *ops;           // Two per file: its read, write or close
+    int *fds;               // Output file of each member
+    size_t *readOf;         // Read of the data of each small file
+    unsigned char *buffer;  // Data of the small files, URING_BATCH_BYTES
+    size_t bytes;           // Bytes of the buffer in use
+    char (*paths)[PATH_MAX];    // Paths of the created files
+} ExtractBatch;
+
+// Members of an archive being extracted. Directories are created while the metadata
+// is walked and the files are queued; they are then extracted by worker threads in
+// the order of their data in the archive, and hard links last, in archive order.
+// The status of the directories is restored after that. With one thread and a ring,
+// files are batched instead and extracted a batch at a time through io_uring
+typedef struct {
+    int fd;                 // Archive
+    int jobs;               // Worker threads. With one, every member is extracted right away
+    Uring ring;             // Batches the files of a sequential extraction, or NULL
+    LinkMap links;          // Extracted paths of files with several links
+    OutDirs dirs;           // Extracted directories
+    ExtractJob *items;      // Queued members, in archive order
+    size_t count;
+    size_t capacity;
+    size_t *order;          // Positions of the queued files by data offset
+    size_t numFiles;
+    size_t next;            // Next file to take from order
+    int blockThreads;       // Threads that inflate the blocks of one file
+    ExtractBatch batch;
+    bool toStdout;          // Members are written to the standard output right away
+} ExtractQueue;
+
+// Position of a queued file and the offset of its data, to sort the files
+typedef struct {
+    off_t offset;
+    size_t index;
+} ExtractOrder;
+
+static int compare_extract_order(const void *a, const void *b) {
+    const ExtractOrder *x = a, *y = b;
+    if (x->offset != y->offset)
+        return x->offset < y->offset ? -1 : 1;
+    return (x->index > y->index) - (x->index < y->index);
+}
 
-// Function to extract an archive
-void extract_directory(int fd, List list, ListNode *current, const char *basePath) {
-    // Create the directory
-    MyzNode *dir_entry = list_value(*current);
-    char dirPath[PATH_MAX];
-    snprintf(dirPath, sizeof(dirPath), "%s/%s", basePath, dir_entry->name);
+static void extract_batch_free(ExtractQueue *queue) {
+    ExtractBatch *batch = &queue->batch;
+    free(batch->ops);
+    free(batch->fds);
+    free(batch->readOf);
+    free(batch->buffer);
+    free(batch->paths);
+    memset(batch, 0, sizeof(*batch));
+    uring_destroy(queue->ring);
+    queue->ring = NULL;
+}
 
-    if (mkdir(dirPath, dir_entry->stat.st_mode) == -1 && errno != EEXIST) {
-        perror("mkdir");
+// Function to set up the ring and the buffers of the batches. Without a ring, every
+// member goes through the blocking calls
+static void extract_batch_init(ExtractQueue *queue, int uringDepth) {
+    queue->ring = uring_create(uringDepth);
+    if (queue->ring == NULL)
         return;
-    }
+    size_t depth = uring_depth(queue->ring);
+    ExtractBatch *batch = &queue->batch;
+    batch->ops = malloc(2 * depth * sizeof(UringOp));
+    batch->fds = malloc(depth * sizeof(int));
+    batch->readOf = malloc(depth * sizeof(size_t));
+    batch->buffer = malloc(URING_BATCH_BYTES);
+    batch->paths = malloc(depth * sizeof(*batch->paths));
+    if (batch->ops == NULL || batch->fds == NULL || batch->readOf == NULL || batch->buffer == NULL ||
+        batch->paths == NULL)
+        extract_batch_free(queue);
+}
 
-    // Extract the directory contents
-    int numChildren = dir_entry->dirContents;
-    *current = list_next(*current);
+static void extract_queue_init(ExtractQueue *queue, int fd, int jobs, int uringDepth, bool toStdout) {
+    memset(queue, 0, sizeof(*queue));
+    queue->fd = fd;
+    queue->jobs = jobs > 1 && !toStdout ? jobs : 1;
+    queue->links = linkmap_create();
+    queue->toStdout = toStdout;
+    outdirs_init(&queue->dirs);
+    if (queue->jobs == 1 && uringDepth > 0 && !toStdout)
+        extract_batch_init(queue, uringDepth);
+}
 
-    // Extract each child
-    for (int i = 0; i < numChildren; ++i) {
-        MyzNode *child = list_value(*current);
-        if (child->type == MYZ_NODE_TYPE_DIR) {
-            extract_directory(fd, list, current, dirPath);
-        } else {
-            extract_file(fd, child, dirPath);
-            *current = list_next(*current);
+// Function to create the directory name in directory dir for its contents. When the
+// members go to the standard output nothing is created, and EXTRACT_STDOUT_DIR
+// stands for it. Returns the number of the directory or -1
+static int extract_queue_dir(ExtractQueue *queue, int dir, const char *name, const struct stat *st) {
+    if (queue->toStdout)
+        return EXTRACT_STDOUT_DIR;
+    return outdir_create(&queue->dirs, dir, clean_output_name(name), st);
+}
+
+// Function to add a member to the queue. Returns NULL if out of memory
+static ExtractJob *extract_queue_push(ExtractQueue *queue, MyzNode *entry, int dir) {
+    if (queue->count == queue->capacity) {
+        size_t capacity = queue->capacity ? queue->capacity * 2 : 1024;
+        ExtractJob *items = realloc(queue->items, capacity * sizeof(ExtractJob));
+        if (items == NULL) {
+            perror("realloc");
+            return NULL;
         }
-    }
+        queue->items = items;
+        queue->capacity = capacity;
+    }
+    ExtractJob *job = &queue->items[queue->count];
+    job->path = strdup(entry->path);
+    job->extra = entry->extra_size > 0 ? malloc(entry->extra_size) : NULL;
+    if (job->path == NULL || (entry->extra_size > 0 && job->extra == NULL)) {
+        perror("malloc");
+        free(job->path);
+        free(job->extra);
+        return NULL;
+    }
+    job->dir = dir;
+    job->type = entry->type;
+    job->stat = entry->stat;
+    job->data_offset = entry->data_offset;
+    job->data_size = entry->data_size;
+    job->compressed = entry->compressed;
+    job->extra_size = entry->extra_size;
+    if (entry->extra_size > 0)
+        memcpy(job->extra, entry->extra, entry->extra_size);
+    job->outPath = NULL;
+    job->small = false;
+    queue->count++;
+    return job;
 }
 
-void extract_archive(char *archiveFile, char **fileList) {
-    // Open the archive file
-    int fd = open(archiveFile, O_RDONLY);
-    if (fd == -1) {
-        perror("open");
+static void extract_batch(ExtractQueue *queue);
+
+// Function to extract a file or hard link into directory dir, or queue it for the worker threads
+static void extract_queue_add(ExtractQueue *queue, ArchiveReader *reader, MyzNode *entry, int dir) {
+    if (queue->toStdout) {
+        write_member_stdout(reader, entry);
         return;
     }
-
-    // Read the header of the archive
-    MyzHeader header;
-    if (read(fd, &header, sizeof(MyzHeader)) != sizeof(MyzHeader)) {
-        perror("read");
-        close(fd);
+    if (queue->jobs == 1 && (queue->ring == NULL || entry->type == MYZ_NODE_TYPE_HARDLINK)) {
+        // A hard link may refer to a file that is still in the batch
+        extract_batch(queue);
+        if (entry->type == MYZ_NODE_TYPE_HARDLINK)
+            extract_link(reader, entry, &queue->dirs, dir, queue->links);
+        else
+            extract_file(queue->fd, entry, &queue->dirs, dir, queue->links);
         return;
     }
 
-    // Check if the archive file is valid
-    if (strncmp(header.magic, "MYZ", 4) != 0) {
-        fprintf(stderr, "Invalid archive file\n");
-        close(fd);
+    bool small = false;
+    if (queue->ring != NULL) {
+        // Small raw data is read and written through the ring too, unless it may be cloned
+        uint32_t count;
+        small = !entry->compressed && entry->data_size <= URING_FILE_MAX &&
+                extra_chunks(entry, &count) == NULL && extra_extents(entry, &count) == NULL &&
+                !move_clone_possible(entry->data_offset);
+
+        if (small && queue->batch.bytes + entry->data_size > URING_BATCH_BYTES)
+            extract_batch(queue);
+    }
+
+    ExtractJob *job = extract_queue_push(queue, entry, dir);
+    if (job == NULL || queue->ring == NULL)
         return;
+    job->small = small;
+    if (small)
+        queue->batch.bytes += entry->data_size;
+    if (queue->count == uring_depth(queue->ring))
+        extract_batch(queue);
+}
+
+// Function to rebuild the entry of a queued member
+static void extract_job_node(const ExtractJob *job, MyzNode *node) {
+    memset(node, 0, sizeof(MyzNode));
+    node->name = entries_name(job->path);
+    node->path = job->path;
+    node->type = job->type;
+    node->stat = job->stat;
+    node->data_offset = job->data_offset;
+    node->data_size = job->data_size;
+    node->compressed = job->compressed;
+    node->dirContents = -1;
+    node->extra_size = job->extra_size;
+    node->extra = job->extra;
+    node->extra_borrowed = true;
+}
+
+// Worker thread: extract queued files until there are none left. They all read the
+// shared archive descriptor at the offset of their data
+static void *extract_worker(void *arg) {
+    ExtractQueue *queue = arg;
+    while (true) {
+        size_t i = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED);
+        if (i >= queue->numFiles)
+            break;
+        ExtractJob *job = &queue->items[queue->order[i]];
+        MyzNode node;
+        extract_job_node(job, &node);
+        char filePath[PATH_MAX];
+        if (extract_file_data(queue->fd, &node, &queue->dirs, job->dir, filePath, queue->blockThreads) == 0 &&
+            node.stat.st_nlink > 1)
+            job->outPath = strdup(filePath);
+    }
+    return NULL;
+}
+
+static void extract_job_free(ExtractJob *job) {
+    free(job->path);
+    free(job->extra);
+    free(job->outPath);
+}
+
+// Function to extract the batch of a sequential extraction through the ring. The reads
+// of the small data from the archive are submitted together, then the writes of that
+// data, then the closes; larger data is moved as usual in between
+static void extract_batch(ExtractQueue *queue) {
+    size_t count = queue->count;
+    if (count == 0 || queue->ring == NULL)
+        return;     // Nothing batched, or the queue of a parallel extraction
+    ExtractBatch *batch = &queue->batch;
+    UringOp *ops = batch->ops;
+    int *fds = batch->fds;
+    size_t *readOf = batch->readOf;
+    unsigned char *buffer = batch->buffer;
+
+    // Create the files and read the small data. Creating a file makes the ring hand the
+    // open to a kernel worker thread, so the opens stay on the blocking calls
+    size_t numReads = 0, used = 0;
+    char (*paths)[PATH_MAX] = batch->paths;
+    for (size_t i = 0; i < count; i++) {
+        ExtractJob *job = &queue->items[i];
+        fds[i] = output_create(&queue->dirs, job->dir, clean_output_name(entries_name(job->path)), paths[i]);
+        if (fds[i] != -1 && job->small) {
+            readOf[i] = numReads;
+            ops[numReads++] = (UringOp){URING_READ, queue->fd, NULL, 0, 0, buffer + used,
+                                        job->data_size, job->data_offset, -ECANCELED};
+            used += job->data_size;
+        }
     }
+    bool ringFailed = uring_run(queue->ring, ops, numReads) == -1;
+
+    // Write the data, small data through the ring
+    size_t numWrites = 0;
+    for (size_t i = 0; i < count; i++) {
+        ExtractJob *job = &queue->items[i];
+        if (fds[i] == -1)
+            continue;
+        MyzNode node;
+        extract_job_node(job, &node);
+        if (node.stat.st_nlink > 1)
+            remember_link_target(queue->links, &node, paths[i]);
+        if (!job->small) {
+            write_file_data(queue->fd, &node, fds[i], paths[i], compress_default_threads());
+        } else if (ringFailed || ops[readOf[i]].result != (int)job->data_size) {
+            fprintf(stderr, "Failed to extract '%s'\n", paths[i]);
+            job->small = false;
+        } else if (job->data_size > 0) {
+            ops[numReads + numWrites++] = (UringOp){URING_WRITE, fds[i], NULL, 0, 0, ops[readOf[i]].buffer,
+                                                    job->data_size, 0, -ECANCELED};
+        }
+    }
+    ringFailed = ringFailed || uring_run(queue->ring, ops + numReads, numWrites) == -1;
+    for (size_t w = 0; w < numWrites; w++) {
+        UringOp *op = &ops[numReads + w];
+        // Short writes are finished with the blocking calls
+        int written = op->result > 0 ? op->result : 0;
+        if (written < (int)op->length &&
+            pwrite_all(op->fd, (unsigned char *)op->buffer + written, op->length - written, written) == -1)
+            perror("write");
+    }
+
+    // Restore the status of the files and close them
+    size_t numCloses = 0;
+    for (size_t i = 0; i < count; i++) {
+        ExtractJob *job = &queue->items[i];
+        if (fds[i] == -1)
+            continue;
+        output_finish(fds[i], &job->stat);
+        if (job->small)
+            move_count(MOVE_URING, job->data_size);
+        ops[numCloses++] = (UringOp){URING_CLOSE, fds[i], NULL, 0, 0, NULL, 0, 0, -ECANCELED};
+    }
+    if (ringFailed || uring_run(queue->ring, ops, numCloses) == -1) {
+        for (size_t c = 0; c < numCloses; c++) {
+            if (ops[c].result == -ECANCELED)
+                close(ops[c].fd);
+        }
+    }
+
+    for (size_t i = 0; i < count; i++)
+        extract_job_free(&queue->items[i]);
+    queue->count = 0;
+    batch->bytes = 0;
+}
+
+// Function to extract the queued members and free the queue
+static void extract_queue_finish(ExtractQueue *queue, ArchiveReader *reader) {
+    extract_batch(queue);   // The last batch of a sequential extraction
+
+    // Take the files in the order of their data, so that the archive is read mostly sequentially
+    ExtractOrder *sorted = malloc((queue->count > 0 ? queue->count : 1) * sizeof(ExtractOrder));
+    queue->order = malloc((queue->count > 0 ? queue->count : 1) * sizeof(size_t));
+    if (sorted == NULL || queue->order == NULL) {
+        perror("malloc");
+        queue->count = 0;
+    }
+    for (size_t i = 0; i < queue->count; i++) {
+        if (queue->items[i].type != MYZ_NODE_TYPE_HARDLINK)
+            sorted[queue->numFiles++] = (ExtractOrder){queue->items[i].data_offset, i};
+    }
+    qsort(sorted, queue->numFiles, sizeof(ExtractOrder), compare_extract_order);
+    for (size_t i = 0; i < queue->numFiles; i++)
+        queue->order[i] = sorted[i].index;
+    free(sorted);
+
+    // The cores are shared between the files being extracted and the blocks of each file
+    int numThreads = queue->jobs < (int)queue->numFiles ? queue->jobs : (int)queue->numFiles;
+    queue->blockThreads = compress_default_threads() / (numThreads > 0 ? numThreads : 1);
+    if (queue->blockThreads < 1)
+        queue->blockThreads = 1;
+    pthread_t *threads = malloc((numThreads > 0 ? numThreads : 1) * sizeof(pthread_t));
+    int started = 0;
+    for (int i = 0; threads != NULL && i < numThreads; i++) {
+        if (pthread_create(&threads[i], NULL, extract_worker, queue) != 0)
+            break;
+        started++;
+    }
+    if (started == 0)
+        extract_worker(queue);  // No threads: extract in this one
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    // Hard links go to the first extracted path of their file, in archive order
+    for (size_t i = 0; i < queue->count; i++) {
+        ExtractJob *job = &queue->items[i];
+        if (job->type == MYZ_NODE_TYPE_HARDLINK) {
+            MyzNode node;
+            extract_job_node(job, &node);
+            extract_link(reader, &node, &queue->dirs, job->dir, queue->links);
+        } else if (job->outPath != NULL &&
+                   linkmap_find(queue->links, job->stat.st_dev, job->stat.st_ino) == NULL &&
+                   linkmap_insert(queue->links, job->stat.st_dev, job->stat.st_ino, job->outPath) == 0) {
+            job->outPath = NULL;    // Owned by the map
+        }
+        extract_job_free(job);
+    }
+    free(queue->items);
+    free(queue->order);
+    linkmap_destroy(queue->links, free);
+    outdirs_free(&queue->dirs);     // Directory times are restored after their contents
+    extract_batch_free(queue);
+    memset(queue, 0, sizeof(*queue));
+}
+
+// Entry found through the path index for a selective extraction
+typedef struct {
+    uint64_t number;    // Position in the metadata table, the order of extraction
+    uint64_t slot;      // Slot of the entry in the path index
+    int request;        // Requested path the entry was found for
+} IndexedEntry;
+
+static int compare_indexed_entries(const void *a, const void *b) {
+    const IndexedEntry *x = a, *y = b;
+    if (x->number != y->number)
+        return x->number < y->number ? -1 : 1;
+    return x->request - y->request;
+}
+
+// Function to add the entries of a range of index slots to the entries to extract
+static int add_indexed_entries(PathIndex index, uint64_t first, uint64_t last, int request,
+                               IndexedEntry **entries, size_t *count, size_t *capacity) {
+    for (uint64_t slot = first; slot < last; slot++) {
+        if (*count == *capacity) {
+            size_t newCapacity = *capacity ? *capacity * 2 : 64;
+            IndexedEntry *grown = realloc(*entries, newCapacity * sizeof(IndexedEntry));
+            if (grown == NULL)
+                return -1;
+            *entries = grown;
+            *capacity = newCapacity;
+        }
+        IndexedEntry *entry = &(*entries)[*count];
+        if (path_index_number(index, slot, &entry->number) == -1)
+            return -1;
+        entry->slot = slot;
+        entry->request = request;
+        (*count)++;
+    }
+    return 0;
+}
+
+// Directory extracted for a selective extraction through the path index
+typedef struct {
+    int request;        // Requested path the directory was found for
+    char *path;         // Path in the archive
+    int dir;            // Extracted directory
+} IndexedDir;
+
+// Function to push an extracted directory on the stack of those that hold the current entry
+static int push_indexed_dir(IndexedDir **stack, int *depth, int *capacity, int request, const char *path, int dir) {
+    if (*depth == *capacity) {
+        int newCapacity = *capacity ? *capacity * 2 : 16;
+        IndexedDir *grown = realloc(*stack, newCapacity * sizeof(IndexedDir));
+        if (grown == NULL)
+            return -1;
+        *stack = grown;
+        *capacity = newCapacity;
+    }
+    char *copy = strdup(path);
+    if (copy == NULL)
+        return -1;
+    (*stack)[(*depth)++] = (IndexedDir){request, copy, dir};
+    return 0;
+}
+
+// Function to check if a path is inside directory dirPath
+static bool path_is_inside(const char *path, const char *dirPath) {
+    size_t length = strlen(dirPath);
+    return strncmp(path, dirPath, length) == 0 && path[length] == '/';
+}
+
+// Function to add the entries matched by a pattern and the contents of the matched
+// directories. Only the paths that start with the literal prefix of the pattern are
+// tried, and the contents of a matched directory are not tried again
+static int add_matched_entries(PathIndex index, PatternSet patterns, int request,
+                               IndexedEntry **entries, size_t *count, size_t *capacity) {
+    const char *prefix;
+    size_t length;
+    uint64_t first, last, skipFirst = 0, skipLast = 0;
+    pattern_set_prefix(patterns, request, &prefix, &length);
+    if (path_index_prefix(index, prefix, length, &first, &last) == -1)
+        return -1;
+    for (uint64_t slot = first; slot < last; slot++) {
+        if (slot == skipFirst && skipFirst < skipLast) {
+            slot = skipLast - 1;
+            continue;
+        }
+        uint64_t number;
+        const char *slotPath;
+        uint32_t pathLength;
+        char path[MAX_PATH_LEN];
+        if (path_index_slot(index, slot, &number, &slotPath, &pathLength) == -1)
+            return -1;
+        memcpy(path, slotPath, pathLength);
+        path[pathLength] = '\0';
+        if (!pattern_set_matches(patterns, request, path))
+            continue;
+        uint64_t subFirst, subLast;
+        if (add_indexed_entries(index, slot, slot + 1, request, entries, count, capacity) == -1 ||
+            path_index_descendants(index, path, &subFirst, &subLast) == -1 ||
+            add_indexed_entries(index, subFirst, subLast, request, entries, count, capacity) == -1)
+            return -1;
+        if (subFirst < subLast) {
+            skipFirst = subFirst;
+            skipLast = subLast;
+        }
+    }
+    return 0;
+}
+
+// Function to extract the requested paths of an archive through its path index.
+// Only the records of the requested entries and of the contents of requested
+// directories are read. Entries are extracted in archive order, to the same places
+// as extract_entries would: each requested entry under its name in the current
+// directory, and its contents below it
+static void extract_indexed(ArchiveReader *reader, char **fileList, PatternSet patterns, int jobs, int uringDepth,
+                            bool toStdout) {
+    PathIndex index = reader->index;
+    IndexedEntry *entries = NULL;
+    size_t count = 0, capacity = 0;
+    for (int i = 0; fileList[i] != NULL; i++) {
+        const char *prefix;
+        size_t prefixLength;
+        uint64_t first, last, subFirst, subLast;
+        if (pattern_set_prefix(patterns, i, &prefix, &prefixLength) ?
+            add_matched_entries(index, patterns, i, &entries, &count, &capacity) == -1 :
+            (path_index_find(index, fileList[i], &first, &last) == -1 ||
+             path_index_descendants(index, fileList[i], &subFirst, &subLast) == -1 ||
+             add_indexed_entries(index, first, last, i, &entries, &count, &capacity) == -1 ||
+             (first < last && add_indexed_entries(index, subFirst, subLast, i, &entries, &count, &capacity) == -1))) {
+            fprintf(stderr, "Corrupt path index\n");
+            free(entries);
+            return;
+        }
+    }
+    qsort(entries, count, sizeof(IndexedEntry), compare_indexed_entries);
+
+    // An entry selected by several requests is extracted for the first of them
+    size_t unique = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (unique == 0 || entries[unique - 1].number != entries[i].number)
+            entries[unique++] = entries[i];
+    }
+    count = unique;
+
+    ExtractQueue queue;
+    extract_queue_init(&queue, reader->fd, jobs, uringDepth, toStdout);
+    IndexedDir *stack = NULL;   // Extracted directories that hold the current entry
+    int depth = 0, stackCapacity = 0;
+    for (size_t i = 0; i < count; i++) {
+        MyzNode entry;
+        char path[MAX_PATH_LEN];
+        uint64_t number;
+        if (reader_entry(reader, entries[i].slot, &entry, path, &number) == -1) {
+            fprintf(stderr, "Corrupt metadata section\n");
+            break;
+        }
+
+        const char *request = fileList[entries[i].request];
+        const char *prefix;
+        size_t prefixLength;
+        int dir = -1;
+        if (pattern_set_prefix(patterns, entries[i].request, &prefix, &prefixLength)) {
+            // A match of a pattern goes where extracting the whole archive puts it, below
+            // the directory entries it is in. Those that are not extracted yet are created
+            while (depth > 0 && (stack[depth - 1].request != entries[i].request ||
+                                 !path_is_inside(entry.path, stack[depth - 1].path)))
+                free(stack[--depth].path);
+            dir = depth > 0 ? stack[depth - 1].dir : -1;
+            bool failed = false;
+            const char *slash = entry.path + (depth > 0 ? strlen(stack[depth - 1].path) + 1 : 0);
+            while (!failed && (slash = strchr(slash, '/')) != NULL) {
+                char dirPath[MAX_PATH_LEN], nodePath[MAX_PATH_LEN];
+                MyzNode node;
+                uint64_t first, last, dirNumber;
+                snprintf(dirPath, sizeof(dirPath), "%.*s", (int)(slash - entry.path), entry.path);
+                slash++;
+                // The path of a top level entry may hold slashes of its own
+                if (path_index_find(index, dirPath, &first, &last) == -1 || first == last ||
+                    reader_entry(reader, first, &node, nodePath, &dirNumber) == -1)
+                    continue;
+                free(node.extra);
+                if (node.type != MYZ_NODE_TYPE_DIR)
+                    continue;
+                dir = extract_queue_dir(&queue, dir, node.name, &node.stat);
+                failed = dir == -1 || push_indexed_dir(&stack, &depth, &stackCapacity, entries[i].request, dirPath, dir) == -1;
+            }
+            if (failed) {
+                free(entry.extra);
+                continue;
+            }
+        } else if (strchr(entry.path + strlen(request), '/') != NULL) {
+            // The entry goes below the requested entry, which goes in the current directory
+            const char *relative = entry.path + strlen(request);
+            // Contents come right after their directory, whose path is the parent path
+            size_t parentLength = strrchr(entry.path, '/') - entry.path;
+            while (depth > 0 && (stack[depth - 1].request != entries[i].request ||
+                                 strlen(stack[depth - 1].path) != parentLength ||
+                                 strncmp(stack[depth - 1].path, entry.path, parentLength) != 0))
+                free(stack[--depth].path);
+            if (depth > 0) {
+                dir = stack[depth - 1].dir;
+            } else {
+                // Requested paths that overlap interleave: reach the directory through its path
+                const char *requestName = strrchr(request, '/');
+                requestName = requestName != NULL ? requestName + 1 : request;
+                const char *lastSlash = strrchr(relative, '/');
+                char basePath[PATH_MAX];
+                snprintf(basePath, sizeof(basePath), "./%s%.*s", requestName, (int)(lastSlash - relative), relative);
+                dir = toStdout ? EXTRACT_STDOUT_DIR : outdir_add_path(&queue.dirs, basePath);
+            }
+        }
 
-    // Move the file descriptor to the metadata offset
-    if (lseek(fd, header.metadata_offset, SEEK_SET) == -1) {
-        perror("lseek");
-        close(fd);
-        return;
+        if (entry.type == MYZ_NODE_TYPE_DIR) {
+            int newDir = extract_queue_dir(&queue, dir, entry.name, &entry.stat);
+            if (newDir != -1)
+                push_indexed_dir(&stack, &depth, &stackCapacity, entries[i].request, entry.path, newDir);
+        } else {
+            extract_queue_add(&queue, reader, &entry, dir);
+        }
+        free(entry.extra);
     }
 
-    // Read the list of archive entries
-    List list = list_create(NULL);
-    MyzNode entry;
-    while (read(fd, &entry, sizeof(MyzNode)) == sizeof(MyzNode)) {
-        MyzNode *node = malloc(sizeof(MyzNode));
-        memset(node, 0, sizeof(MyzNode)); // Initialize memory to zero
-        *node = entry;
+    while (depth > 0)
+        free(stack[--depth].path);
+    free(stack);
+    free(entries);
+    extract_queue_finish(&queue, reader);
+}
 
-        list_insert_after(list, list_last(list), node);
-    }
+// Function to extract the entries of an archive in one walk over its metadata.
+// Requested entries are extracted into the current directory, matches of patterns
+// at their path and the contents of an extracted directory into it, like a stream
+// archive. The entries inside a directory that holds no match are not matched
+static void extract_entries(ArchiveReader *reader, PatternSet patterns, int jobs, int uringDepth, bool toStdout) {
+    struct {
+        uint64_t number;    // Position of the directory
+        int dir;            // Directory it was extracted to, -1 or EXTRACT_STDOUT_DIR
+        bool contents;      // Everything inside is extracted
+        bool skip;          // Nothing inside is matched
+        struct stat stat;   // Stored status, to create it for a match inside
+        char name[MAX_NAME_LEN];
+    } *dirs = NULL;         // Directories that hold the current entry, outermost first
+    int depth = 0, capacity = 0;
+    ExtractQueue queue;
+    extract_queue_init(&queue, reader->fd, jobs, uringDepth, toStdout);
+
+    ArchiveCursor cursor;
+    reader_begin(reader, &cursor);
+    MyzNode entry;
+    uint64_t parent;
+    int ret;
+    while ((ret = reader_next(&cursor, &entry, &parent)) == 1) {
+        // Leave the directories that the entry is not in. When the members are
+        // extracted right away, the contents of the extracted ones are done
+        while (depth > 0 && dirs[depth - 1].number + 1 != parent) {
+            depth--;
+            if (queue.jobs == 1 && dirs[depth].dir >= 0) {
+                extract_batch(&queue);
+                outdir_close(&queue.dirs, dirs[depth].dir);
+            }
+        }
 
-    // Extract the files and directories
-    ListNode current = list_first(list);
-    while (current != NULL) {
-        MyzNode *current_entry = list_value(current);
+        // Contents of an extracted directory are always extracted into it
+        int dir = -1, request;
         bool extract = true;
-
-        // If a file list is provided, check if the current entry is in the list
-        if (fileList != NULL && fileList[0] != NULL) {
+        if (depth > 0 && dirs[depth - 1].contents) {
+            dir = dirs[depth - 1].dir;
+        } else if (depth > 0 && dirs[depth - 1].skip) {
             extract = false;
-            for (int i = 0; fileList[i] != NULL; i++) {
-                if (strcmp(current_entry->path, fileList[i]) == 0) {
-                    extract = true;
-                    break;
-                }
+        } else if (patterns != NULL) {
+            pattern_match match = pattern_set_match(patterns, entry.path, &request);
+            extract = match != PATTERN_NONE;
+            // A match of a pattern keeps its path: the directories it is in are created first
+            for (int i = 0; match == PATTERN_GLOB && extract && i < depth; i++) {
+                if (dirs[i].dir == -1)
+                    dirs[i].dir = extract_queue_dir(&queue, i > 0 ? dirs[i - 1].dir : -1, dirs[i].name, &dirs[i].stat);
+                extract = dirs[i].dir != -1;
+                dir = dirs[i].dir;
             }
         }
 
-        if (extract) {
-            if (current_entry->type == MYZ_NODE_TYPE_DIR) {
-                extract_directory(fd, list, &current, ".");
-            } else {
-                extract_file(fd, current_entry, ".");
-                current = list_next(current);
+        if (entry.type == MYZ_NODE_TYPE_DIR) {
+            if (depth == capacity) {
+                capacity = capacity ? capacity * 2 : 16;
+                dirs = realloc(dirs, capacity * sizeof(*dirs));
             }
-        } else {
-            current = list_next(current);
+            dirs[depth].number = cursor.number - 1;
+            dirs[depth].dir = extract ? extract_queue_dir(&queue, dir, entry.name, &entry.stat) : -1;
+            // Nothing inside a directory that could not be created is extracted
+            dirs[depth].contents = dirs[depth].dir != -1;
+            dirs[depth].skip = extract ? !dirs[depth].contents
+                                       : (depth > 0 && dirs[depth - 1].skip) || !pattern_set_inside(patterns, entry.path);
+            dirs[depth].stat = entry.stat;
+            snprintf(dirs[depth].name, MAX_NAME_LEN, "%s", entry.name);
+            depth++;
+        } else if (extract) {
+            extract_queue_add(&queue, reader, &entry, dir);
         }
     }
+    if (ret == -1)
+        fprintf(stderr, "Corrupt metadata section\n");
 
-    // Close the archive file
-    close(fd);
-
-    // Free dynamically allocated memory
-    ListNode node = list_first(list);
-    while (node != NULL) {
-        MyzNode *entry = list_value(node);
-        free(entry);
-        node = list_next(node);
-    }
-
-    // Destroy the list
-    list_destroy(list);
+    free(dirs);
+    reader_end(&cursor);
+    extract_queue_finish(&queue, reader);
 }
 
-// Print the metadata of the archive
-void print_metadata(char *archiveFile) {
-    // Open the archive file
-    int fd = open(archiveFile, O_RDONLY);
-    if (fd == -1) {
-        perror("open");
+void extract_archive(char *archiveFile, char **fileList, int jobs, int uringDepth, bool toStdout) {
+    // The requested paths and patterns are compiled once for every entry to match
+    PatternSet patterns = NULL;
+    if (fileList != NULL && fileList[0] != NULL && (patterns = pattern_set_create(fileList)) == NULL) {
+        perror("malloc");
         return;
     }
 
-    // Read the header of the archive
+    // Open the archive file and read its header. A stream archive in a regular file
+    // is read through its trailing metadata when it is extracted on several threads
+    // or through io_uring. Members written to the standard output go one at a time
+    if (toStdout) {
+        jobs = 1;
+        uringDepth = 0;
+    }
+    bool forward = (jobs <= 1 && uringDepth == 0) || strcmp(archiveFile, "-") == 0;
     MyzHeader header;
-    if (read(fd, &header, sizeof(MyzHeader)) != sizeof(MyzHeader)) {
-        perror("read");
-        close(fd);
+    int fd = open_archive(archiveFile, O_RDONLY, &header, forward);
+    if (fd == -1) {
+        pattern_set_destroy(patterns);
         return;
     }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);     // Fails on a pipe, which is read in order anyway
 
-    // Check if the archive file is valid
-    if (strncmp(header.magic, "MYZ", 4) != 0) {
-        fprintf(stderr, "Invalid archive file\n");
+    // Stream archives are otherwise extracted in one forward pass
+    if (archive_is_stream(&header) && forward) {
+        extract_stream(fd, patterns, archive_is_compact(&header), toStdout);
         close(fd);
+        pattern_set_destroy(patterns);
         return;
     }
 
+    // Requested paths are found through the path index, when the archive has one
+    ArchiveReader reader;
+    if (reader_open(&reader, fd, &header) == 0) {
+        if (reader.index != NULL && patterns != NULL)
+            extract_indexed(&reader, fileList, patterns, jobs, uringDepth, toStdout);
+        else
+            extract_entries(&reader, patterns, jobs, uringDepth, toStdout);
+        reader_close(&reader);
+    }
+    pattern_set_destroy(patterns);
+}
+
+// Function to count the contents of every directory whose node does not store the
+// count, which only the entries inside refer to. Returns an array by position, or
+// NULL for version 1 archives, whose entries store the count
+static int *count_dir_contents(ArchiveReader *reader) {
+    if (reader->counted)
+        return NULL;
+    int *counts = calloc(reader->count + 1, sizeof(int));
+    ArchiveCursor cursor;
+    MyzNode entry;
+    uint64_t parent;
+    reader_begin(reader, &cursor);
+    while (counts != NULL && reader_next(&cursor, &entry, &parent) == 1) {
+        if (parent > 0)
+            counts[parent - 1]++;
+    }
+    reader_end(&cursor);
+    return counts;
+}
+
+// Print the metadata of the archive
+void print_metadata(char *archiveFile) {
+    // Open the archive file and map its metadata
+    ArchiveReader reader;
+    if (open_reader(archiveFile, O_RDONLY, &reader) == -1)
+        return;
+    MyzHeader header = reader.header;
+
     // Print the header information
     printf("=== Archive Header ===\n");
-    printf("Magic: %s\n", header.magic);
+    printf("Magic: %.4s\n", header.magic);
     printf("Total bytes: %lu\n", header.total_bytes);
     printf("Metadata offset: %lu\n", header.metadata_offset);
 
-    // Move the file descriptor to the metadata offset
-    if (lseek(fd, header.metadata_offset, SEEK_SET) == -1) {
-        perror("lseek");
-        close(fd);
-        return;
-    }
-
-    // Read and print the list of archive entries
+    // Walk over the archive entries and print them
+    int *counts = count_dir_contents(&reader);
+    ArchiveCursor cursor;
     MyzNode entry;
+    uint64_t parent;
+    int ret;
+    reader_begin(&reader, &cursor);
     printf("\n=== Archive Metadata ===\n");
-    while (read(fd, &entry, sizeof(MyzNode)) == sizeof(MyzNode)) {
+    while ((ret = reader_next(&cursor, &entry, &parent)) == 1) {
+        if (counts != NULL)
+            entry.dirContents = counts[cursor.number - 1];
         printf("Name: %s\n", entry.name);
         printf("Path: %s\n", entry.path);
         printf("Type: %s\n", 
@@ -571,7 +1816,19 @@ void print_metadata(char *archiveFile) {
                entry.type == MYZ_NODE_TYPE_HARDLINK ? "Hardlink" : "Unknown");
         printf("Data offset: %ld\n", entry.data_offset);
         printf("Size: %ld bytes\n", entry.stat.st_size);
+        if (entry.type == MYZ_NODE_TYPE_FILE)
+            printf("Stored size: %ld bytes\n", entry.data_size);
         printf("Compressed: %s\n", entry.compressed ? "Yes" : "No");
+        const MyzBlockIndex *blocks = extra_blocks(&entry);
+        if (blocks != NULL)
+            printf("Compressed blocks: %u of %u bytes\n", blocks->count, blocks->block_size);
+        uint32_t numChunks;
+        if (extra_chunks(&entry, &numChunks) != NULL)
+            printf("Deduplicated chunks: %u\n", numChunks);
+        uint32_t numExtents;
+        const MyzExtent *extents = extra_extents(&entry, &numExtents);
+        if (extents != NULL)
+            printf("Sparse: %u data extents, %ld bytes of data\n", numExtents, (long)sparse_data_size(extents, numExtents));
         if (entry.type == MYZ_NODE_TYPE_DIR)
             printf("Number of directory contents: %d\n", entry.dirContents);
 
@@ -581,154 +1838,104 @@ void print_metadata(char *archiveFile) {
         printf("Access rights: %o\n", entry.stat.st_mode & 0777);
         printf("\n");
     }
+    if (ret == -1)
+        fprintf(stderr, "Corrupt metadata section\n");
 
     // Close the archive file
-    close(fd);
+    reader_end(&cursor);
+    free(counts);
+    reader_close(&reader);
 }
 
-// Function to query an archive file, given the exact file path
-void query_archive(char *archiveFile, char **fileList) {
-    // Open the archive file
-    int fd = open(archiveFile, O_RDONLY);
-    if (fd == -1) {
-        perror("open");
-        return;
+// Function to query an archive through its path index. Like a scan of the entries,
+// the requested path that comes first in the archive is reported
+static void query_path_index(PathIndex index, char **fileList) {
+    const char *found = NULL;
+    uint64_t foundNumber = 0;
+    for (int i = 0; fileList[i] != NULL; i++) {
+        uint64_t first, last, number;
+        if (path_index_find(index, fileList[i], &first, &last) == -1) {
+            fprintf(stderr, "Corrupt path index\n");
+            return;
+        }
+        for (uint64_t slot = first; slot < last; slot++) {
+            if (path_index_number(index, slot, &number) == 0 && (found == NULL || number < foundNumber)) {
+                found = fileList[i];
+                foundNumber = number;
+            }
+        }
     }
 
-    // Read the header of the archive
-    MyzHeader header;
-    if (read(fd, &header, sizeof(MyzHeader)) != sizeof(MyzHeader)) {
-        perror("read");
-        close(fd);
-        return;
-    }
+    // Print a positive or negative answer
+    if (found != NULL)
+        printf("File '%s' found in the archive.\n", found);
+    else
+        printf("File not found in the archive.\n");
+}
 
-    // Check if the archive file is valid
-    if (strncmp(header.magic, "MYZ", 4) != 0) {
-        fprintf(stderr, "Invalid archive file\n");
-        close(fd);
+// Function to query an archive file, given the exact file path
+void query_archive(char *archiveFile, char **fileList) {
+    // Open the archive file and map its metadata
+    ArchiveReader reader;
+    if (open_reader(archiveFile, O_RDONLY, &reader) == -1)
         return;
-    }
 
-    // Move the file descriptor to the metadata offset
-    if (lseek(fd, header.metadata_offset, SEEK_SET) == -1) {
-        perror("lseek");
-        close(fd);
+    // Archives with a path index are answered from it, without walking the entries
+    if (reader.index != NULL) {
+        query_path_index(reader.index, fileList);
+        reader_close(&reader);
         return;
     }
 
-    // Read the list of archive entries
-    List list = list_create(NULL);
+    // Walk over the archive entries until one of them is in the list
+    ArchiveCursor cursor;
     MyzNode entry;
-    while (read(fd, &entry, sizeof(MyzNode)) == sizeof(MyzNode)) {
-        MyzNode *node = malloc(sizeof(MyzNode));
-        memset(node, 0, sizeof(MyzNode)); // Initialize memory to zero
-        *node = entry;
-
-        list_insert_after(list, list_last(list), node);
-    }
-
-    // Query the archive entries
-    ListNode current = list_first(list);
-    while (current != NULL) {
-        MyzNode *current_entry = list_value(current);
-        bool found = false;
-
-        // Check if the current entry is in the list
+    uint64_t parent;
+    bool found = false;
+    reader_begin(&reader, &cursor);
+    while (!found && reader_next(&cursor, &entry, &parent) == 1) {
         for (int i = 0; fileList[i] != NULL; i++) {
-            if (strcmp(current_entry->path, fileList[i]) == 0) {
+            if (strcmp(entry.path, fileList[i]) == 0) {
                 found = true;
                 break;
             }
         }
-
-        // Print a positive or negative answer
-        if (found) {
-            printf("File '%s' found in the archive.\n", current_entry->path);
-            break;
-        } else {
-            current = list_next(current);
-        }
     }
 
-    if (current == NULL) {
+    // Print a positive or negative answer
+    if (found)
+        printf("File '%s' found in the archive.\n", entry.path);
+    else
         printf("File not found in the archive.\n");
-    }
 
     // Close the archive file
-    close(fd);
-
-    // Free dynamically allocated memory
-    ListNode node = list_first(list);
-    while (node != NULL) {
-        MyzNode *entry = list_value(node);
-        free(entry);
-        node = list_next(node);
-    }
-
-    // Destroy the list
-    list_destroy(list);
+    reader_end(&cursor);
+    reader_close(&reader);
 }
 
-// Function to print the hierarchy of the archive
 // Function to print the hierarchy of the archive with proper indentation
 void print_hierarchy(char *archiveFile) {
-    // Open the archive file
-    int fd = open(archiveFile, O_RDONLY);
-    if (fd == -1) {
-        perror("open");
-        return;
-    }
-
-    // Read the header
-    MyzHeader header;
-    if (read(fd, &header, sizeof(MyzHeader)) != sizeof(MyzHeader)) {
-        perror("read");
-        close(fd);
-        return;
-    }
-
-    // Validate archive
-    if (strncmp(header.magic, "MYZ", 4) != 0) {
-        fprintf(stderr, "Invalid archive file\n");
-        close(fd);
-        return;
-    }
-
-    // Read metadata
-    if (lseek(fd, header.metadata_offset, SEEK_SET) == -1) {
-        perror("lseek");
-        close(fd);
+    // Open the archive file and map its metadata
+    ArchiveReader reader;
+    if (open_reader(archiveFile, O_RDONLY, &reader) == -1)
         return;
-    }
-
-    // Load entries into a list
-    List list = list_create(NULL);
-    MyzNode entry;
-    while (read(fd, &entry, sizeof(MyzNode)) == sizeof(MyzNode)) {
-        MyzNode *node = malloc(sizeof(MyzNode));
-        *node = entry;
-        list_insert_after(list, list_last(list), node);
-    }
 
     // Print the hierarchy
     printf("=== Archive Hierarchy ===\n");
-    ListNode current = list_first(list);
-    int depth = 0;
 
-    // Stack to track directory contexts
-    char *parent_dirs[100];  // Adjust size as needed
-    int stack_top = -1;
+    // Stack of the directories that hold the current entry
+    uint64_t *dirs = NULL;
+    int depth = 0, capacity = 0;
 
-    while (current != NULL) {
-        MyzNode *node = list_value(current);
-
-        // Check if we're exiting a directory
-        while (stack_top >= 0 && strncmp(node->path, parent_dirs[stack_top], strlen(parent_dirs[stack_top])) != 0) {
-            // Pop the stack and decrease depth
-            stack_top--;
+    ArchiveCursor cursor;
+    MyzNode entry;
+    uint64_t parent;
+    int ret;
+    reader_begin(&reader, &cursor);
+    while ((ret = reader_next(&cursor, &entry, &parent)) == 1) {
+        // Leave the directories that the entry is not in
+        while (depth > 0 && dirs[depth - 1] + 1 != parent)
             depth--;
-        }
 
         // Print indentation based on depth
         for (int i = 0; i < depth; i++) {
@@ -736,120 +1943,206 @@ void print_hierarchy(char *archiveFile) {
         }
 
         // Print directory or file
-        if (node->type == MYZ_NODE_TYPE_DIR) {
-            printf("├── %s/\n", node->name);
+        if (entry.type == MYZ_NODE_TYPE_DIR) {
+            printf("├── %s/\n", entry.name);
             // Push the current directory to the stack
-            stack_top++;
-            parent_dirs[stack_top] = node->path;
-            depth++;  // Increase depth for children
+            if (depth == capacity) {
+                capacity = capacity ? capacity * 2 : 16;
+                dirs = realloc(dirs, capacity * sizeof(uint64_t));
+            }
+            dirs[depth++] = cursor.number - 1;
         } else {
-            printf("├── %s\n", node->name);
+            printf("├── %s\n", entry.name);
         }
-
-        // Move to next node
-        current = list_next(current);
     }
+    if (ret == -1)
+        fprintf(stderr, "Corrupt metadata section\n");
 
     // Cleanup
-    close(fd);
-    ListNode node = list_first(list);
-    while (node != NULL) {
-        free(list_value(node));
-        node = list_next(node);
-    }
-    list_destroy(list);
+    free(dirs);
+    reader_end(&cursor);
+    reader_close(&reader);
 }
 
-// Function to check if a path exists in the archive
-bool path_exists_in_archive(List list, const char *path) {
-    ListNode node = list_first(list);
-    while (node != NULL) {
-        MyzNode *entry = list_value(node);
-        if (strcmp(entry->path, path) == 0) {
-            return true;
-        }
-        node = list_next(node);
+// Function to check the data of every member of an archive against its checksum,
+// without extracting anything. Returns 0 if the archive is intact
+int test_archive(char *archiveFile) {
+    ArchiveReader reader;
+    if (open_reader(archiveFile, O_RDONLY, &reader) == -1)
+        return -1;
+
+    // The members are checked from a table, so that the threads can take any of them
+    EntryTable entries;
+    if (load_entries(&reader, &entries) == -1) {
+        entries_free(&entries);
+        reader_close(&reader);
+        return -1;
     }
-    return false;
+
+    VerifyReport report;
+    int ret = verify_entries(reader.fd, &entries, compress_default_threads(), &report);
+    verify_report(&report, stdout);
+    // Members without a checksum pass only because nothing could be checked
+    if (report.unchecked > 0)
+        fprintf(stderr, "Warning: %lu of %lu members have no checksum and were not verified\n",
+                (unsigned long)report.unchecked, (unsigned long)report.members);
+
+    entries_free(&entries);
+    reader_close(&reader);
+    return ret;
 }
 
-// Function to filter paths, keeping the most generic path
-void filter_paths_append(List list, char **fileList) {
+// Function to check if a path exists in the archive and was not removed
+bool path_exists_in_archive(const EntryTable *entries, const EntryTree *tree, const bool *removed, const char *path) {
+    size_t index = entries_tree_find(entries, tree, path);
+    return index != ENTRY_NONE && !removed[index];
+}
+
+// Function to filter paths, keeping the most generic path: the archive entries of
+// each path that is added again are marked in removed
+void filter_paths_append(EntryTable *entries, const EntryTree *tree, bool *removed, char **fileList) {
     for (int i = 0; fileList[i] != NULL; i++) {
-        ListNode node = list_first(list);
-        ListNode prev = NULL;
-        while (node != NULL) {
-            MyzNode *entry = list_value(node);
-            if (strncmp(entry->path, fileList[i], strlen(fileList[i])) == 0) {
-                node = list_next(node);
-                list_remove_after(list, prev);
-                free(entry);
-            } else {
-                prev = node;
-                node = list_next(node);
-            }
+        // The entry of the path and everything in it
+        size_t index = entries_tree_find(entries, tree, fileList[i]);
+        if (index != ENTRY_NONE)
+            entries_tree_remove(entries, tree, index, removed);
+
+        // Top level entries that were added from inside the path before
+        size_t length = strlen(fileList[i]);
+        for (index = 0; index < tree->count; index += tree->links[index].size) {
+            const char *path = entries->entries[index].path;
+            if (strncmp(path, fileList[i], length) == 0 && path[length] == '/')
+                entries_tree_remove(entries, tree, index, removed);
         }
     }
 }
 
-// Function to append files and directories to an existing archive
-void append_archive(char *archiveFile, char **fileList, bool gzip) {
-    // Open the archive file
-    int fd = open(archiveFile, O_RDWR);
-    if (fd == -1) {
-        perror("open");
-        return;
+// Function to check if the data of any entry of the table is deduplicated
+static bool entries_use_dedup(const EntryTable *entries) {
+    uint32_t numChunks;
+    for (size_t i = 0; i < entries->count; i++) {
+        if (extra_chunks(&entries->entries[i], &numChunks) != NULL)
+            return true;
     }
+    return false;
+}
 
-    // Read the header of the archive
-    MyzHeader header;
-    if (read(fd, &header, sizeof(MyzHeader)) != sizeof(MyzHeader)) {
-        perror("read");
-        close(fd);
-        return;
+// Function to check if the raw data of an archive is block aligned: every raw file
+// with data starts at a multiple of the smallest block size
+static bool entries_use_alignment(const EntryTable *entries) {
+    bool raw = false;
+    uint32_t count;
+    for (size_t i = 0; i < entries->count; i++) {
+        const MyzNode *entry = &entries->entries[i];
+        if (entry->type != MYZ_NODE_TYPE_FILE || entry->compressed || entry->data_size == 0 ||
+            extra_chunks(entry, &count) != NULL)
+            continue;
+        if (entry->data_offset % 512 != 0)
+            return false;
+        raw = true;
     }
+    return raw;
+}
 
-    // Check if the archive file is valid
-    if (strncmp(header.magic, "MYZ", 4) != 0) {
-        fprintf(stderr, "Invalid archive file\n");
-        close(fd);
+// Function to hand the data of removed files with several links to a remaining hard
+// link of the first count entries, which becomes the file. Without it, the links
+// to a removed file would have no data once the data is no longer written again
+static void keep_removed_link_data(EntryTable *entries, size_t count, const bool *removed) {
+    LinkMap links = linkmap_create();   // First remaining hard link of each file
+    if (links == NULL)
         return;
+    for (size_t i = 0; i < count; i++) {
+        MyzNode *entry = &entries->entries[i];
+        if (!removed[i] && entry->type == MYZ_NODE_TYPE_HARDLINK &&
+            linkmap_find(links, entry->stat.st_dev, entry->stat.st_ino) == NULL)
+            linkmap_insert(links, entry->stat.st_dev, entry->stat.st_ino, entry);
+    }
+    for (size_t i = 0; i < count; i++) {
+        MyzNode *file = &entries->entries[i];
+        if (!removed[i] || file->type != MYZ_NODE_TYPE_FILE || file->stat.st_nlink < 2)
+            continue;
+        MyzNode *link = linkmap_find(links, file->stat.st_dev, file->stat.st_ino);
+        if (link == NULL || entries_set_extra(entries, link, file->extra, file->extra_size) == -1)
+            continue;
+        link->type = MYZ_NODE_TYPE_FILE;
+        link->data_offset = file->data_offset;
+        link->data_size = file->data_size;
+        link->compressed = file->compressed;
     }
+    linkmap_destroy(links, NULL);
+}
 
-    // Move the file descriptor to the metadata offset
-    if (lseek(fd, header.metadata_offset, SEEK_SET) == -1) {
-        perror("lseek");
-        close(fd);
-        return;
+// Function to check if the raw data of the first count entries of an archive was
+// checksummed: every raw file with data has a checksum
+static bool entries_use_checksums(const EntryTable *entries, size_t count) {
+    bool raw = false;
+    uint32_t chunks;
+    for (size_t i = 0; i < count; i++) {
+        const MyzNode *entry = &entries->entries[i];
+        if (entry->type != MYZ_NODE_TYPE_FILE || entry->compressed || entry->data_size == 0 ||
+            extra_chunks(entry, &chunks) != NULL)
+            continue;
+        if (extra_checksum(entry) == NULL)
+            return false;
+        raw = true;
     }
+    return raw;
+}
 
-    // Read the list of archive entries
-    List list = list_create(NULL);
-    MyzNode entry;
-    while (read(fd, &entry, sizeof(MyzNode)) == sizeof(MyzNode)) {
-        MyzNode *node = malloc(sizeof(MyzNode));
-        memset(node, 0, sizeof(MyzNode)); // Initialize memory to zero
-        *node = entry;
+static int vacuum_write(int fd, EntryTable *entries, const char *archiveFile, char *tempPath, MyzHeader *header);
+static int replace_archive(int out, const char *tempPath, const char *archiveFile);
+
+// Function to append files and directories to an existing archive. Returns -1 if
+// nothing was appended
+int append_archive(char *archiveFile, char **fileList, bool gzip, bool dedup, bool align, bool checksum, int uringDepth) {
+    // Open the archive file and map its metadata
+    ArchiveReader reader;
+    if (open_reader(archiveFile, O_RDWR, &reader) == -1)
+        return -1;
 
-        list_insert_after(list, list_last(list), node);
+    // Copy the archive entries into a table. The archive is written below, so the
+    // mapping is released first, but a stream archive stays open for its data.
+    // Entries that could not be read would be lost when the metadata is written
+    // again, so nothing is appended to such an archive
+    MyzHeader header = reader.header;
+    EntryTable entries;
+    int loaded = load_entries(&reader, &entries);
+    int fd = loaded == 0 && archive_is_stream(&header) ? dup(reader.fd) : -1;
+    reader_close(&reader);
+    if (loaded == -1 || (fd == -1 && archive_is_stream(&header))) {
+        if (loaded == 0)
+            perror("dup");
+        else
+            fprintf(stderr, "Cannot append to '%s': its metadata could not be read\n", archiveFile);
+        entries_free(&entries);
+        return -1;
     }
+    int status = -1;
 
-    // Filter paths to remove specific files if their parent directory is added
-    filter_paths_append(list, fileList);
+    // Index the tree of the archive entries once, for the lookups of every path
+    EntryTree tree;
+    bool *removed = calloc(entries.count > 0 ? entries.count : 1, sizeof(bool));
+    if (removed == NULL || entries_tree_build(&entries, &tree) == -1) {
+        free(removed);
+        entries_free(&entries);
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
 
-    uint64_t totalDataBytes = 0;    // Total number of data bytes in the archive
+    // Filter paths to remove specific files if their parent directory is added
+    filter_paths_append(&entries, &tree, removed, fileList);
 
     // Process each file and directory in the list
     for (int i = 0; fileList[i] != NULL; i++) {
         struct stat st; // File information
         if (lstat(fileList[i], &st) == -1) {
             perror("lstat");
-            list_destroy(list);
-            return;
+            goto done;
         }
 
         // Check if the path already exists in the archive
-        if (path_exists_in_archive(list, fileList[i])) {
+        if (path_exists_in_archive(&entries, &tree, removed, fileList[i])) {
             printf("Path '%s' already exists in the archive.\n", fileList[i]);
             continue;
         }
@@ -859,172 +2152,394 @@ void append_archive(char *archiveFile, char **fileList, bool gzip) {
             DIR *dir = opendir(fileList[i]);
             if (dir == NULL) {
                 perror("opendir");
-                list_destroy(list);
-                return;
+                goto done;
             }
             closedir(dir);
         }
 
-        // Initialize the node for the file or directory
-        MyzNode *node = malloc(sizeof(MyzNode));
-        memset(node, 0, sizeof(MyzNode)); // Initialize memory to zero
+        // Add a zeroed node for the file or directory to the table
+        MyzNode *node = entries_add(&entries);
+        if (node == NULL)
+            goto done;
         node->stat = st;    // Copy the file information
-        
-        // Get the name of the file or directory
-        char *lastPart = strrchr(fileList[i], '/');
-        if (lastPart == NULL) { // No directory part
-            strncpy(node->name, fileList[i], MAX_NAME_LEN - 1);
-            node->name[MAX_NAME_LEN - 1] = '\0';
-        } else {    // Directory part exists
-            strncpy(node->name, lastPart + 1, MAX_NAME_LEN - 1);
-            node->name[MAX_NAME_LEN - 1] = '\0';
-        }
-        strncpy(node->path, fileList[i], MAX_PATH_LEN - 1); // Copy the path
-        node->path[MAX_PATH_LEN - 1] = '\0';
+
+        // Copy the path to the arena, the name is its last part
+        if (entries_set_path(&entries, node, fileList[i]) == -1)
+            goto done;
         node->type = S_ISDIR(st.st_mode) ? MYZ_NODE_TYPE_DIR : MYZ_NODE_TYPE_FILE;  // Set the type
         node->data_offset = 0;    // This will be set later
         node->dirContents = (node->type == MYZ_NODE_TYPE_DIR) ? 0 : -1; // Set the number of directory contents
+        node->compressed = gzip && node->type == MYZ_NODE_TYPE_FILE;
 
-        // Add the file size to the total bytes
-        if (node->type == MYZ_NODE_TYPE_FILE)
-            totalDataBytes += node->stat.st_size;
-
-        // Add the node to the list
-        list_insert_after(list, list_last(list), node);
+        // Process the directory recursively. The walk adds entries, so the node is found again by position
+        if (node->type == MYZ_NODE_TYPE_DIR) {
+            size_t index = entries.count - 1;
+            int dirContents = processDirectory(fileList[i], &entries, gzip);
+            if (dirContents == -1)
+                goto done;
+            entries.entries[index].dirContents = dirContents;
+        }
+    }
 
-        // Process the directory recursively
-        if (node->type == MYZ_NODE_TYPE_DIR)
-            node->dirContents = processDirectory(fileList[i], list, gzip, &totalDataBytes);
+    // Drop the filtered archive entries. The new entries follow them and are all kept
+    bool *keep = realloc(removed, (entries.count > 0 ? entries.count : 1) * sizeof(bool));
+    if (keep == NULL)
+        goto done;
+    removed = keep;
+    memset(removed + tree.count, 0, (entries.count - tree.count) * sizeof(bool));
+    size_t kept = tree.count;
+    for (size_t i = 0; i < tree.count; i++)
+        kept -= removed[i];
+    keep_removed_link_data(&entries, tree.count, removed);
+    entries_compact(&entries, removed);
+
+    // The data of the remaining archive entries stays where it is: only the new data
+    // and the metadata are written, after the end of the archive. Stream archives
+    // interleave their entries with the data, so their entries are first copied with
+    // their data to a new archive, which is appended to and then replaces them. An
+    // archive that was deduplicated, aligned or checksummed whole stays so
+    checksum = checksum || entries_use_checksums(&entries, kept);
+    dedup = dedup || entries_use_dedup(&entries);
+    align = align || entries_use_alignment(&entries);
+    if (fd != -1) {
+        char tempPath[PATH_MAX];
+        EntryTable old = entries;
+        old.count = kept;
+        int out = vacuum_write(fd, &old, archiveFile, tempPath, &header);
+        if (out == -1)
+            goto done;
+        close(out);
+        out = transferEntriesToFile(header, &entries, kept, tempPath, dedup, align, checksum, uringDepth);
+        if (out == -1)
+            unlink(tempPath);
+        else
+            status = replace_archive(out, tempPath, archiveFile);
+    } else {
+        int new_fd = transferEntriesToFile(header, &entries, kept, archiveFile, dedup, align, checksum, uringDepth);
+        if (new_fd != -1) {
+            close(new_fd);
+            status = 0;
+        }
     }
 
-    // Update the header of the archive
-    header.total_bytes += sizeof(MyzNode) * list_size(list) + totalDataBytes;
-    header.metadata_offset += totalDataBytes;
+done:
+    // Free the table and its index
+    entries_tree_free(&tree);
+    free(removed);
+    entries_free(&entries);
+    if (fd != -1)
+        close(fd);
+    return status;
+}
 
-    // Transfer the list to the archive file
-    int new_fd = transferListToFile(header, list, archiveFile);
-    if (new_fd == -1) {
-        list_destroy(list);
-        return;
-    }
+// Stored data of an archive that entries refer to: the data of a file, or a chunk
+// shared by the files that were deduplicated
+typedef struct {
+    off_t offset;
+    off_t size;
+    bool raw;           // Raw data of a file, aligned in an aligned archive
+    off_t newOffset;    // Offset in the vacuumed archive
+} DataRange;
+
+static int compare_data_ranges(const void *a, const void *b) {
+    const DataRange *x = a, *y = b;
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
 
-    // Close the archive file
-    close(new_fd);
-    
-    // Destroy the list
-    list_destroy(list);
+// Function to collect the data ranges that the entries of a table refer to, by
+// offset, each once. Returns their number or -1
+static ssize_t collect_data_ranges(const EntryTable *entries, DataRange **ranges) {
+    size_t count = 0, capacity = 0;
+    *ranges = NULL;
+    for (size_t i = 0; i < entries->count; i++) {
+        const MyzNode *entry = &entries->entries[i];
+        if (entry->type != MYZ_NODE_TYPE_FILE)
+            continue;
+        uint32_t numChunks;
+        const MyzChunk *chunks = extra_chunks(entry, &numChunks);
+        size_t needed = count + (chunks != NULL ? numChunks : 1);
+        if (needed > capacity) {
+            capacity = needed > capacity * 2 ? needed : capacity * 2;
+            DataRange *grown = realloc(*ranges, capacity * sizeof(DataRange));
+            if (grown == NULL) {
+                perror("realloc");
+                free(*ranges);
+                *ranges = NULL;
+                return -1;
+            }
+            *ranges = grown;
+        }
+        for (uint32_t c = 0; chunks != NULL && c < numChunks; c++)
+            (*ranges)[count++] = (DataRange){chunks[c].offset, chunks[c].stored_size, false, 0};
+        if (chunks == NULL && entry->data_size > 0)
+            (*ranges)[count++] = (DataRange){entry->data_offset, entry->data_size, !entry->compressed, 0};
+    }
+    if (count > 1)
+        qsort(*ranges, count, sizeof(DataRange), compare_data_ranges);
+
+    // Chunks are shared, and a file may hold the data of a removed one
+    size_t unique = 0;
+    for (size_t i = 0; i < count; i++) {
+        DataRange *last = unique > 0 ? &(*ranges)[unique - 1] : NULL;
+        if (last != NULL && last->offset == (*ranges)[i].offset) {
+            if (last->size < (*ranges)[i].size)
+                last->size = (*ranges)[i].size;
+            last->raw |= (*ranges)[i].raw;
+        } else {
+            (*ranges)[unique++] = (*ranges)[i];
+        }
+    }
+    return unique;
 }
 
-// Function to delete files and directories from an existing archive
-void delete_archive(char *archiveFile, char **fileList) {
-    // Open the archive file
-    int fd = open(archiveFile, O_RDWR);
-    if (fd == -1) {
-        perror("open");
-        return;
+// Function to give back to the filesystem the parts of the data region of an archive,
+// from the header to end, that no range refers to. Returns the bytes punched out
+static off_t punch_unused_data(int fd, const DataRange *ranges, size_t count, off_t end) {
+    off_t used = sizeof(MyzHeader), punched = 0;
+    for (size_t i = 0; i <= count; i++) {
+        off_t next = i < count ? ranges[i].offset : end;
+        if (next > used) {
+            // Filesystems zero the partial blocks at the edges and free the whole ones
+            if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, used, next - used) == -1) {
+                perror("fallocate");
+                break;
+            }
+            punched += next - used;
+        }
+        if (i < count && ranges[i].offset + ranges[i].size > used)
+            used = ranges[i].offset + ranges[i].size;
     }
+    return punched;
+}
 
-    // Read the header of the archive
-    MyzHeader header;
-    if (read(fd, &header, sizeof(MyzHeader)) != sizeof(MyzHeader)) {
-        perror("read");
-        close(fd);
-        return;
+// Function to get the offset in the vacuumed archive of data at offset in the old one:
+// that of the first range that starts there or after it
+static off_t vacuum_offset(const DataRange *ranges, size_t count, off_t offset, off_t dataEnd) {
+    size_t low = 0, high = count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (ranges[mid].offset < offset)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low < count ? ranges[low].newOffset : dataEnd;
+}
+
+// Function to write the entries of a table to a new archive next to archiveFile, whose
+// path goes to tempPath, a buffer of PATH_MAX bytes, and whose header goes to *header.
+// The data they refer to is copied from the archive in fd, each range once and in the
+// order of the archive, with copy_file_range or clones, so nothing is read from the
+// original files. The data of an aligned archive stays aligned. Returns the new
+// archive, or -1 after removing it
+static int vacuum_write(int fd, EntryTable *entries, const char *archiveFile, char *tempPath, MyzHeader *header) {
+    DataRange *ranges;
+    ssize_t count = collect_data_ranges(entries, &ranges);
+    if (count == -1)
+        return -1;
+
+    // The new archive is written next to the old one, so that it can be renamed over it
+    struct stat st;
+    if (snprintf(tempPath, PATH_MAX, "%s.XXXXXX", archiveFile) >= PATH_MAX) {
+        fprintf(stderr, "Path too long: %s\n", archiveFile);
+        free(ranges);
+        return -1;
     }
+    int out = mkstemp(tempPath);
+    if (out == -1) {
+        perror("mkstemp");
+        free(ranges);
+        return -1;
+    }
+    if (fstat(fd, &st) == 0)
+        fchmod(out, st.st_mode & 07777);
 
-    // Check if the archive file is valid
-    if (strncmp(header.magic, "MYZ", 4) != 0) {
-        fprintf(stderr, "Invalid archive file\n");
-        close(fd);
-        return;
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, MYZ_MAGIC_V2, sizeof(header->magic));
+    off_t dataEnd = sizeof(MyzHeader);
+    off_t blockSize = entries_use_alignment(entries) ? move_block_size(out) : 1;
+    if (write_all(out, header, sizeof(MyzHeader)) == -1) {
+        perror("write");
+        goto fail;
+    }
+    for (ssize_t i = 0; i < count; i++) {
+        if (align_data(out, ranges[i].raw ? blockSize : 1, &dataEnd, ranges[i].size) == -1 ||
+            move_data(fd, ranges[i].offset, out, ranges[i].size) == -1)
+            goto fail;
+        ranges[i].newOffset = dataEnd;
+        dataEnd += ranges[i].size;
     }
 
-    // Move the file descriptor to the metadata offset
-    if (lseek(fd, header.metadata_offset, SEEK_SET) == -1) {
-        perror("lseek");
-        close(fd);
-        return;
+    // Move the entries to their data in the new archive
+    for (size_t i = 0; i < entries->count; i++) {
+        MyzNode *entry = &entries->entries[i];
+        if (entry->type != MYZ_NODE_TYPE_FILE)
+            continue;
+        uint32_t numChunks;
+        const MyzChunk *chunks = extra_chunks(entry, &numChunks);
+        if (chunks != NULL) {
+            MyzChunk *moved = malloc(numChunks * sizeof(MyzChunk));
+            if (moved == NULL) {
+                perror("malloc");
+                goto fail;
+            }
+            for (uint32_t c = 0; c < numChunks; c++) {
+                moved[c] = chunks[c];
+                moved[c].offset = vacuum_offset(ranges, count, chunks[c].offset, dataEnd);
+            }
+            extra_remove(entry, MYZ_EXTRA_CHUNKS);
+            int ret = extra_add(entry, MYZ_EXTRA_CHUNKS, moved, numChunks * sizeof(MyzChunk));
+            free(moved);
+            if (ret == -1)
+                goto fail;
+        }
+        entry->data_offset = vacuum_offset(ranges, count, entry->data_offset, dataEnd);
     }
 
-    // Read the list of archive entries
-    List list = list_create(NULL);
-    MyzNode entry;
-    while (read(fd, &entry, sizeof(MyzNode)) == sizeof(MyzNode)) {
-        MyzNode *node = malloc(sizeof(MyzNode));
-        memset(node, 0, sizeof(MyzNode)); // Initialize memory to zero
-        *node = entry;
+    if (write_metadata(out, header, entries, dataEnd, false) == -1)
+        goto fail;
+    free(ranges);
+    return out;
+
+fail:
+    close(out);
+    unlink(tempPath);
+    free(ranges);
+    return -1;
+}
 
-        list_insert_after(list, list_last(list), node);
+// Function to put a complete new archive in place of archiveFile. Returns -1 after
+// removing it if it could not be made durable or renamed
+static int replace_archive(int out, const char *tempPath, const char *archiveFile) {
+    if (fsync(out) == -1) {
+        perror("fsync");
+        close(out);
+        unlink(tempPath);
+        return -1;
     }
+    close(out);
+    if (rename(tempPath, archiveFile) == -1) {
+        perror("rename");
+        unlink(tempPath);
+        return -1;
+    }
+    return 0;
+}
 
-    // Remove the specified files and directories from the list
-    for (int i = 0; fileList[i] != NULL; i++) {
-        ListNode node = list_first(list);
-        ListNode prev = NULL;
-        while (node != NULL) {
-            MyzNode *entry = list_value(node);
-            if (strcmp(entry->path, fileList[i]) == 0) {
-                // Update the parent directory's dirContents
-                ListNode parentNode = list_first(list);
-                while (parentNode != NULL) {
-                    MyzNode *parentEntry = list_value(parentNode);
-                    if (parentEntry->type == MYZ_NODE_TYPE_DIR && 
-                        strncmp(entry->path, parentEntry->path, strlen(parentEntry->path)) == 0) {
-                        parentEntry->dirContents--;
-                        break;
-                    }
-                    parentNode = list_next(parentNode);
-                }
+// Function to write the entries of a table to a new archive that replaces archiveFile
+// once it is complete, with their data copied from the archive in fd
+static int vacuum_entries(int fd, EntryTable *entries, const char *archiveFile) {
+    char tempPath[PATH_MAX];
+    MyzHeader header;
+    int out = vacuum_write(fd, entries, archiveFile, tempPath, &header);
+    return out == -1 ? -1 : replace_archive(out, tempPath, archiveFile);
+}
 
-                // If the entry is a directory, remove its contents
-                if (entry->type == MYZ_NODE_TYPE_DIR) {
-                    ListNode childNode = list_next(node);
-                    while (childNode != NULL) {
-                        MyzNode *childEntry = list_value(childNode);
-                        if (strncmp(childEntry->path, entry->path, strlen(entry->path)) == 0) {
-                            ListNode nextChildNode = list_next(childNode);
-                            list_remove_after(list, node);
-                            free(childEntry);
-                            childNode = nextChildNode;
-                        } else {
-                            break;
-                        }
-                    }
-                }
+// Function to delete files and directories from an existing archive. The data of the
+// entries is left where it is, and only the metadata is written again, after the old
+// one; with punchHoles, the data no entry refers to any more and the old metadata are
+// punched out of the file.
+// Stream archives, whose entries are interleaved with their data, are vacuumed instead.
+// Returns -1 if the archive was not updated
+int delete_archive(char *archiveFile, char **fileList, bool punchHoles) {
+    // Open the archive file and map its metadata
+    ArchiveReader reader;
+    if (open_reader(archiveFile, O_RDWR, &reader) == -1)
+        return -1;
 
-                node = list_next(node);
-                list_remove_after(list, prev);
-                free(entry);
-            } else {
-                prev = node;
-                node = list_next(node);
-            }
-        }
+    // Copy the archive entries into a table. The mapping is released before the
+    // metadata is written, but the archive stays open for a vacuum
+    MyzHeader header = reader.header;
+    EntryTable entries;
+    int loaded = load_entries(&reader, &entries);
+    int fd = loaded == 0 ? dup(reader.fd) : -1;
+    reader_close(&reader);
+    if (fd == -1) {
+        if (loaded == 0)
+            perror("dup");
+        else
+            fprintf(stderr, "Cannot delete from '%s': its metadata could not be read\n", archiveFile);
+        entries_free(&entries);
+        return -1;
     }
 
-    // Update the header of the archive
-    uint64_t totalDataBytes = 0;
-    ListNode node = list_first(list);
-    while (node != NULL) {
-        MyzNode *entry = list_value(node);
-        if (entry->type == MYZ_NODE_TYPE_FILE) {
-            totalDataBytes += entry->stat.st_size;
+    // Index the tree of the entries once: each path is found by following its
+    // directories, and removing it marks its subtree and updates its directory
+    EntryTree tree;
+    bool *removed = calloc(entries.count > 0 ? entries.count : 1, sizeof(bool));
+    if (removed == NULL || entries_tree_build(&entries, &tree) == -1) {
+        free(removed);
+        entries_free(&entries);
+        close(fd);
+        return -1;
+    }
+    for (int i = 0; fileList[i] != NULL; i++) {
+        size_t index = entries_tree_find(&entries, &tree, fileList[i]);
+        if (index != ENTRY_NONE)
+            entries_tree_remove(&entries, &tree, index, removed);
+    }
+
+    // Remove the marked entries in one pass, keeping the data of their hard links
+    keep_removed_link_data(&entries, entries.count, removed);
+    entries_compact(&entries, removed);
+    entries_tree_free(&tree);
+    free(removed);
+
+    int status = 0;
+    if (archive_is_stream(&header)) {
+        status = vacuum_entries(fd, &entries, archiveFile);
+    } else {
+        // Write the updated table after the old one. Every entry is kept as it is
+        int new_fd = transferEntriesToFile(header, &entries, entries.count, archiveFile, false, false, false, 0);
+        if (new_fd == -1)
+            status = -1;
+        if (new_fd != -1 && punchHoles) {
+            // With no entry left, all the old data is unused
+            DataRange *ranges;
+            ssize_t count = collect_data_ranges(&entries, &ranges);
+            if (count != -1) {
+                off_t punched = punch_unused_data(new_fd, ranges, count, header.total_bytes);
+                printf("Punched %ld bytes of unused data\n", (long)punched);
+                free(ranges);
+            }
         }
-        node = list_next(node);
+        if (new_fd != -1)
+            close(new_fd);
     }
-    header.total_bytes = sizeof(MyzHeader) + sizeof(MyzNode) * list_size(list) + totalDataBytes;
-    header.metadata_offset = sizeof(MyzHeader) + totalDataBytes;
 
-    // Transfer the updated list to the archive file
-    int new_fd = transferListToFile(header, list, archiveFile);
-    if (new_fd == -1) {
-        list_destroy(list);
-        return;
-    }
+    close(fd);
+    entries_free(&entries);
+    return status;
+}
 
-    // Close the archive file
-    close(new_fd);
+// Function to compact an archive: its entries are written to a new archive with only
+// the data they refer to, which replaces it. Data left by deleted and replaced
+// entries and by earlier metadata sections is dropped. Returns -1 if it was not replaced
+int vacuum_archive(char *archiveFile) {
+    ArchiveReader reader;
+    if (open_reader(archiveFile, O_RDONLY, &reader) == -1)
+        return -1;
+    EntryTable entries;
+    int loaded = load_entries(&reader, &entries);
+    off_t before = lseek(reader.fd, 0, SEEK_END);
+    int fd = loaded == 0 ? dup(reader.fd) : -1;
+    reader_close(&reader);
+    if (fd == -1) {
+        if (loaded == 0)
+            perror("dup");
+        else
+            fprintf(stderr, "Cannot vacuum '%s': its metadata could not be read\n", archiveFile);
+        entries_free(&entries);
+        return -1;
+    }
 
-    // Destroy the list
-    list_destroy(list);
-}
\ No newline at end of file
+    int status = vacuum_entries(fd, &entries, archiveFile);
+    if (status == 0) {
+        struct stat st;
+        if (stat(archiveFile, &st) == 0)
+            printf("Vacuumed '%s': %ld bytes, was %ld bytes\n", archiveFile, (long)st.st_size, (long)before);
+    }
+    close(fd);
+    entries_free(&entries);
+    return status;
+}
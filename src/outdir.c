@@ -0,0 +1,192 @@
+#include "outdir.h"
+
+void outdirs_init(OutDirs *dirs) {
+    memset(dirs, 0, sizeof(*dirs));
+}
+
+// Function to add a directory to the table. Returns its number or -1
+static int outdir_add(OutDirs *dirs, char *path, int fd, const struct stat *st, bool restore) {
+    if (dirs->count == dirs->capacity) {
+        size_t capacity = dirs->capacity ? dirs->capacity * 2 : 64;
+        OutDir *grown = realloc(dirs->dirs, capacity * sizeof(OutDir));
+        if (grown == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        dirs->dirs = grown;
+        dirs->capacity = capacity;
+    }
+    OutDir *outDir = &dirs->dirs[dirs->count];
+    outDir->path = path;
+    outDir->fd = fd;
+    if (st != NULL)
+        outDir->stat = *st;
+    outDir->restore = restore;
+    if (fd != -1)
+        dirs->open++;
+    return dirs->count++;
+}
+
+// Function to join a name to the path of a directory
+static int outdir_join(const OutDirs *dirs, int dir, const char *name, char *path) {
+    int n = dir < 0 ? snprintf(path, PATH_MAX, "%s", name)
+                    : snprintf(path, PATH_MAX, "%s/%s", dirs->dirs[dir].path, name);
+    return n < PATH_MAX ? 0 : -1;
+}
+
+int outdir_at(const OutDirs *dirs, int dir, const char *name, char *buffer, const char **atName) {
+    if (dir < 0 || dirs->dirs[dir].fd != -1) {
+        *atName = name;
+        return dir < 0 ? AT_FDCWD : dirs->dirs[dir].fd;
+    }
+    *atName = buffer;
+    return outdir_join(dirs, dir, name, buffer) == 0 ? AT_FDCWD : -1;
+}
+
+int outdir_create(OutDirs *dirs, int dir, const char *name, const struct stat *st) {
+    char path[PATH_MAX], buffer[PATH_MAX];
+    const char *atName;
+    int dirFd = outdir_at(dirs, dir, name, buffer, &atName);
+    if (dirFd == -1 || outdir_join(dirs, dir, name, path) == -1) {
+        fprintf(stderr, "Path too long: %s\n", name);
+        return -1;
+    }
+
+    // The contents go in before the stored mode is restored, which may not allow it
+    bool created = mkdirat(dirFd, atName, (st->st_mode & 07777) | S_IRWXU) == 0;
+    if (!created && errno != EEXIST) {
+        perror("mkdir");
+        return -1;
+    }
+    int fd = -1;
+    if (dirs->open < OUTDIR_MAX_OPEN) {
+        fd = openat(dirFd, atName, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd == -1) {
+            perror("open");
+            return -1;
+        }
+    }
+    char *copy = strdup(path);
+    int number = copy != NULL ? outdir_add(dirs, copy, fd, st, created) : -1;
+    if (number == -1) {
+        free(copy);
+        if (fd != -1)
+            close(fd);
+    }
+    return number;
+}
+
+int outdir_add_path(OutDirs *dirs, const char *path) {
+    char *copy = strdup(path);
+    int number = copy != NULL ? outdir_add(dirs, copy, -1, NULL, false) : -1;
+    if (number == -1)
+        free(copy);
+    return number;
+}
+
+void outdir_close(OutDirs *dirs, int dir) {
+    OutDir *outDir = &dirs->dirs[dir];
+    int fd = outDir->fd;
+    if (fd == -1 && outDir->restore)
+        fd = open(outDir->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd != -1 && outDir->restore)
+        restore_attributes(fd, &outDir->stat);
+    outDir->restore = false;
+    if (fd != -1)
+        close(fd);
+    if (outDir->fd != -1)
+        dirs->open--;
+    outDir->fd = -1;
+}
+
+void outdirs_free(OutDirs *dirs) {
+    // Restoring the times of a directory after its subdirectories keeps them
+    for (size_t i = dirs->count; i > 0; i--) {
+        outdir_close(dirs, i - 1);
+        free(dirs->dirs[i - 1].path);
+    }
+    free(dirs->dirs);
+    outdirs_init(dirs);
+}
+
+// Function to build the n-th candidate name of a file: the name itself, then
+// "name(N).ext" with the suffix before the extension
+static int suffixed_name(const char *name, int suffix, char *candidate) {
+    const char *dot = strrchr(name, '.');
+    if (dot == name)
+        dot = NULL;     // Hidden file without an extension
+    int n;
+    if (suffix == 0)
+        n = snprintf(candidate, PATH_MAX, "%s", name);
+    else if (dot)
+        n = snprintf(candidate, PATH_MAX, "%.*s(%d)%s", (int)(dot - name), name, suffix, dot);
+    else
+        n = snprintf(candidate, PATH_MAX, "%s(%d)", name, suffix);
+    return n < PATH_MAX ? 0 : -1;
+}
+
+int output_create(const OutDirs *dirs, int dir, const char *name, char *filePath) {
+    for (int suffix = 0;; suffix++) {
+        char candidate[PATH_MAX], buffer[PATH_MAX];
+        const char *atName;
+        int dirFd;
+        if (suffixed_name(name, suffix, candidate) == -1 ||
+            (dirFd = outdir_at(dirs, dir, candidate, buffer, &atName)) == -1 ||
+            outdir_join(dirs, dir, candidate, filePath) == -1) {
+            fprintf(stderr, "Path too long: %s\n", name);
+            return -1;
+        }
+        // Created for the owner only until its status is restored
+        int fd = openat(dirFd, atName, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        if (fd != -1 || errno != EEXIST) {
+            if (fd == -1)
+                perror("open");
+            return fd;
+        }
+    }
+}
+
+int output_link(const OutDirs *dirs, int dir, const char *name, const char *target) {
+    for (int suffix = 0;; suffix++) {
+        char candidate[PATH_MAX], buffer[PATH_MAX];
+        const char *atName;
+        int dirFd;
+        if (suffixed_name(name, suffix, candidate) == -1 ||
+            (dirFd = outdir_at(dirs, dir, candidate, buffer, &atName)) == -1) {
+            fprintf(stderr, "Path too long: %s\n", name);
+            return -1;
+        }
+        if (linkat(AT_FDCWD, target, dirFd, atName, 0) == 0)
+            return 0;
+        if (errno != EEXIST) {
+            perror("link");
+            return -1;
+        }
+    }
+}
+
+void output_preallocate(int fd, off_t size) {
+    // Filesystems without fallocate just allocate the blocks as they are written
+    if (size >= OUTPUT_PREALLOC_MIN)
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size);
+}
+
+void restore_attributes(int fd, const struct stat *st) {
+    // Only root can give files away; other users keep owning what they extract
+    if (geteuid() == 0 && fchown(fd, st->st_uid, st->st_gid) == -1)
+        perror("fchown");
+    // After the owner, whose change clears the set-user-ID and set-group-ID bits
+    if (fchmod(fd, st->st_mode & 07777) == -1)
+        perror("fchmod");
+    struct timespec times[2] = {st->st_atim, st->st_mtim};
+    if (futimens(fd, times) == -1)
+        perror("futimens");
+}
+
+void output_finish(int fd, const struct stat *st) {
+    restore_attributes(fd, st);
+
+    // The data is not read again: start writing it back and let the kernel drop it
+    if (st->st_size >= OUTPUT_DONTNEED_MIN)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
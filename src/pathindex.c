@@ -0,0 +1,240 @@
+#include "pathindex.h"
+#include "meta.h"
+
+struct path_index {
+    uint64_t count;
+    const unsigned char *offsets;   // Parts of the index, in the mapped metadata section
+    const unsigned char *slots;
+    const char *paths;
+    uint64_t pathsSize;
+};
+
+// Path of an entry while the index is built
+typedef struct {
+    const char *path;
+    uint64_t entry;
+} IndexPath;
+
+// Function to encode the header of an index
+static void put_header(unsigned char *out, const PathIndexHeader *header) {
+    memcpy(out, header->magic, sizeof(header->magic));
+    meta_store_le(out + 4, header->reserved, 4);
+    meta_store_le(out + 8, header->count, 8);
+    meta_store_le(out + 16, header->paths_size, 8);
+}
+
+static void get_header(const unsigned char *data, PathIndexHeader *header) {
+    memcpy(header->magic, data, sizeof(header->magic));
+    header->reserved = meta_load_le(data + 4, 4);
+    header->count = meta_load_le(data + 8, 8);
+    header->paths_size = meta_load_le(data + 16, 8);
+}
+
+// Function to encode a slot of an index
+static void put_slot(unsigned char *out, const PathIndexSlot *slot) {
+    meta_store_le(out, slot->path_offset, 8);
+    meta_store_le(out + 8, slot->path_length, 4);
+    meta_store_le(out + 12, slot->reserved, 4);
+    meta_store_le(out + 16, slot->entry, 8);
+}
+
+static void get_slot(const unsigned char *data, PathIndexSlot *slot) {
+    slot->path_offset = meta_load_le(data, 8);
+    slot->path_length = meta_load_le(data + 8, 4);
+    slot->reserved = meta_load_le(data + 12, 4);
+    slot->entry = meta_load_le(data + 16, 8);
+}
+
+static int compare_index_paths(const void *a, const void *b) {
+    return strcmp(((const IndexPath *)a)->path, ((const IndexPath *)b)->path);
+}
+
+unsigned char *path_index_build(const EntryTable *entries, const uint64_t *recordOffsets, uint64_t count, size_t *size) {
+    // Collect the paths of the entries stored in the table, in table order
+    IndexPath *paths = malloc((count > 0 ? count : 1) * sizeof(IndexPath));
+    if (paths == NULL)
+        return NULL;
+    uint64_t n = 0;
+    uint64_t pathsSize = 0;
+    for (size_t i = 0; i < entries->count && n < count; i++) {
+        const MyzNode *entry = &entries->entries[i];
+        if (!meta_stored(entry))
+            continue;
+        paths[n].path = entry->path;
+        paths[n].entry = n;
+        pathsSize += strlen(entry->path);
+        n++;
+    }
+    qsort(paths, n, sizeof(IndexPath), compare_index_paths);
+
+    // Header, record offsets, slots and paths
+    size_t offsetsSize = (n + 1) * 8;
+    size_t total = PATH_INDEX_HEADER_SIZE + offsetsSize + n * PATH_INDEX_SLOT_SIZE + pathsSize;
+    unsigned char *out = malloc(total);
+    if (out == NULL) {
+        free(paths);
+        return NULL;
+    }
+
+    PathIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PATH_INDEX_MAGIC, sizeof(header.magic));
+    header.count = n;
+    header.paths_size = pathsSize;
+    put_header(out, &header);
+    for (uint64_t i = 0; i <= n; i++)
+        meta_store_le(out + PATH_INDEX_HEADER_SIZE + i * 8, recordOffsets[i], 8);
+
+    // Paths are laid out in sorted order, so a binary search touches nearby bytes
+    unsigned char *slots = out + PATH_INDEX_HEADER_SIZE + offsetsSize;
+    char *pathData = (char *)(slots + n * PATH_INDEX_SLOT_SIZE);
+    uint64_t pathOffset = 0;
+    for (uint64_t i = 0; i < n; i++) {
+        size_t length = strlen(paths[i].path);
+        PathIndexSlot slot = {pathOffset, length, 0, paths[i].entry};
+        put_slot(slots + i * PATH_INDEX_SLOT_SIZE, &slot);
+        memcpy(pathData + pathOffset, paths[i].path, length);
+        pathOffset += length;
+    }
+    free(paths);
+
+    *size = total;
+    return out;
+}
+
+PathIndex path_index_open(const unsigned char *data, size_t size, uint64_t count) {
+    PathIndexHeader header;
+    if (size < PATH_INDEX_HEADER_SIZE)
+        return NULL;
+    get_header(data, &header);
+    if (memcmp(header.magic, PATH_INDEX_MAGIC, sizeof(header.magic)) != 0 || header.count != count)
+        return NULL;
+
+    // The parts of the index must fill the rest of the metadata section
+    uint64_t rest = size - PATH_INDEX_HEADER_SIZE;
+    if (header.count > rest / (8 + PATH_INDEX_SLOT_SIZE) ||
+        (header.count + 1) * 8 + header.count * PATH_INDEX_SLOT_SIZE + header.paths_size != rest)
+        return NULL;
+
+    PathIndex index = malloc(sizeof(*index));
+    if (index == NULL)
+        return NULL;
+    index->count = header.count;
+    index->offsets = data + PATH_INDEX_HEADER_SIZE;
+    index->slots = index->offsets + (header.count + 1) * 8;
+    index->paths = (const char *)(index->slots + header.count * PATH_INDEX_SLOT_SIZE);
+    index->pathsSize = header.paths_size;
+    return index;
+}
+
+int path_index_slot(PathIndex index, uint64_t i, uint64_t *number, const char **path, uint32_t *length) {
+    // The index is not aligned in the archive, so slots are decoded from their bytes
+    PathIndexSlot slot;
+    if (i >= index->count)
+        return -1;
+    get_slot(index->slots + i * PATH_INDEX_SLOT_SIZE, &slot);
+    if (slot.path_length >= MAX_PATH_LEN || slot.path_offset > index->pathsSize ||
+        slot.path_length > index->pathsSize - slot.path_offset || slot.entry >= index->count)
+        return -1;
+    *number = slot.entry;
+    if (path != NULL) {
+        *path = index->paths + slot.path_offset;
+        *length = slot.path_length;
+    }
+    return 0;
+}
+
+// Function to compare the path of a slot with a null terminated key, like strcmp
+static int compare_slot(PathIndex index, uint64_t i, const char *key, int *result) {
+    uint64_t number;
+    const char *path;
+    uint32_t length;
+    if (path_index_slot(index, i, &number, &path, &length) == -1)
+        return -1;
+    size_t keyLength = strlen(key);
+    int cmp = memcmp(path, key, length < keyLength ? length : keyLength);
+    if (cmp == 0)
+        cmp = length < keyLength ? -1 : length > keyLength;
+    *result = cmp;
+    return 0;
+}
+
+// Function to find the first slot whose path is not less than key (or greater than
+// key if after is set), by binary search
+static int lower_bound(PathIndex index, const char *key, bool after, uint64_t *result) {
+    uint64_t low = 0, high = index->count;
+    while (low < high) {
+        uint64_t mid = low + (high - low) / 2;
+        int cmp;
+        if (compare_slot(index, mid, key, &cmp) == -1)
+            return -1;
+        if (cmp < 0 || (after && cmp == 0))
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    *result = low;
+    return 0;
+}
+
+int path_index_find(PathIndex index, const char *path, uint64_t *first, uint64_t *last) {
+    if (lower_bound(index, path, false, first) == -1 || lower_bound(index, path, true, last) == -1)
+        return -1;
+    return 0;
+}
+
+int path_index_prefix(PathIndex index, const char *prefix, size_t length, uint64_t *first, uint64_t *last) {
+    // Every path that starts with the prefix sorts between the prefix and the prefix
+    // with its last byte incremented. Bytes that cannot be incremented are dropped
+    char key[MAX_PATH_LEN + 1];
+    if (length > MAX_PATH_LEN) {
+        *first = *last = 0;
+        return 0;
+    }
+    memcpy(key, prefix, length);
+    key[length] = '\0';
+    if (lower_bound(index, key, false, first) == -1)
+        return -1;
+    while (length > 0 && (unsigned char)key[length - 1] == 0xff)
+        length--;
+    if (length == 0) {
+        *last = index->count;
+        return 0;
+    }
+    key[length - 1]++;
+    key[length] = '\0';
+    return lower_bound(index, key, false, last);
+}
+
+int path_index_descendants(PathIndex index, const char *path, uint64_t *first, uint64_t *last) {
+    char key[MAX_PATH_LEN + 1];
+    size_t length = strlen(path);
+    if (length >= MAX_PATH_LEN) {
+        *first = *last = 0;
+        return 0;
+    }
+    memcpy(key, path, length);
+    key[length] = '/';
+    return path_index_prefix(index, key, length + 1, first, last);
+}
+
+int path_index_number(PathIndex index, uint64_t i, uint64_t *number) {
+    return path_index_slot(index, i, number, NULL, NULL);
+}
+
+int path_index_record(PathIndex index, uint64_t number, uint64_t *offset, uint64_t *size) {
+    uint64_t offsets[2];
+    if (number >= index->count)
+        return -1;
+    offsets[0] = meta_load_le(index->offsets + number * 8, 8);
+    offsets[1] = meta_load_le(index->offsets + (number + 1) * 8, 8);
+    if (offsets[0] > offsets[1])
+        return -1;
+    *offset = offsets[0];
+    *size = offsets[1] - offsets[0];
+    return 0;
+}
+
+void path_index_close(PathIndex index) {
+    free(index);
+}
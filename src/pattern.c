@@ -0,0 +1,189 @@
+#include "pattern.h"
+#include <fnmatch.h>
+
+#define PATTERN_WILDCARDS "*?[\\"
+
+// Node of the trie of the literal prefixes, reached by the bytes of its prefix
+typedef struct {
+    unsigned char byte;     // Last byte of the prefix
+    int child;              // First node one byte longer, or -1
+    int next;               // Next node with the same parent, or -1
+    int exact;              // First exact path equal to the prefix, or -1
+    int globs;              // First pattern whose literal prefix this is, or -1
+} PatternNode;
+
+// A request of the list
+typedef struct {
+    char *text;             // Pattern to match, "*" added after a trailing '/'
+    size_t prefixLength;    // Bytes before the first wildcard
+    bool glob;              // Not an exact path
+    bool prefixOnly;        // Matches every path that starts with the prefix
+    int nextGlob;           // Next pattern with the same literal prefix, or -1
+} PatternRequest;
+
+struct pattern_set {
+    PatternNode *nodes;     // Node 0 is the empty prefix
+    int count;
+    int capacity;
+    PatternRequest *requests;
+    int numRequests;
+};
+
+// Function to find the node one byte longer than node, or add it. Returns -1 if out of memory
+static int pattern_child(PatternSet set, int node, unsigned char byte, bool add) {
+    int child;
+    for (child = set->nodes[node].child; child != -1; child = set->nodes[child].next) {
+        if (set->nodes[child].byte == byte)
+            return child;
+    }
+    if (!add)
+        return -1;
+    if (set->count == set->capacity) {
+        int capacity = set->capacity * 2;
+        PatternNode *grown = realloc(set->nodes, capacity * sizeof(PatternNode));
+        if (grown == NULL)
+            return -1;
+        set->nodes = grown;
+        set->capacity = capacity;
+    }
+    child = set->count++;
+    set->nodes[child] = (PatternNode){byte, -1, set->nodes[node].child, -1, -1};
+    set->nodes[node].child = child;
+    return child;
+}
+
+// Function to add a request to the trie
+static int pattern_add(PatternSet set, int request) {
+    PatternRequest *req = &set->requests[request];
+    int node = 0;
+    for (size_t i = 0; i < req->prefixLength && node != -1; i++)
+        node = pattern_child(set, node, (unsigned char)req->text[i], true);
+    if (node == -1)
+        return -1;
+
+    PatternNode *found = &set->nodes[node];
+    if (!req->glob) {
+        if (found->exact == -1)
+            found->exact = request;
+        return 0;
+    }
+    // Patterns with the same prefix are kept in list order
+    int *last = &found->globs;
+    while (*last != -1)
+        last = &set->requests[*last].nextGlob;
+    *last = request;
+    return 0;
+}
+
+PatternSet pattern_set_create(char **fileList) {
+    int numRequests = 0;
+    while (fileList[numRequests] != NULL)
+        numRequests++;
+
+    PatternSet set = calloc(1, sizeof(struct pattern_set));
+    if (set == NULL)
+        return NULL;
+    set->capacity = 256;
+    set->nodes = malloc(set->capacity * sizeof(PatternNode));
+    set->requests = calloc(numRequests > 0 ? numRequests : 1, sizeof(PatternRequest));
+    if (set->nodes == NULL || set->requests == NULL) {
+        pattern_set_destroy(set);
+        return NULL;
+    }
+    set->nodes[0] = (PatternNode){0, -1, -1, -1, -1};
+    set->count = 1;
+
+    for (int i = 0; i < numRequests; i++) {
+        const char *text = fileList[i];
+        size_t length = strlen(text);
+        bool directory = length > 0 && text[length - 1] == '/';
+        PatternRequest *req = &set->requests[i];
+        req->text = malloc(length + 2);
+        set->numRequests = i + 1;
+        if (req->text == NULL) {
+            pattern_set_destroy(set);
+            return NULL;
+        }
+        memcpy(req->text, text, length);
+        strcpy(req->text + length, directory ? "*" : "");
+
+        req->prefixLength = strcspn(req->text, PATTERN_WILDCARDS);
+        req->glob = req->text[req->prefixLength] != '\0';
+        req->prefixOnly = req->glob && strcmp(req->text + req->prefixLength, "*") == 0;
+        req->nextGlob = -1;
+        if (pattern_add(set, i) == -1) {
+            pattern_set_destroy(set);
+            return NULL;
+        }
+    }
+    return set;
+}
+
+bool pattern_set_matches(PatternSet set, int request, const char *path) {
+    const PatternRequest *req = &set->requests[request];
+    if (!req->glob)
+        return strcmp(req->text, path) == 0;
+    if (req->prefixOnly)
+        return strncmp(req->text, path, req->prefixLength) == 0;
+    return fnmatch(req->text, path, 0) == 0;
+}
+
+pattern_match pattern_set_match(PatternSet set, const char *path, int *request) {
+    // Only the patterns whose literal prefix starts the path are tried
+    int node = 0, glob = -1;
+    size_t i = 0;
+    while (true) {
+        for (int g = set->nodes[node].globs; g != -1; g = set->requests[g].nextGlob) {
+            if ((glob == -1 || g < glob) && pattern_set_matches(set, g, path)) {
+                glob = g;
+                break;
+            }
+        }
+        if (path[i] == '\0')
+            break;
+        int child = pattern_child(set, node, (unsigned char)path[i], false);
+        if (child == -1)
+            break;
+        node = child;
+        i++;
+    }
+
+    if (path[i] == '\0' && set->nodes[node].exact != -1) {
+        *request = set->nodes[node].exact;
+        return PATTERN_EXACT;
+    }
+    *request = glob;
+    return glob != -1 ? PATTERN_GLOB : PATTERN_NONE;
+}
+
+bool pattern_set_inside(PatternSet set, const char *dirPath) {
+    // Something inside may match if a pattern starts before the end of "dirPath/",
+    // or if a request goes on past it
+    int node = 0;
+    for (const char *c = dirPath;; c++) {
+        if (set->nodes[node].globs != -1)
+            return true;
+        node = pattern_child(set, node, *c != '\0' ? (unsigned char)*c : '/', false);
+        if (node == -1)
+            return false;
+        if (*c == '\0')
+            return true;
+    }
+}
+
+bool pattern_set_prefix(PatternSet set, int request, const char **prefix, size_t *length) {
+    const PatternRequest *req = &set->requests[request];
+    *prefix = req->text;
+    *length = req->prefixLength;
+    return req->glob;
+}
+
+void pattern_set_destroy(PatternSet set) {
+    if (set == NULL)
+        return;
+    for (int i = 0; i < set->numRequests; i++)
+        free(set->requests[i].text);
+    free(set->requests);
+    free(set->nodes);
+    free(set);
+}
@@ -0,0 +1,368 @@
+#include "reader.h"
+#include <sys/mman.h>
+
+bool archive_is_stream(const MyzHeader *header) {
+    return memcmp(header->magic, MYZ_STREAM_MAGIC, sizeof(header->magic)) == 0 ||
+           memcmp(header->magic, MYZ_STREAM_MAGIC_V2, sizeof(header->magic)) == 0;
+}
+
+bool archive_is_compact(const MyzHeader *header) {
+    return memcmp(header->magic, MYZ_MAGIC_V2, sizeof(header->magic)) == 0 ||
+           memcmp(header->magic, MYZ_STREAM_MAGIC_V2, sizeof(header->magic)) == 0;
+}
+
+off_t archive_metadata_end(const MyzHeader *header) {
+    off_t end = header->total_bytes;
+    if (archive_is_stream(header))
+        end -= sizeof(MyzFooter);
+    return end;
+}
+
+// Function to copy a string into a buffer of size bytes, truncating it. Unlike strncpy
+// the rest of the buffer is not cleared. Returns the length of the copy
+static size_t copy_bounded(char *dest, const char *src, size_t size) {
+    size_t length = strnlen(src, size - 1);
+    memcpy(dest, src, length);
+    dest[length] = '\0';
+    return length;
+}
+
+// Node of the first release, before nodes had a data size and extra metadata. The
+// metadata section holds one per file and directory, nothing else
+typedef struct {
+    struct stat stat;       // Size of the stored data for compressed files
+    char name[MAX_NAME_LEN];
+    char path[MAX_PATH_LEN];
+    myz_node_type type;
+    off_t data_offset;
+    bool compressed;        // Stored as a gzip file, named with a ".gz" suffix
+    int dirContents;        // Also counts the entries that were not stored
+} MyzBaselineNode;
+
+// Function to check a node of the first release: it must be a file or a directory
+// whose strings end inside it and whose data is in the data section
+static bool baseline_node_valid(const MyzBaselineNode *node, const MyzHeader *header) {
+    if (memchr(node->name, '\0', MAX_NAME_LEN) == NULL || memchr(node->path, '\0', MAX_PATH_LEN) == NULL ||
+        *(const unsigned char *)&node->compressed > 1)
+        return false;
+    if (node->type == MYZ_NODE_TYPE_DIR)
+        return node->dirContents >= 0;
+    return node->type == MYZ_NODE_TYPE_FILE && node->dirContents == -1 && node->stat.st_size >= 0 &&
+           node->data_offset >= (off_t)sizeof(MyzHeader) &&
+           node->stat.st_size <= (off_t)header->metadata_offset - node->data_offset;
+}
+
+// Function to report a corrupt metadata section and free what was set up
+static int reader_fail(ArchiveReader *reader, const char *message) {
+    fprintf(stderr, "%s\n", message);
+    reader_close(reader);
+    return -1;
+}
+
+int reader_open(ArchiveReader *reader, int fd, const MyzHeader *header) {
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = fd;
+    reader->header = *header;
+    reader->compact = archive_is_compact(header);
+
+    // The whole metadata section must be in the file, or touching it would fault
+    off_t start = header->metadata_offset;
+    off_t end = archive_metadata_end(header);
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        return reader_fail(reader, "Cannot read the archive");
+    }
+    if (end < start || start < (off_t)sizeof(MyzHeader) || end > st.st_size)
+        return reader_fail(reader, "Truncated metadata section");
+    reader->size = end - start;
+
+    // Map the section from the page that holds its start
+    if (reader->size > 0) {
+        off_t mapStart = start & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+        reader->mapSize = end - mapStart;
+        void *map = mmap(NULL, reader->mapSize, PROT_READ, MAP_PRIVATE, fd, mapStart);
+        if (map == MAP_FAILED) {
+            perror("mmap");
+            return reader_fail(reader, "Cannot read the metadata section");
+        }
+        reader->map = map;
+        reader->data = reader->map + (start - mapStart);
+    }
+    // "MYZ" is the magic of the first release, whose section holds one node per entry.
+    // Version 1 stream archives have their own magic and nodes with extra metadata
+    if (!reader->compact) {
+        reader->baseline = !archive_is_stream(header);
+        if (reader->baseline && reader->size % sizeof(MyzBaselineNode) != 0)
+            return reader_fail(reader, "Corrupt metadata section");
+        reader->counted = !reader->baseline;
+        reader->count = reader->baseline ? reader->size / sizeof(MyzBaselineNode) : 0;
+        return 0;
+    }
+
+    // Version 2: the table, then the path index
+    size_t want = reader->size < META_TABLE_HEADER_MAX ? reader->size : META_TABLE_HEADER_MAX;
+    if (meta_read_table_header(reader->data, want, &reader->table) == -1 ||
+        reader->table.stored_size > reader->size - reader->table.header_size)
+        return reader_fail(reader, "Corrupt metadata section");
+    reader->count = reader->table.count;
+    size_t tableSize = reader->table.header_size + reader->table.stored_size;
+    if (tableSize < reader->size)
+        reader->index = path_index_open(reader->data + tableSize, reader->size - tableSize, reader->table.count);
+    return 0;
+}
+
+void reader_close(ArchiveReader *reader) {
+    path_index_close(reader->index);
+    free(reader->inflated);
+    if (reader->map != NULL)
+        munmap(reader->map, reader->mapSize);
+    if (reader->fd != -1)
+        close(reader->fd);
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = -1;
+}
+
+// Function to get the body of the table, inflating it the first time if it is compressed
+static const unsigned char *reader_body(ArchiveReader *reader) {
+    if (reader->body == NULL) {
+        const unsigned char *stored = reader->data + reader->table.header_size;
+        if (reader->table.flags & META_TABLE_COMPRESSED) {
+            reader->inflated = meta_inflate_body(&reader->table, stored);
+            reader->body = reader->inflated;
+        } else {
+            reader->body = stored;
+        }
+    }
+    return reader->body;
+}
+
+void reader_begin(ArchiveReader *reader, ArchiveCursor *cursor) {
+    memset(cursor, 0, sizeof(*cursor));
+    cursor->reader = reader;
+    meta_parents_init(&cursor->parents);
+    if (!reader->compact) {
+        cursor->pos = reader->data;
+        cursor->end = reader->data + reader->size;
+        return;
+    }
+
+    // Records follow the string table, which must end with a terminated string
+    const unsigned char *body = reader_body(reader);
+    const MetaTableHeader *table = &reader->table;
+    if (body == NULL || (table->strings_size > 0 && body[table->strings_size - 1] != '\0')) {
+        cursor->corrupt = true;
+        return;
+    }
+    cursor->pos = body + table->strings_size;
+    cursor->end = body + table->body_size;
+}
+
+// Function to keep an aligned copy of the extra metadata of the last entry, in the
+// host structs of extra.h
+static int cursor_keep_extra(ArchiveCursor *cursor, MyzNode *node) {
+    if (node->extra_size == 0) {
+        node->extra = NULL;
+        return 0;
+    }
+    if (node->extra_size > cursor->extraCapacity) {
+        unsigned char *extra = realloc(cursor->extra, node->extra_size);
+        if (extra == NULL)
+            return -1;
+        cursor->extra = extra;
+        cursor->extraCapacity = node->extra_size;
+    }
+    memcpy(cursor->extra, node->extra, node->extra_size);
+    if (cursor->reader->compact)
+        meta_extra_decode(cursor->extra, node->extra_size);
+    node->extra = cursor->extra;
+    return 0;
+}
+
+// Function to decode the next raw node of a version 1 stream archive. Its path goes
+// to the buffer of the cursor
+static int cursor_next_raw(ArchiveCursor *cursor, MyzNode *node, uint64_t *parent) {
+    if ((size_t)(cursor->end - cursor->pos) < MYZ_NODE_SIZE)
+        return -1;
+    MyzStoredNode stored;
+    memcpy(&stored, cursor->pos, MYZ_NODE_SIZE);
+    cursor->pos += MYZ_NODE_SIZE;
+    if (stored.extra_size > (size_t)(cursor->end - cursor->pos))
+        return -1;
+    memset(node, 0, sizeof(*node));
+    node->stat = stored.stat;
+    node->type = stored.type;
+    node->data_offset = stored.data_offset;
+    node->data_size = stored.data_size;
+    node->compressed = stored.compressed;
+    node->dirContents = stored.dirContents;
+    node->extra_size = stored.extra_size;
+    node->extra = (unsigned char *)cursor->pos;
+    cursor->pos += node->extra_size;
+    copy_bounded(cursor->path, stored.path, MAX_PATH_LEN);
+    node->path = cursor->path;
+    node->name = entries_name(cursor->path);
+    *parent = meta_parent(&cursor->parents, node, true);
+    return cursor_keep_extra(cursor, node);
+}
+
+// Function to make the last entry, a directory whose path has length bytes, the
+// innermost directory of the walk
+static int cursor_enter_dir(ArchiveCursor *cursor, size_t length) {
+    if (cursor->depth == cursor->capacity) {
+        int capacity = cursor->capacity ? cursor->capacity * 2 : 16;
+        void *dirs = realloc(cursor->dirs, capacity * sizeof(*cursor->dirs));
+        if (dirs == NULL)
+            return -1;
+        cursor->dirs = dirs;
+        cursor->capacity = capacity;
+    }
+    cursor->dirs[cursor->depth].number = cursor->number;
+    cursor->dirs[cursor->depth].length = length;
+    cursor->depth++;
+    return 0;
+}
+
+// Function to decode the next node of the first release. Its directories may count
+// entries that were not stored, so the parent is the last directory whose path starts
+// the path of the node
+static int cursor_next_baseline(ArchiveCursor *cursor, MyzNode *node, uint64_t *parent) {
+    MyzBaselineNode stored;
+    if ((size_t)(cursor->end - cursor->pos) < sizeof(stored))
+        return -1;
+    memcpy(&stored, cursor->pos, sizeof(stored));
+    cursor->pos += sizeof(stored);
+    if (!baseline_node_valid(&stored, &cursor->reader->header))
+        return -1;
+    memset(node, 0, sizeof(*node));
+    node->stat = stored.stat;
+    node->type = stored.type;
+    node->data_offset = stored.data_offset;
+    node->data_size = stored.type == MYZ_NODE_TYPE_FILE ? stored.stat.st_size : 0;
+    node->compressed = stored.compressed && stored.type == MYZ_NODE_TYPE_FILE;
+    node->dirContents = stored.type == MYZ_NODE_TYPE_DIR ? 0 : -1;
+    stored.path[MAX_PATH_LEN - 1] = '\0';
+
+    // Compressed files are gzip files: drop their suffix, and take the size from the
+    // gzip trailer, which holds it modulo 2^32
+    size_t length = strlen(stored.path);
+    if (node->compressed) {
+        if (length > 3 && strcmp(stored.path + length - 3, ".gz") == 0)
+            stored.path[length -= 3] = '\0';
+        unsigned char size[4];
+        if (node->data_size < 18 ||
+            pread(cursor->reader->fd, size, sizeof(size), node->data_offset + node->data_size - 4) != sizeof(size))
+            return -1;
+        node->stat.st_size = size[0] | size[1] << 8 | size[2] << 16 | (off_t)size[3] << 24;
+    }
+
+    // Leave the directories that the node is not in
+    while (cursor->depth > 0) {
+        size_t dirLength = cursor->dirs[cursor->depth - 1].length;
+        if (length > dirLength && stored.path[dirLength] == '/' && memcmp(stored.path, cursor->path, dirLength) == 0)
+            break;
+        cursor->depth--;
+    }
+    *parent = cursor->depth > 0 ? cursor->dirs[cursor->depth - 1].number + 1 : 0;
+
+    // The paths of the open directories start the path of the node, so it keeps them
+    // in the buffer of the cursor. The nodes that follow a directory may be in it
+    memcpy(cursor->path, stored.path, length + 1);
+    node->path = cursor->path;
+    node->name = entries_name(cursor->path);
+    if (node->type == MYZ_NODE_TYPE_DIR && cursor_enter_dir(cursor, length) == -1)
+        return -1;
+    return 0;
+}
+
+int reader_next(ArchiveCursor *cursor, MyzNode *node, uint64_t *parent) {
+    if (cursor->corrupt)
+        return -1;
+    if (cursor->pos == cursor->end)
+        return cursor->reader->compact && cursor->number != cursor->reader->table.count ? -1 : 0;
+    if (!cursor->reader->compact) {
+        if ((cursor->reader->baseline ? cursor_next_baseline(cursor, node, parent)
+                                       : cursor_next_raw(cursor, node, parent)) == -1)
+            return -1;
+        cursor->number++;
+        return 1;
+    }
+
+    uint64_t name;
+    const unsigned char *next = meta_decode_table_record(cursor->pos, cursor->end, node, parent, &name);
+    const MetaTableHeader *table = &cursor->reader->table;
+    if (next == NULL || name >= table->strings_size || cursor->number >= table->count)
+        return -1;
+    cursor->pos = next;
+    const char *nameString = (const char *)cursor->reader->body + name;
+
+    // Leave the directories that the entry is not in. Its own directory came
+    // before it and is still open, since the entries are in depth-first order
+    size_t length = 0;
+    if (*parent == 0) {
+        cursor->depth = 0;
+    } else {
+        while (cursor->depth > 0 && cursor->dirs[cursor->depth - 1].number + 1 != *parent)
+            cursor->depth--;
+        if (cursor->depth == 0)
+            return -1;
+        length = cursor->dirs[cursor->depth - 1].length;
+        if (length + 1 < MAX_PATH_LEN)
+            cursor->path[length++] = '/';
+    }
+
+    // Top level entries keep their whole path, the others only their name
+    node->path = cursor->path;
+    node->name = *parent != 0 ? cursor->path + length : NULL;
+    length += copy_bounded(cursor->path + length, nameString, MAX_PATH_LEN - length);
+    if (node->name == NULL)
+        node->name = entries_name(cursor->path);
+
+    // The entries that follow a directory may be in it
+    if (node->type == MYZ_NODE_TYPE_DIR && cursor_enter_dir(cursor, length) == -1)
+        return -1;
+    cursor->number++;
+    return cursor_keep_extra(cursor, node) == -1 ? -1 : 1;
+}
+
+void reader_end(ArchiveCursor *cursor) {
+    meta_parents_free(&cursor->parents);
+    free(cursor->dirs);
+    free(cursor->extra);
+    memset(cursor, 0, sizeof(*cursor));
+}
+
+int reader_entry(ArchiveReader *reader, uint64_t slot, MyzNode *node, char *path, uint64_t *number) {
+    const char *indexPath;
+    uint32_t length;
+    uint64_t offset, size;
+    const unsigned char *body = reader_body(reader);
+    if (reader->index == NULL || body == NULL ||
+        path_index_slot(reader->index, slot, number, &indexPath, &length) == -1 ||
+        path_index_record(reader->index, *number, &offset, &size) == -1 ||
+        offset > reader->table.body_size || size > reader->table.body_size - offset)
+        return -1;
+
+    // Only the record of the entry is decoded
+    uint64_t parent, name;
+    const unsigned char *record = body + offset;
+    if (meta_decode_table_record(record, record + size, node, &parent, &name) != record + size)
+        return -1;
+
+    // The path comes from the index, the name is its last part
+    memcpy(path, indexPath, length);
+    path[length] = '\0';
+    node->path = path;
+    node->name = entries_name(path);
+
+    // The caller owns the extra metadata
+    if (node->extra != NULL) {
+        unsigned char *extra = malloc(node->extra_size);
+        if (extra == NULL)
+            return -1;
+        memcpy(extra, node->extra, node->extra_size);
+        meta_extra_decode(extra, node->extra_size);
+        node->extra = extra;
+    }
+    return 0;
+}
@@ -0,0 +1,181 @@
+#include "sparse.h"
+#include "datamove.h"
+
+int sparse_scan(int fd, const struct stat *st, MyzExtent **extents, uint32_t *count) {
+    *extents = NULL;
+    *count = 0;
+
+    // A file with all its blocks allocated has no holes
+    if (st->st_size == 0 || (off_t)st->st_blocks * 512 >= st->st_size)
+        return 0;
+
+    MyzExtent *list = NULL;
+    uint32_t numExtents = 0, capacity = 0;
+    off_t pos = 0, dataSize = 0;
+    while (pos < st->st_size) {
+        off_t data = lseek(fd, pos, SEEK_DATA);
+        if (data == -1 && errno == ENXIO)
+            break;  // Only a hole until the end of the file
+        off_t hole = data == -1 ? -1 : lseek(fd, data, SEEK_HOLE);
+        if (hole == -1) {
+            // SEEK_DATA is not supported here: store the file as it is
+            free(list);
+            lseek(fd, 0, SEEK_SET);
+            return 0;
+        }
+        if (data >= st->st_size)
+            break;
+        if (hole > st->st_size)
+            hole = st->st_size;
+
+        if (numExtents == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            list = realloc(list, capacity * sizeof(MyzExtent));
+        }
+        list[numExtents++] = (MyzExtent){data, hole - data, dataSize};
+        dataSize += hole - data;
+        pos = hole;
+    }
+    lseek(fd, 0, SEEK_SET);
+
+    // One extent that covers the whole file is no hole at all
+    if (numExtents == 1 && list[0].offset == 0 && (off_t)list[0].length == st->st_size) {
+        free(list);
+        return 0;
+    }
+
+    *extents = list;
+    *count = numExtents;
+    return 1;
+}
+
+off_t sparse_data_size(const MyzExtent *extents, uint32_t count) {
+    return count > 0 ? (off_t)(extents[count - 1].data_offset + extents[count - 1].length) : 0;
+}
+
+// Function to find the extent that holds a byte of the stored data
+static uint32_t sparse_find(const MyzExtent *extents, uint32_t count, off_t dataOffset) {
+    uint32_t low = 0, high = count;
+    while (high - low > 1) {
+        uint32_t mid = low + (high - low) / 2;
+        if ((off_t)extents[mid].data_offset <= dataOffset)
+            low = mid;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+ssize_t sparse_pread(int fd, const MyzExtent *extents, uint32_t count, void *buffer, size_t size, off_t dataOffset) {
+    size_t done = 0;
+    for (uint32_t i = sparse_find(extents, count, dataOffset); i < count && done < size; i++) {
+        off_t skip = dataOffset + done - extents[i].data_offset;
+        size_t want = extents[i].length - skip;
+        if (want > size - done)
+            want = size - done;
+
+        // Read this part of the extent
+        size_t got = 0;
+        while (got < want) {
+            ssize_t n = pread(fd, (char *)buffer + done + got, want - got, extents[i].offset + skip + got);
+            if (n == -1 && errno == EINTR) continue;
+            if (n <= 0) return -1;
+            got += n;
+        }
+        done += want;
+    }
+    return done;
+}
+
+int sparse_pwrite(int fd, const MyzExtent *extents, uint32_t count, const void *buffer, size_t size, off_t dataOffset) {
+    size_t done = 0;
+    for (uint32_t i = sparse_find(extents, count, dataOffset); i < count && done < size; i++) {
+        off_t skip = dataOffset + done - extents[i].data_offset;
+        size_t want = extents[i].length - skip;
+        if (want > size - done)
+            want = size - done;
+        if (pwrite_all(fd, (const char *)buffer + done, want, extents[i].offset + skip) == -1)
+            return -1;
+        done += want;
+    }
+    return done == size ? 0 : -1;
+}
+
+// Function to get the end of the hole before extent i, which starts at the end of the previous one
+static off_t sparse_hole_start(const MyzExtent *extents, uint32_t i) {
+    return i > 0 ? (off_t)(extents[i - 1].offset + extents[i - 1].length) : 0;
+}
+
+int sparse_write(int fd, const MyzExtent *extents, uint32_t count, const void *buffer, size_t size, off_t dataOffset) {
+    size_t done = 0;
+    for (uint32_t i = sparse_find(extents, count, dataOffset); i < count && done < size; i++) {
+        off_t skip = dataOffset + done - extents[i].data_offset;
+        size_t want = extents[i].length - skip;
+        if (want > size - done)
+            want = size - done;
+        // The hole before an extent goes out right before its first byte
+        if (skip == 0 && write_zeros(fd, extents[i].offset - sparse_hole_start(extents, i)) == -1)
+            return -1;
+        if (write_all(fd, (const char *)buffer + done, want) == -1)
+            return -1;
+        done += want;
+    }
+    return done == size ? 0 : -1;
+}
+
+int sparse_write_end(int fd, const MyzExtent *extents, uint32_t count, off_t fileSize) {
+    return write_zeros(fd, fileSize - sparse_hole_start(extents, count));
+}
+
+int sparse_move(int archiveFd, off_t inOffset, int outFd, const MyzExtent *extents, uint32_t count, off_t size,
+                off_t dataOffset, bool sequential) {
+    off_t done = 0;
+    for (uint32_t i = sparse_find(extents, count, dataOffset); i < count && done < size; i++) {
+        off_t skip = dataOffset + done - extents[i].data_offset;
+        off_t want = extents[i].length - skip;
+        if (want > size - done)
+            want = size - done;
+        if (sequential) {
+            if (skip == 0 && write_zeros(outFd, extents[i].offset - sparse_hole_start(extents, i)) == -1)
+                return -1;
+        } else if (lseek(outFd, extents[i].offset + skip, SEEK_SET) == -1) {
+            perror("lseek");
+            return -1;
+        }
+        if (move_data(archiveFd, inOffset + done, outFd, want) == -1)
+            return -1;
+        done += want;
+    }
+    return done == size ? 0 : -1;
+}
+
+int sparse_pack(int fileFd, int archiveFd, const MyzExtent *extents, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (move_data(fileFd, extents[i].offset, archiveFd, extents[i].length) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+int sparse_unpack(int archiveFd, off_t inOffset, int fileFd, const MyzExtent *extents, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (lseek(fileFd, extents[i].offset, SEEK_SET) == -1) {
+            perror("lseek");
+            return -1;
+        }
+        off_t offset = inOffset == -1 ? -1 : inOffset + (off_t)extents[i].data_offset;
+        if (move_data(archiveFd, offset, fileFd, extents[i].length) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+int sparse_stream(int archiveFd, off_t inOffset, int outFd, const MyzExtent *extents, uint32_t count, off_t fileSize) {
+    for (uint32_t i = 0; i < count; i++) {
+        off_t offset = inOffset == -1 ? -1 : inOffset + (off_t)extents[i].data_offset;
+        if (write_zeros(outFd, extents[i].offset - sparse_hole_start(extents, i)) == -1 ||
+            move_data(archiveFd, offset, outFd, extents[i].length) == -1)
+            return -1;
+    }
+    return sparse_write_end(outFd, extents, count, fileSize);
+}
@@ -0,0 +1,161 @@
+#include "uring.h"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// Ring shared with the kernel, set up without liburing
+struct uring {
+    int fd;
+    unsigned depth;
+    // Submission queue
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned sqMask;
+    unsigned *sqArray;
+    struct io_uring_sqe *sqes;
+    // Completion queue
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe *cqes;
+    // Mappings
+    void *ringMap;
+    size_t ringSize;
+    size_t sqesSize;
+};
+
+static int uring_setup(unsigned depth, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, depth, params);
+}
+
+static int uring_enter(int fd, unsigned submit, unsigned minComplete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, submit, minComplete, flags, NULL, 0);
+}
+
+Uring uring_create(unsigned depth) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    // Only the thread that runs the batches uses the ring, so the kernel may run the
+    // completions when it waits. Older kernels take the ring without these hints
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    int fd = uring_setup(depth, &params);
+    if (fd == -1 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params));
+        fd = uring_setup(depth, &params);
+    }
+    if (fd == -1)
+        return NULL;
+    // One mapping for both queues, since Linux 5.4
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(fd);
+        return NULL;
+    }
+
+    Uring ring = calloc(1, sizeof(struct uring));
+    if (ring == NULL) {
+        close(fd);
+        return NULL;
+    }
+    ring->fd = fd;
+    ring->depth = params.sq_entries;
+
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ringSize = sqSize > cqSize ? sqSize : cqSize;
+    ring->ringMap = mmap(NULL, ring->ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->ringMap == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        if (ring->ringMap != MAP_FAILED)
+            munmap(ring->ringMap, ring->ringSize);
+        if (ring->sqes != MAP_FAILED)
+            munmap(ring->sqes, ring->sqesSize);
+        close(fd);
+        free(ring);
+        return NULL;
+    }
+
+    char *map = ring->ringMap;
+    ring->sqHead = (unsigned *)(map + params.sq_off.head);
+    ring->sqTail = (unsigned *)(map + params.sq_off.tail);
+    ring->sqMask = *(unsigned *)(map + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *)(map + params.sq_off.array);
+    ring->cqHead = (unsigned *)(map + params.cq_off.head);
+    ring->cqTail = (unsigned *)(map + params.cq_off.tail);
+    ring->cqMask = *(unsigned *)(map + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(map + params.cq_off.cqes);
+    return ring;
+}
+
+unsigned uring_depth(Uring ring) {
+    return ring->depth;
+}
+
+// Function to fill the submission queue entry of an operation
+static void uring_prepare(struct io_uring_sqe *sqe, const UringOp *op, size_t index) {
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = op->fd;
+    sqe->user_data = index;
+    switch (op->opcode) {
+        case URING_OPENAT:
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->addr = (uintptr_t)op->path;
+            sqe->len = op->mode;
+            sqe->open_flags = op->flags;
+            break;
+        case URING_READ:
+        case URING_WRITE:
+            sqe->opcode = op->opcode == URING_READ ? IORING_OP_READ : IORING_OP_WRITE;
+            sqe->addr = (uintptr_t)op->buffer;
+            sqe->len = op->length;
+            sqe->off = op->offset;
+            break;
+        case URING_CLOSE:
+            sqe->opcode = IORING_OP_CLOSE;
+            break;
+    }
+}
+
+int uring_run(Uring ring, UringOp *ops, size_t count) {
+    size_t queued = 0, completed = 0;
+    while (completed < count) {
+        // Queue as many operations as there are free entries
+        unsigned tail = *ring->sqTail;
+        while (queued < count && queued - completed < ring->depth) {
+            unsigned slot = tail & ring->sqMask;
+            uring_prepare(&ring->sqes[slot], &ops[queued], queued);
+            ring->sqArray[slot] = slot;
+            tail++;
+            queued++;
+        }
+        __atomic_store_n(ring->sqTail, tail, __ATOMIC_RELEASE);
+
+        // Submit them and wait for everything in flight in one call
+        unsigned toSubmit = tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+        if (uring_enter(ring->fd, toSubmit, queued - completed, IORING_ENTER_GETEVENTS) == -1 &&
+            errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            perror("io_uring_enter");
+            return -1;
+        }
+
+        unsigned head = *ring->cqHead;
+        while (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & ring->cqMask];
+            ops[cqe->user_data].result = cqe->res;
+            head++;
+            completed++;
+        }
+        __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+void uring_destroy(Uring ring) {
+    if (ring == NULL)
+        return;
+    munmap(ring->sqes, ring->sqesSize);
+    munmap(ring->ringMap, ring->ringSize);
+    close(ring->fd);
+    free(ring);
+}
@@ -1,27 +1,80 @@
 #include "utils.h"
+#include "uring.h"
 
 void print_usage() {
-    printf("Usage: myz {-c|-a|-x|-m|-d|-p|-j|-q} <archive-file> <list-of-files/dirs>\n");
+    printf("Usage: myz {-c|-a|-x|-m|-d|-p|-t|-j|-O|-q|-v|--dedup|--align|--jobs N|--uring|--queue-depth N|--from-file FILE|--punch-holes|--vacuum|--no-checksum} <archive-file> <list-of-files/dirs>\n");
+}
+
+// Path of the list and its position, to sort the paths and keep the first of equal ones
+typedef struct {
+    char *path;
+    int index;
+} SortedPath;
+
+static int compare_sorted_paths(const void *a, const void *b) {
+    const SortedPath *x = a, *y = b;
+    int cmp = strcmp(x->path, y->path);
+    return cmp != 0 ? cmp : (x->index > y->index) - (x->index < y->index);
+}
+
+// Function to check if a path is in a sorted list
+static bool sorted_paths_contain(const SortedPath *sorted, int count, const char *path) {
+    int low = 0, high = count;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        int cmp = strcmp(sorted[mid].path, path);
+        if (cmp == 0)
+            return true;
+        if (cmp < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return false;
 }
 
 char **filter_paths(char **fileList, int *numFiles) {
+    // Sort the paths once, so that each directory a path is in is found by binary search
+    SortedPath *sorted = malloc((*numFiles > 0 ? *numFiles : 1) * sizeof(SortedPath));
+    for (int i = 0; i < *numFiles; i++)
+        sorted[i] = (SortedPath){fileList[i], i};
+    qsort(sorted, *numFiles, sizeof(SortedPath), compare_sorted_paths);
+
+    // A path is dropped if it was already given, or if a directory it is in was given
     int newSize = 0;
     for (int i = 0; i < *numFiles; i++) {
-        if (fileList[i] == NULL) continue;
-        for (int j = i + 1; j < *numFiles; j++) {
-            if (fileList[j] == NULL) continue;
-            if (strstr(fileList[j], fileList[i]) == fileList[j]) {
-                free(fileList[j]);
-                fileList[j] = NULL;
-            } else if (strstr(fileList[i], fileList[j]) == fileList[i]) {
-                free(fileList[i]);
-                fileList[i] = NULL;
-                break;
-            }
+        const char *path = sorted[i].path;
+        bool nested = i > 0 && strcmp(sorted[i - 1].path, path) == 0;
+        char *prefix = strdup(path);
+        for (const char *slash = strchr(path, '/'); !nested && slash != NULL; slash = strchr(slash + 1, '/')) {
+            size_t length = slash - path;
+            if (slash[1] == '\0')
+                break;  // A trailing slash belongs to the path itself
+
+            // The directory may have been given with or without its slash
+            char next = prefix[length + 1];
+            prefix[length + 1] = '\0';
+            nested = sorted_paths_contain(sorted, *numFiles, prefix);
+            prefix[length] = '\0';
+            nested = nested || (length > 0 && sorted_paths_contain(sorted, *numFiles, prefix));
+            prefix[length] = '/';
+            prefix[length + 1] = next;
+        }
+        free(prefix);
+        if (nested) {
+            fileList[sorted[i].index] = NULL;
+        } else {
+            newSize++;
         }
-        if (fileList[i] != NULL) newSize++;
     }
 
+    // The dropped paths are freed once the searches are over
+    for (int i = 0; i < *numFiles; i++) {
+        if (fileList[sorted[i].index] == NULL)
+            free(sorted[i].path);
+    }
+    free(sorted);
+
     char **newFileList = malloc((newSize + 1) * sizeof(char *));
     int index = 0;
     for (int i = 0; i < *numFiles; i++) {
@@ -36,10 +89,77 @@ char **filter_paths(char **fileList, int *numFiles) {
     return newFileList;
 }
 
+// Function to add the lines of a file ("-" for the standard input) to a list of paths.
+// Empty lines are skipped
+static int read_path_list(const char *listFile, char ***fileList, int *numFiles) {
+    FILE *file = strcmp(listFile, "-") == 0 ? stdin : fopen(listFile, "r");
+    if (file == NULL) {
+        perror(listFile);
+        return -1;
+    }
+    int capacity = *numFiles + 1;
+    char *line = NULL;
+    size_t lineCapacity = 0;
+    ssize_t length;
+    bool failed = false;
+    while (!failed && (length = getline(&line, &lineCapacity, file)) != -1) {
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+            line[--length] = '\0';
+        if (length == 0)
+            continue;
+        if (*fileList == NULL || *numFiles + 1 >= capacity) {
+            capacity = capacity * 2 > 64 ? capacity * 2 : 64;
+            char **grown = realloc(*fileList, capacity * sizeof(char *));
+            if (grown == NULL) {
+                perror("realloc");
+                failed = true;
+                continue;
+            }
+            *fileList = grown;
+        }
+        (*fileList)[(*numFiles)++] = strdup(line);
+        (*fileList)[*numFiles] = NULL;
+    }
+    free(line);
+    if (ferror(file)) {
+        perror(listFile);
+        failed = true;
+    }
+    if (file != stdin)
+        fclose(file);
+    return failed ? -1 : 0;
+}
+
+// Values of the options that only have a long form
+enum {
+    OPT_DEDUP = 256,
+    OPT_JOBS,
+    OPT_ALIGN,
+    OPT_URING,
+    OPT_QUEUE_DEPTH,
+    OPT_FROM_FILE,
+    OPT_VACUUM,
+    OPT_PUNCH_HOLES,
+    OPT_NO_CHECKSUM
+};
+
+static const struct option long_options[] = {
+    {"dedup", no_argument, NULL, OPT_DEDUP},
+    {"jobs", required_argument, NULL, OPT_JOBS},
+    {"align", no_argument, NULL, OPT_ALIGN},
+    {"uring", no_argument, NULL, OPT_URING},
+    {"queue-depth", required_argument, NULL, OPT_QUEUE_DEPTH},
+    {"from-file", required_argument, NULL, OPT_FROM_FILE},
+    {"vacuum", no_argument, NULL, OPT_VACUUM},
+    {"punch-holes", no_argument, NULL, OPT_PUNCH_HOLES},
+    {"no-checksum", no_argument, NULL, OPT_NO_CHECKSUM},
+    {NULL, 0, NULL, 0}
+};
+
 int parse_arguments(int argc, char *argv[], CommandLineArgs *args) {
     int opt;
     // Initialize arguments
-    *args = (CommandLineArgs){false, false, false, false, false, false, false, false, NULL, NULL, 0};
+    *args = (CommandLineArgs){false, false, false, false, false, false, false, false, false, false, false, false, false, false, false, false, false, NULL, NULL, NULL, 0, 1, URING_DEFAULT_DEPTH};
 
     if (argc < 3) {
         print_usage();
@@ -47,7 +167,7 @@ int parse_arguments(int argc, char *argv[], CommandLineArgs *args) {
     }
 
     // Parse command line arguments
-    while ((opt = getopt(argc, argv, "caxmdpjq")) != -1) {
+    while ((opt = getopt_long(argc, argv, "caxmdpjqvtO", long_options, NULL)) != -1) {
         switch (opt) {
             case 'c':
                 args->create = true;
@@ -73,6 +193,57 @@ int parse_arguments(int argc, char *argv[], CommandLineArgs *args) {
             case 'j':
                 args->gzip = true;
                 break;
+            case 'v':
+                args->verbose = true;
+                break;
+            case 't':
+                args->test = true;
+                break;
+            case 'O':
+                args->toStdout = true;
+                break;
+            case OPT_DEDUP:
+                args->dedup = true;
+                break;
+            case OPT_ALIGN:
+                args->align = true;
+                break;
+            case OPT_JOBS: {
+                char *end;
+                long jobs = strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || jobs < 1 || jobs > 1024) {
+                    fprintf(stderr, "--jobs needs a number of threads from 1 to 1024\n");
+                    return 1;
+                }
+                args->jobs = (int)jobs;
+                break;
+            }
+            case OPT_URING:
+                args->uring = true;
+                break;
+            case OPT_QUEUE_DEPTH: {
+                char *end;
+                long depth = strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || depth < 1 || depth > URING_MAX_DEPTH) {
+                    fprintf(stderr, "--queue-depth needs a number of entries from 1 to %d\n", URING_MAX_DEPTH);
+                    return 1;
+                }
+                args->queueDepth = (int)depth;
+                args->uring = true;
+                break;
+            }
+            case OPT_FROM_FILE:
+                args->fromFile = optarg;
+                break;
+            case OPT_VACUUM:
+                args->vacuum = true;
+                break;
+            case OPT_PUNCH_HOLES:
+                args->punchHoles = true;
+                break;
+            case OPT_NO_CHECKSUM:
+                args->noChecksum = true;
+                break;
             default:
                 print_usage();
                 return 1;
@@ -86,6 +257,67 @@ int parse_arguments(int argc, char *argv[], CommandLineArgs *args) {
         return 1;
     }
 
+    // Validate --dedup flag
+    if (args->dedup && !(args->create || args->append)) {
+        fprintf(stderr, "--dedup requires -c or -a\n");
+        print_usage();
+        return 1;
+    }
+
+    // Validate --align flag
+    if (args->align && !(args->create || args->append)) {
+        fprintf(stderr, "--align requires -c or -a\n");
+        print_usage();
+        return 1;
+    }
+
+    // Validate --no-checksum flag
+    if (args->noChecksum && !(args->create || args->append)) {
+        fprintf(stderr, "--no-checksum requires -c or -a\n");
+        print_usage();
+        return 1;
+    }
+
+    // Validate --jobs flag
+    if (args->jobs > 1 && !args->export) {
+        fprintf(stderr, "--jobs requires -x\n");
+        print_usage();
+        return 1;
+    }
+
+    // Validate --uring flag
+    if (args->uring && !(args->create || args->append || args->export)) {
+        fprintf(stderr, "--uring requires -c, -a or -x\n");
+        print_usage();
+        return 1;
+    }
+
+    // Validate -O flag
+    if (args->toStdout && !args->export) {
+        fprintf(stderr, "-O requires -x\n");
+        print_usage();
+        return 1;
+    }
+    if (args->toStdout && (args->jobs > 1 || args->uring)) {
+        fprintf(stderr, "--jobs and --uring cannot be used with -O\n");
+        print_usage();
+        return 1;
+    }
+
+    // Validate --punch-holes flag
+    if (args->punchHoles && !args->delete) {
+        fprintf(stderr, "--punch-holes requires -d\n");
+        print_usage();
+        return 1;
+    }
+
+    // Validate --from-file flag
+    if (args->fromFile != NULL && !args->export) {
+        fprintf(stderr, "--from-file requires -x\n");
+        print_usage();
+        return 1;
+    }
+
     // Check if the archive file is provided
     if (optind < argc) {
         args->archiveFile = argv[optind];
@@ -108,6 +340,14 @@ int parse_arguments(int argc, char *argv[], CommandLineArgs *args) {
         args->numFiles = 0;
     }
 
+    // Add the paths of the list file after those of the command line
+    if (args->fromFile != NULL && strcmp(args->fromFile, "-") == 0 && strcmp(args->archiveFile, "-") == 0) {
+        fprintf(stderr, "The archive and the list file cannot both be read from the standard input\n");
+        return 1;
+    }
+    if (args->fromFile != NULL && read_path_list(args->fromFile, &args->fileList, &args->numFiles) == -1)
+        return 1;
+
     if (args->fileList != NULL) {
         // Filter paths
         args->fileList = filter_paths(args->fileList, &args->numFiles);
@@ -0,0 +1,199 @@
+#include "verify.h"
+#include "checksum.h"
+#include "compress.h"
+#include "dedup.h"
+#include "extra.h"
+#include "sparse.h"
+#include <pthread.h>
+
+typedef enum {
+    TASK_RAW,       // A range of stored data read straight from the archive
+    TASK_BLOCKS,    // A run of compressed blocks
+    TASK_CHUNKS     // The whole chunk list of a deduplicated entry
+} task_kind;
+
+// Part of the data of an entry, checked by one worker
+typedef struct {
+    size_t entry;           // Position of the entry in the table
+    task_kind kind;
+    uint64_t start;         // Byte offset of a raw range, or first block
+    uint64_t count;         // Bytes of a raw range, or number of blocks
+    uint32_t crc;           // CRC32C of the part
+    uint64_t length;        // Bytes of original data in the part
+    int error;
+} VerifyTask;
+
+// State shared by the verify threads
+typedef struct {
+    int archiveFd;
+    const EntryTable *entries;
+    VerifyTask *tasks;
+    size_t count;
+    size_t next;            // Next task to take
+} VerifyJob;
+
+// Function to compute the checksum of one part of an entry
+static int verify_task(VerifyJob *job, VerifyTask *task) {
+    const MyzNode *entry = &job->entries->entries[task->entry];
+    switch (task->kind) {
+        case TASK_RAW:
+            task->crc = 0;
+            task->length = task->count;
+            return checksum_range(job->archiveFd, entry->data_offset + task->start, task->count, &task->crc);
+        case TASK_BLOCKS:
+            return decompress_checksum(job->archiveFd, entry, task->start, task->count, &task->crc, &task->length);
+        case TASK_CHUNKS: {
+            // The chunks of a sparse file hold the data of its extents only
+            uint32_t extentCount;
+            const MyzExtent *extents = extra_extents(entry, &extentCount);
+            task->length = extents != NULL ? sparse_data_size(extents, extentCount) : entry->stat.st_size;
+            return dedup_checksum(job->archiveFd, entry, &task->crc);
+        }
+    }
+    return -1;
+}
+
+// Worker thread: take tasks until there are none left
+static void *verify_worker(void *arg) {
+    VerifyJob *job = arg;
+    while (true) {
+        size_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (i >= job->count)
+            break;
+        job->tasks[i].error = verify_task(job, &job->tasks[i]);
+    }
+    return NULL;
+}
+
+// Function to add a task to the list, growing it as needed
+static int add_task(VerifyTask **tasks, size_t *count, size_t *capacity, VerifyTask task) {
+    if (*count == *capacity) {
+        size_t newCapacity = *capacity ? *capacity * 2 : 256;
+        VerifyTask *p = realloc(*tasks, newCapacity * sizeof(VerifyTask));
+        if (p == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        *tasks = p;
+        *capacity = newCapacity;
+    }
+    (*tasks)[(*count)++] = task;
+    return 0;
+}
+
+// Function to split the data of each checksummed entry into tasks, in table order
+static int build_tasks(const EntryTable *entries, VerifyTask **tasks, size_t *count, VerifyReport *report) {
+    size_t capacity = 0;
+    *tasks = NULL;
+    *count = 0;
+    for (size_t i = 0; i < entries->count; i++) {
+        const MyzNode *entry = &entries->entries[i];
+        if (entry->type != MYZ_NODE_TYPE_FILE)
+            continue;
+        report->members++;
+        if (extra_checksum(entry) == NULL) {
+            report->unchecked++;
+            continue;
+        }
+
+        uint32_t numChunks;
+        const MyzBlockIndex *index = extra_blocks(entry);
+        VerifyTask task = {i, TASK_RAW, 0, 0, 0, 0, 0};
+        if (extra_chunks(entry, &numChunks) != NULL) {
+            task.kind = TASK_CHUNKS;
+            if (add_task(tasks, count, &capacity, task) == -1)
+                return -1;
+        } else if (index != NULL) {
+            task.kind = TASK_BLOCKS;
+            do {
+                task.count = index->count - task.start < VERIFY_BLOCKS_PER_TASK ? index->count - task.start
+                                                                                 : VERIFY_BLOCKS_PER_TASK;
+                if (add_task(tasks, count, &capacity, task) == -1)
+                    return -1;
+                task.start += task.count;
+            } while (task.start < index->count);
+        } else {
+            // Compressed data without a block index cannot be split or checked
+            // without inflating it all; the writer always adds one
+            if (entry->compressed && extra_find(entry, MYZ_EXTRA_BLOCKS, NULL) != NULL) {
+                fprintf(stderr, "verify: corrupt block index of '%s'\n", entry->path);
+                report->failed++;
+                continue;
+            }
+            if (entry->compressed) {
+                report->unchecked++;
+                continue;
+            }
+            uint64_t size = entry->data_size;
+            do {
+                task.count = size - task.start < VERIFY_RANGE_SIZE ? size - task.start : VERIFY_RANGE_SIZE;
+                if (add_task(tasks, count, &capacity, task) == -1)
+                    return -1;
+                task.start += task.count;
+            } while (task.start < size);
+        }
+    }
+    return 0;
+}
+
+int verify_entries(int archiveFd, const EntryTable *entries, int numThreads, VerifyReport *report) {
+    memset(report, 0, sizeof(*report));
+    VerifyJob job = {archiveFd, entries, NULL, 0, 0};
+    if (build_tasks(entries, &job.tasks, &job.count, report) == -1) {
+        free(job.tasks);
+        return -1;
+    }
+
+    // Check the parts on the worker threads
+    if (numThreads > (int)job.count)
+        numThreads = job.count;
+    pthread_t *threads = malloc((numThreads > 0 ? numThreads : 1) * sizeof(pthread_t));
+    int started = 0;
+    for (int i = 0; threads != NULL && i < numThreads && numThreads > 1; i++) {
+        if (pthread_create(&threads[i], NULL, verify_worker, &job) != 0)
+            break;
+        started++;
+    }
+    if (started == 0)
+        verify_worker(&job);    // One or no threads: check in this one
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    // Join the checksums of the parts of each entry, in order
+    size_t t = 0;
+    while (t < job.count) {
+        const MyzNode *entry = &entries->entries[job.tasks[t].entry];
+        uint32_t crc = 0;
+        uint64_t length = 0;
+        int error = 0;
+        for (; t < job.count && &entries->entries[job.tasks[t].entry] == entry; t++) {
+            error |= job.tasks[t].error;
+            crc = crc32c_combine(crc, job.tasks[t].crc, job.tasks[t].length);
+            length += job.tasks[t].length;
+        }
+
+        const MyzChecksum *checksum = extra_checksum(entry);
+        if (error != 0) {
+            fprintf(stderr, "verify: corrupt or unreadable data in '%s'\n", entry->path);
+            report->failed++;
+        } else if (crc != checksum->crc32c || length != checksum->size) {
+            fprintf(stderr, "verify: checksum mismatch in '%s'\n", entry->path);
+            report->failed++;
+        } else {
+            report->verified++;
+            report->bytes += length;
+        }
+    }
+
+    free(job.tasks);
+    return report->failed > 0 ? -1 : 0;
+}
+
+void verify_report(const VerifyReport *report, FILE *out) {
+    fprintf(out, "=== Verify ===\n");
+    fprintf(out, "Members: %lu\n", (unsigned long)report->members);
+    fprintf(out, "Verified: %lu (%lu bytes)\n", (unsigned long)report->verified, (unsigned long)report->bytes);
+    fprintf(out, "Without checksum: %lu\n", (unsigned long)report->unchecked);
+    fprintf(out, "Failed: %lu\n", (unsigned long)report->failed);
+}
@@ -0,0 +1,434 @@
+#include "walk.h"
+#include <pthread.h>
+#include <sys/sysmacros.h>
+
+// Fields that statx is asked for: those the metadata of an entry stores. The size,
+// blocks, link count and inode of a directory are never used, so they are not asked for
+#define WALK_STATX_DIR (STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID | STATX_ATIME | STATX_MTIME | STATX_CTIME)
+#define WALK_STATX_FILE (WALK_STATX_DIR | STATX_NLINK | STATX_INO | STATX_SIZE | STATX_BLOCKS)
+
+// A directory to read, and its contents once read
+typedef struct walk_dir WalkDir;
+struct walk_dir {
+    char *path;
+    int fd;                 // Opened relative to the parent directory, or -1 to open by path
+    MyzNode *children;      // Entries of the directory, in readdir order
+    size_t *names;          // Position of the name of each child in strings
+    char *strings;          // Names of the children, one after the other
+    size_t stringsSize;
+    size_t stringsCapacity;
+    WalkDir **subdirs;      // Contents of each child that is a directory, or NULL
+    int count;
+    int capacity;
+};
+
+// Directories waiting to be read by one thread. The owner works at the bottom
+// (newest first, for locality), thieves take from the top (oldest, largest subtrees)
+typedef struct {
+    WalkDir **items;
+    int top;
+    int bottom;
+    int capacity;
+    pthread_mutex_t lock;
+} WalkDeque;
+
+typedef struct {
+    WalkDeque *deques;
+    int numThreads;
+    bool gzip;
+    int openDirs;           // Queued directories that hold a descriptor
+    pthread_mutex_t lock;
+    pthread_cond_t wake;    // New directories were queued, or the walk is over
+    long pending;           // Directories queued or being read
+    unsigned long pushes;   // Number of directories queued so far
+    size_t entries;         // Entries found so far
+} Walker;
+
+typedef struct {
+    Walker *walker;
+    int id;
+} WalkThread;
+
+// Counters of the traversal, updated by all walker threads
+static struct {
+    unsigned long dirs;         // Directories read
+    unsigned long entries;      // Entries returned by getdents64
+    unsigned long getdents;     // getdents64 calls
+    unsigned long statx;        // statx calls
+    unsigned long statxDirs;    // statx calls of directories, without the file fields
+    unsigned long fstatat;      // fstatat calls, where statx is not available
+    unsigned long statsSkipped; // Special files skipped by their d_type, without a stat
+    unsigned long lookups;      // Lookups of one name relative to a directory descriptor
+} walk_stats;
+
+// Cleared once statx fails with ENOSYS, so that the walk falls back to fstatat
+static int walk_use_statx = 1;
+
+#define WALK_COUNT(field, n) __atomic_fetch_add(&walk_stats.field, (n), __ATOMIC_RELAXED)
+
+// Function to queue a directory on the deque of a thread
+static void walk_push(Walker *walker, int id, WalkDir *dir) {
+    WalkDeque *deque = &walker->deques[id];
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom == deque->capacity) {
+        // Reuse the space before the top, or grow
+        int count = deque->bottom - deque->top;
+        if (deque->top > deque->capacity / 2) {
+            memmove(deque->items, deque->items + deque->top, count * sizeof(WalkDir *));
+        } else {
+            deque->capacity = deque->capacity ? deque->capacity * 2 : 64;
+            WalkDir **items = malloc(deque->capacity * sizeof(WalkDir *));
+            if (count > 0)
+                memcpy(items, deque->items + deque->top, count * sizeof(WalkDir *));
+            free(deque->items);
+            deque->items = items;
+        }
+        deque->top = 0;
+        deque->bottom = count;
+    }
+    deque->items[deque->bottom++] = dir;
+    pthread_mutex_unlock(&deque->lock);
+
+    pthread_mutex_lock(&walker->lock);
+    walker->pending++;
+    walker->pushes++;
+    pthread_cond_signal(&walker->wake);
+    pthread_mutex_unlock(&walker->lock);
+}
+
+// Function to take a directory from a deque: the newest for its owner, the oldest for a thief
+static WalkDir *walk_take(WalkDeque *deque, bool owner) {
+    WalkDir *dir = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->top < deque->bottom)
+        dir = owner ? deque->items[--deque->bottom] : deque->items[deque->top++];
+    pthread_mutex_unlock(&deque->lock);
+    return dir;
+}
+
+// Function to create a directory to be read
+static WalkDir *walk_dir_create(const char *path) {
+    WalkDir *dir = calloc(1, sizeof(WalkDir));
+    dir->path = strdup(path);
+    dir->fd = -1;
+    return dir;
+}
+
+// Function to open a subdirectory relative to its parent, if the limit of open
+// directories allows it. Otherwise it is opened by path when it is read
+static void walk_open_subdir(Walker *walker, int parentFd, const char *name, WalkDir *subdir) {
+    if (__atomic_add_fetch(&walker->openDirs, 1, __ATOMIC_RELAXED) > WALK_MAX_OPEN_DIRS) {
+        __atomic_fetch_sub(&walker->openDirs, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    subdir->fd = openat(parentFd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (subdir->fd == -1)
+        __atomic_fetch_sub(&walker->openDirs, 1, __ATOMIC_RELAXED);
+    else
+        WALK_COUNT(lookups, 1);
+}
+
+// Function to get the status of an entry of a directory, without following a symlink.
+// statx is asked only for the fields the archive stores, and for fewer when d_type
+// says the entry is a directory; the fields it did not fill are left at zero
+static int walk_stat(int dirFd, const char *name, unsigned char type, struct stat *st) {
+    if (__atomic_load_n(&walk_use_statx, __ATOMIC_RELAXED)) {
+        unsigned int mask = type == DT_DIR ? WALK_STATX_DIR : WALK_STATX_FILE;
+        struct statx stx;
+        WALK_COUNT(statx, 1);
+        WALK_COUNT(statxDirs, type == DT_DIR);
+        if (statx(dirFd, name, AT_SYMLINK_NOFOLLOW, mask, &stx) == 0) {
+            memset(st, 0, sizeof(*st));
+            st->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+            st->st_mode = stx.stx_mode;
+            st->st_uid = stx.stx_uid;
+            st->st_gid = stx.stx_gid;
+            st->st_atim.tv_sec = stx.stx_atime.tv_sec;
+            st->st_atim.tv_nsec = stx.stx_atime.tv_nsec;
+            st->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+            st->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+            st->st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+            st->st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+            if (stx.stx_mask & STATX_NLINK)
+                st->st_nlink = stx.stx_nlink;
+            if (stx.stx_mask & STATX_INO)
+                st->st_ino = stx.stx_ino;
+            if (stx.stx_mask & STATX_SIZE)
+                st->st_size = stx.stx_size;
+            if (stx.stx_mask & STATX_BLOCKS)
+                st->st_blocks = stx.stx_blocks;
+            return 0;
+        }
+        if (errno != ENOSYS)
+            return -1;
+        __atomic_store_n(&walk_use_statx, 0, __ATOMIC_RELAXED);
+    }
+    WALK_COUNT(fstatat, 1);
+    return fstatat(dirFd, name, st, AT_SYMLINK_NOFOLLOW);
+}
+
+// Function to read one directory: a node for each entry, and a queued walk for each
+// subdirectory. Entries are read in bulk with getdents64 and looked up relative to
+// the directory descriptor; the stat is skipped when d_type already rules an entry out
+static void walk_read_dir(Walker *walker, int id, WalkDir *dir, char *buffer) {
+    // Open the directory, unless its parent already did
+    int fd = dir->fd;
+    if (fd == -1) {
+        fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1) {
+            perror("open");
+            return;
+        }
+    }
+    WALK_COUNT(dirs, 1);
+
+    // Process each file and directory in the directory
+    ssize_t n;
+    while (true) {
+        n = getdents64(fd, buffer, WALK_DENTS_BUFFER_SIZE);
+        WALK_COUNT(getdents, 1);
+        if (n <= 0)
+            break;
+        for (ssize_t pos = 0; pos < n; ) {
+            struct dirent64 *entry = (struct dirent64 *)(buffer + pos);
+            pos += entry->d_reclen;
+
+            // Skip the current and parent directories
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+                continue;
+            WALK_COUNT(entries, 1);
+
+            // Devices, pipes and sockets have no data that can be archived
+            unsigned char type = entry->d_type;
+            if (type != DT_UNKNOWN && type != DT_DIR && type != DT_REG && type != DT_LNK) {
+                WALK_COUNT(statsSkipped, 1);
+                fprintf(stderr, "Skipping special file '%s/%s'\n", dir->path, entry->d_name);
+                continue;
+            }
+
+            // Get file information
+            struct stat st;
+            WALK_COUNT(lookups, 1);
+            if (walk_stat(fd, entry->d_name, type, &st) == -1) {
+                perror("stat");
+                continue;
+            }
+            if (!S_ISDIR(st.st_mode) && !S_ISLNK(st.st_mode) && !S_ISREG(st.st_mode)) {
+                fprintf(stderr, "Skipping special file '%s/%s'\n", dir->path, entry->d_name);
+                continue;
+            }
+
+            // Add a node to the contents of the directory. They are kept in one array,
+            // and their names in another; the paths are made when they go to the table
+            if (dir->count == dir->capacity) {
+                dir->capacity = dir->capacity ? dir->capacity * 2 : 16;
+                dir->children = realloc(dir->children, dir->capacity * sizeof(MyzNode));
+                dir->subdirs = realloc(dir->subdirs, dir->capacity * sizeof(WalkDir *));
+                dir->names = realloc(dir->names, dir->capacity * sizeof(size_t));
+            }
+            size_t nameLength = strlen(entry->d_name) + 1;
+            if (dir->stringsCapacity - dir->stringsSize < nameLength) {
+                while (dir->stringsCapacity - dir->stringsSize < nameLength)
+                    dir->stringsCapacity = dir->stringsCapacity ? dir->stringsCapacity * 2 : 1024;
+                dir->strings = realloc(dir->strings, dir->stringsCapacity);
+            }
+            dir->names[dir->count] = dir->stringsSize;
+            memcpy(dir->strings + dir->stringsSize, entry->d_name, nameLength);
+            dir->stringsSize += nameLength;
+            MyzNode *node = &dir->children[dir->count];
+            memset(node, 0, sizeof(MyzNode)); // Initialize memory to zero
+            node->stat = st;
+            // Files with several links are told apart when the archive is written
+            node->type = S_ISDIR(st.st_mode) ? MYZ_NODE_TYPE_DIR : 
+                          S_ISLNK(st.st_mode) ? MYZ_NODE_TYPE_SYMLINK : MYZ_NODE_TYPE_FILE;
+            node->data_offset = 0;    // This will be set later
+            node->compressed = walker->gzip && node->type == MYZ_NODE_TYPE_FILE;
+            node->dirContents = (node->type == MYZ_NODE_TYPE_DIR) ? 0 : -1;
+            dir->subdirs[dir->count] = NULL;
+
+            // Queue the subdirectory on this thread; other threads may steal it
+            if (node->type == MYZ_NODE_TYPE_DIR) {
+                char fullPath[PATH_MAX];
+                snprintf(fullPath, PATH_MAX, "%s/%s", dir->path, entry->d_name);
+                WalkDir *subdir = walk_dir_create(fullPath);
+                walk_open_subdir(walker, fd, entry->d_name, subdir);
+                dir->subdirs[dir->count] = subdir;
+                walk_push(walker, id, subdir);
+            }
+            dir->count++;
+        }
+    }
+    if (n == -1)
+        perror("getdents64");
+    __atomic_fetch_add(&walker->entries, dir->count, __ATOMIC_RELAXED);
+
+    // Close the directory
+    close(fd);
+    if (dir->fd != -1) {
+        dir->fd = -1;
+        __atomic_fetch_sub(&walker->openDirs, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Walker thread: read directories from its own deque, or steal them, until none are left
+static void *walk_worker(void *arg) {
+    WalkThread *thread = arg;
+    Walker *walker = thread->walker;
+    char *buffer = malloc(WALK_DENTS_BUFFER_SIZE);
+
+    while (true) {
+        pthread_mutex_lock(&walker->lock);
+        unsigned long pushes = walker->pushes;
+        pthread_mutex_unlock(&walker->lock);
+
+        WalkDir *dir = walk_take(&walker->deques[thread->id], true);
+        for (int i = 1; dir == NULL && i < walker->numThreads; i++)
+            dir = walk_take(&walker->deques[(thread->id + i) % walker->numThreads], false);
+
+        if (dir == NULL) {
+            // Nothing to take: stop when the walk is over, or wait for new directories
+            pthread_mutex_lock(&walker->lock);
+            if (walker->pending == 0) {
+                pthread_mutex_unlock(&walker->lock);
+                break;
+            }
+            if (walker->pushes == pushes)
+                pthread_cond_wait(&walker->wake, &walker->lock);
+            pthread_mutex_unlock(&walker->lock);
+            continue;
+        }
+
+        walk_read_dir(walker, thread->id, dir, buffer);
+
+        pthread_mutex_lock(&walker->lock);
+        if (--walker->pending == 0)
+            pthread_cond_broadcast(&walker->wake);
+        pthread_mutex_unlock(&walker->lock);
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+// Function to free a walked directory
+static void walk_dir_free(WalkDir *dir) {
+    free(dir->children);
+    free(dir->subdirs);
+    free(dir->names);
+    free(dir->strings);
+    free(dir->path);
+    free(dir);
+}
+
+// Function to free a walked directory and the walks of its subdirectories
+static void walk_free(WalkDir *dir) {
+    for (int i = 0; i < dir->count; i++) {
+        if (dir->subdirs[i] != NULL)
+            walk_free(dir->subdirs[i]);
+    }
+    walk_dir_free(dir);
+}
+
+// Function to append the contents of a walked directory to the table, depth first,
+// and free the walk. The table has room for all of them, and their paths go to its
+// arena. Returns the number of entries in the directory, or -1 if out of memory
+static int walk_emit(WalkDir *dir, EntryTable *table) {
+    int count = dir->count;
+    for (int i = 0; i < dir->count; i++) {
+        WalkDir *subdir = dir->subdirs[i];
+        if (count == -1) {
+            if (subdir != NULL)
+                walk_free(subdir);
+            continue;
+        }
+
+        MyzNode *node = &table->entries[table->count++];
+        *node = dir->children[i];
+        char path[MAX_PATH_LEN];
+        snprintf(path, MAX_PATH_LEN, "%s/%s", dir->path, dir->strings + dir->names[i]);
+        if (entries_set_path(table, node, path) == -1) {
+            table->count--;
+            count = -1;
+            if (subdir != NULL)
+                walk_free(subdir);
+        } else if (subdir != NULL) {
+            node->dirContents = walk_emit(subdir, table);
+            if (node->dirContents == -1)
+                count = -1;
+        }
+    }
+    walk_dir_free(dir);
+    return count;
+}
+
+int walk_tree(const char *dirPath, EntryTable *table, bool gzip, int numThreads) {
+    if (numThreads < 1)
+        numThreads = 1;
+
+    Walker walker;
+    walker.deques = calloc(numThreads, sizeof(WalkDeque));
+    walker.numThreads = numThreads;
+    walker.gzip = gzip;
+    walker.openDirs = 0;
+    walker.pending = 0;
+    walker.pushes = 0;
+    walker.entries = 0;
+    pthread_mutex_init(&walker.lock, NULL);
+    pthread_cond_init(&walker.wake, NULL);
+    for (int i = 0; i < numThreads; i++)
+        pthread_mutex_init(&walker.deques[i].lock, NULL);
+
+    WalkDir *root = walk_dir_create(dirPath);
+    walk_push(&walker, 0, root);
+
+    // This thread is walker 0
+    WalkThread *threads = malloc(numThreads * sizeof(WalkThread));
+    pthread_t *ids = malloc(numThreads * sizeof(pthread_t));
+    int started = 1;
+    for (int i = 0; i < numThreads; i++)
+        threads[i] = (WalkThread){&walker, i};
+    for (int i = 1; i < numThreads; i++) {
+        if (pthread_create(&ids[i], NULL, walk_worker, &threads[i]) != 0)
+            break;
+        started++;
+    }
+    walk_worker(&threads[0]);
+    for (int i = 1; i < started; i++)
+        pthread_join(ids[i], NULL);
+
+    for (int i = 0; i < numThreads; i++) {
+        free(walker.deques[i].items);
+        pthread_mutex_destroy(&walker.deques[i].lock);
+    }
+    free(walker.deques);
+    free(threads);
+    free(ids);
+    pthread_mutex_destroy(&walker.lock);
+    pthread_cond_destroy(&walker.wake);
+
+    // Put the nodes in the order of a sequential walk, after growing the table once
+    if (entries_reserve(table, walker.entries) == -1) {
+        walk_free(root);
+        return -1;
+    }
+    return walk_emit(root, table);
+}
+
+int walk_default_threads(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus > 0 ? (int)cpus * WALK_THREADS_PER_CPU : 1;
+    return threads < WALK_MIN_THREADS ? WALK_MIN_THREADS : threads;
+}
+
+void walk_report(FILE *out) {
+    fprintf(out, "=== Traversal ===\n");
+    fprintf(out, "Directories: %lu\n", walk_stats.dirs);
+    fprintf(out, "Entries: %lu\n", walk_stats.entries);
+    fprintf(out, "getdents64 calls: %lu\n", walk_stats.getdents);
+    fprintf(out, "statx calls: %lu (%lu directories without size, blocks, links or inode)\n", walk_stats.statx,
+            walk_stats.statxDirs);
+    fprintf(out, "fstatat calls: %lu\n", walk_stats.fstatat);
+    // Every entry that is archived needs its status: only the skipped ones save a call
+    fprintf(out, "Stat calls saved by d_type: %lu of %lu entries\n", walk_stats.statsSkipped, walk_stats.entries);
+    fprintf(out, "Lookups relative to a directory descriptor: %lu\n", walk_stats.lookups);
+}
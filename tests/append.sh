@@ -0,0 +1,65 @@
+#!/bin/sh
+# Append to regular and stream archives. The data of the entries already in the
+# archive must survive, even when their original files are gone, and a failed
+# append must leave the archive as it was and fail the command
+MYZ=${MYZ:-$(pwd)/myz}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK" || exit 1
+failed=0
+
+fail() {
+    echo "FAIL: $1"
+    failed=1
+}
+
+# Function to extract an archive into a new directory and compare a file with its copy
+check_file() {
+    rm -rf out
+    mkdir out
+    (cd out && "$MYZ" -x "../$1") || fail "$1: extract"
+    cmp -s "$2" "out/$3" || fail "$1: $3"
+}
+
+mkdir old new big
+printf 'old data\n' > old/a.txt
+seq 1 2000 > old/b.txt
+printf 'new data\n' > new/c.txt
+head -c 2000000 /dev/urandom > big/large.bin
+cp old/a.txt a.txt
+cp old/b.txt b.txt
+cp new/c.txt c.txt
+
+# In place: the old data stays where it is and is not read from the files again
+"$MYZ" -c plain.myz old > /dev/null || fail "plain: create"
+mv old gone
+"$MYZ" -a plain.myz new > /dev/null || fail "plain: append"
+"$MYZ" -t plain.myz > /dev/null || fail "plain: test"
+check_file plain.myz a.txt old/a.txt
+check_file plain.myz b.txt old/b.txt
+check_file plain.myz c.txt new/c.txt
+mv gone old
+
+# Stream archive: the old entries are copied from the archive itself
+"$MYZ" -c - old > stream.myz || fail "stream: create"
+mv old gone
+"$MYZ" -a stream.myz new > /dev/null || fail "stream: append"
+"$MYZ" -t stream.myz > /dev/null || fail "stream: test"
+check_file stream.myz a.txt old/a.txt
+check_file stream.myz b.txt old/b.txt
+check_file stream.myz c.txt new/c.txt
+[ -z "$(ls stream.myz.* 2> /dev/null)" ] || fail "stream: temporary archive left"
+mv gone old
+
+# Failed append: the file size limit stops the write, which must not corrupt anything
+"$MYZ" -c limit.myz old > /dev/null || fail "limit: create"
+cp limit.myz limit.orig
+if (trap '' XFSZ; ulimit -f 1000; "$MYZ" -a limit.myz big) > /dev/null 2>&1; then
+    fail "limit: append did not fail"
+fi
+cmp -s limit.myz limit.orig || fail "limit: archive changed"
+"$MYZ" -t limit.myz > /dev/null || fail "limit: test"
+check_file limit.myz b.txt old/b.txt
+
+[ $failed -eq 0 ] && echo "Append: OK"
+exit $failed
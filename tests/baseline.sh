@@ -0,0 +1,39 @@
+#!/bin/sh
+# Read the archives in tests/data, written by the first release from this tree:
+#   tree/a.txt       "hello"
+#   tree/empty/
+#   tree/sub/b.txt   the numbers 1 to 500, one per line
+# baseline.myz stores the data as it is, baseline-gzip.myz was created with -j and
+# names its top directory gztree. The nodes were written as x86-64 Linux structs
+MYZ=${MYZ:-$(pwd)/myz}
+DATA=$(cd "$(dirname "$0")/data" && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+printf 'hello\n' > "$WORK/a.txt"
+seq 1 500 > "$WORK/b.txt"
+failed=0
+
+fail() {
+    echo "FAIL: $1"
+    failed=1
+}
+
+for archive in baseline baseline-gzip; do
+    top=tree
+    [ "$archive" = baseline-gzip ] && top=gztree
+    out="$WORK/$archive"
+    mkdir "$out"
+    (cd "$out" && "$MYZ" -x "$DATA/$archive.myz") || fail "$archive: extract"
+    cmp -s "$WORK/a.txt" "$out/$top/a.txt" || fail "$archive: $top/a.txt"
+    cmp -s "$WORK/b.txt" "$out/$top/sub/b.txt" || fail "$archive: $top/sub/b.txt"
+    [ -d "$out/$top/empty" ] || fail "$archive: $top/empty"
+    [ "$(cd "$out" && find . | wc -l)" -eq 6 ] || fail "$archive: extra files"
+    "$MYZ" -q "$DATA/$archive.myz" "$top/sub/b.txt" | grep -q "found in the archive" || fail "$archive: query"
+    "$MYZ" -t "$DATA/$archive.myz" > /dev/null 2> "$WORK/test.err" || fail "$archive: test"
+    # The first release stored no checksums, which -t warns about
+    grep -q "not verified" "$WORK/test.err" || fail "$archive: unverified warning"
+    "$MYZ" -m "$DATA/$archive.myz" | grep -q "^Size: 6 bytes" || fail "$archive: size of a.txt"
+done
+
+[ $failed -eq 0 ] && echo "Baseline archives: OK"
+exit $failed
@@ -0,0 +1,69 @@
+#!/bin/sh
+# Delete from archives, punch out the unused data and vacuum them. The remaining
+# entries must extract as they were, deduplicated and sparse ones included
+MYZ=${MYZ:-$(pwd)/myz}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK" || exit 1
+failed=0
+
+fail() {
+    echo "FAIL: $1"
+    failed=1
+}
+
+# Function to extract an archive into a new directory
+extract() {
+    rm -rf out
+    mkdir out
+    (cd out && "$MYZ" -x "../$1") || fail "$1: extract"
+}
+
+# Function to print the KiB allocated to a file
+blocks() {
+    du -k "$1" | cut -f 1
+}
+
+mkdir tree tree/keep tree/drop
+seq 1 3000 > tree/keep/a.txt
+head -c 1000000 /dev/urandom > tree/drop/b.bin
+cp tree/drop/b.bin tree/keep/copy.bin
+# A sparse file: 8 MiB with data in two places
+truncate -s 8M tree/keep/sparse
+printf 'start' | dd of=tree/keep/sparse conv=notrunc 2> /dev/null
+head -c 100000 /dev/urandom | dd of=tree/keep/sparse bs=4096 seek=1000 conv=notrunc 2> /dev/null
+
+# Delete with --punch-holes: the data of the deleted entries is freed
+"$MYZ" -c punch.myz tree > /dev/null || fail "punch: create"
+before=$(blocks punch.myz)
+"$MYZ" -d --punch-holes punch.myz tree/drop | grep -q "^Punched [1-9]" || fail "punch: nothing punched"
+[ "$(blocks punch.myz)" -lt "$before" ] || fail "punch: no blocks freed"
+"$MYZ" -t punch.myz > /dev/null || fail "punch: test"
+extract punch.myz
+[ -e out/tree/drop ] && fail "punch: deleted entry extracted"
+cmp -s tree/keep/a.txt out/tree/keep/a.txt || fail "punch: tree/keep/a.txt"
+cmp -s tree/keep/copy.bin out/tree/keep/copy.bin || fail "punch: tree/keep/copy.bin"
+cmp -s tree/keep/sparse out/tree/keep/sparse || fail "punch: tree/keep/sparse"
+
+# Deleting every entry punches out all the data
+"$MYZ" -d --punch-holes punch.myz tree | grep -q "^Punched [1-9]" || fail "punch: all entries"
+[ -z "$("$MYZ" -p punch.myz | sed 1d)" ] || fail "punch: entries left"
+
+# Vacuum of a deduplicated archive: the shared chunks of the files that are left are
+# copied to the new archive, and the sparse file keeps its holes on extraction
+"$MYZ" -c --dedup vacuum.myz tree > /dev/null || fail "vacuum: create"
+"$MYZ" -d vacuum.myz tree/drop > /dev/null || fail "vacuum: delete"
+size=$(wc -c < vacuum.myz)
+"$MYZ" --vacuum vacuum.myz > /dev/null || fail "vacuum: vacuum"
+[ "$(wc -c < vacuum.myz)" -lt "$size" ] || fail "vacuum: not smaller"
+"$MYZ" -t vacuum.myz > /dev/null || fail "vacuum: test"
+extract vacuum.myz
+[ -e out/tree/drop ] && fail "vacuum: deleted entry extracted"
+cmp -s tree/keep/a.txt out/tree/keep/a.txt || fail "vacuum: tree/keep/a.txt"
+cmp -s tree/keep/copy.bin out/tree/keep/copy.bin || fail "vacuum: tree/keep/copy.bin"
+cmp -s tree/keep/sparse out/tree/keep/sparse || fail "vacuum: tree/keep/sparse"
+[ "$(blocks out/tree/keep/sparse)" -lt 4096 ] || fail "vacuum: holes of tree/keep/sparse filled"
+"$MYZ" -x -O vacuum.myz tree/keep/sparse | cmp -s - tree/keep/sparse || fail "vacuum: sparse file to stdout"
+
+[ $failed -eq 0 ] && echo "Delete and vacuum: OK"
+exit $failed